@@ -0,0 +1,147 @@
+/*
+ * Benchmark of the packing of fixed-type arrays: the generated pack
+ * functions append the whole array with dbus_message_iter_append_fixed_array,
+ * they are compared to the former per element loop of
+ * dbus_message_iter_append_basic calls for several array sizes.
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fr_sise_bench.h"
+
+/* Bytes packed per size and method, spread over as many messages as
+   needed */
+#define BENCH_BYTES (8 * 1024 * 1024)
+
+/* Pack function, fixed or per element */
+typedef int (*pack_fcn_t)(DBusMessageIter *iter, void *array, int len);
+
+static int pack_bytes(DBusMessageIter *iter, void *array, int len)
+{
+	return cdbus_pack_fr_sise_bench_Bytes_bytes_array(iter, array, len);
+}
+
+static int pack_ints(DBusMessageIter *iter, void *array, int len)
+{
+	return cdbus_pack_fr_sise_bench_Ints_ints_array(iter, array, len);
+}
+
+static int pack_doubles(DBusMessageIter *iter, void *array, int len)
+{
+	return cdbus_pack_fr_sise_bench_Doubles_doubles_array(iter, array, len);
+}
+
+struct bench_type_t {
+	const char *name;
+	int type;
+	const char *signature;
+	size_t size;
+	pack_fcn_t fixed;
+};
+
+/* What the generated code did before the fixed-type arrays were packed
+   with a single call */
+static int pack_per_element(DBusMessageIter *iter, int type,
+			const char *signature, size_t size, char *array, int len)
+{
+	DBusMessageIter sub_iter;
+	int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, signature, &sub_iter);
+	for (i = 0 ; i < len ; i++)
+		dbus_message_iter_append_basic(&sub_iter, type, array + i * size);
+	dbus_message_iter_close_container(iter, &sub_iter);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Throughput in MB/s of packing nb arrays of len elements in a new message
+   each */
+static double bench_pack(struct bench_type_t *bench, char *array, int len,
+			int nb, int fixed)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter;
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0 ; i < nb ; i++) {
+		msg = dbus_message_new_method_call("fr.sise.bench", "/fr/sise/bench",
+						"fr.sise.bench", bench->name);
+		if (!msg)
+			exit(1);
+		dbus_message_iter_init_append(msg, &iter);
+		if (fixed)
+			bench->fixed(&iter, array, len);
+		else
+			pack_per_element(&iter, bench->type, bench->signature,
+					bench->size, array, len);
+		dbus_message_unref(msg);
+	}
+
+	return (double)len * bench->size * nb / (now() - start) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	static const int lengths[] = { 16, 256, 4096, 65536, 1048576 };
+	struct bench_type_t benches[] = {
+		{ "Bytes", DBUS_TYPE_BYTE, "y", 1, pack_bytes },
+		{ "Ints", DBUS_TYPE_INT32, "i", 4, pack_ints },
+		{ "Doubles", DBUS_TYPE_DOUBLE, "d", 8, pack_doubles },
+	};
+	char *array;
+	int nb;
+	int b, l;
+
+	array = malloc(lengths[4] * sizeof(double));
+	if (!array)
+		return 1;
+	memset(array, 0x5a, lengths[4] * sizeof(double));
+
+	printf("%-8s %8s %16s %16s\n", "type", "length", "fixed (MB/s)",
+		"per elt (MB/s)");
+	for (b = 0 ; b < sizeof(benches) / sizeof(benches[0]) ; b++) {
+		for (l = 0 ; l < sizeof(lengths) / sizeof(lengths[0]) ; l++) {
+			nb = BENCH_BYTES / (lengths[l] * benches[b].size);
+			if (!nb)
+				nb = 1;
+			printf("%-8s %8d %16.0f %16.0f\n", benches[b].name,
+				lengths[l],
+				bench_pack(&benches[b], array, lengths[l], nb, 1),
+				bench_pack(&benches[b], array, lengths[l], nb, 0));
+		}
+	}
+
+	free(array);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Benchmark of the signal subscription lookup: N subscriptions are
+ * registered, each on its own path, and signal_lookup is timed on signals
+ * matching them. The same lookup without an interface falls back to a scan
+ * of the subscriptions, as every signal used to be looked up, and gives
+ * the reference time.
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include "libcdbus.c"
+
+#define BENCH_ITF "fr.sise.bench"
+#define NB_LOOKUPS 100000
+
+static struct cdbus_arg_entry_t no_args[] = {
+	{ NULL, 0, NULL },
+};
+
+static struct cdbus_message_entry_t bench_members[] = {
+	{ 0, "Sig", NULL, no_args, NULL },
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t bench_table[] = {
+	{ BENCH_ITF, bench_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Signals on the paths of the subscriptions, with or without an interface */
+static DBusMessage ** bench_messages(int nb, int with_interface)
+{
+	DBusMessage ** msgs;
+	char path[32];
+	int i;
+
+	msgs = malloc(sizeof(*msgs) * nb);
+	if (!msgs)
+		return NULL;
+	for (i = 0 ; i < nb ; i++) {
+		snprintf(path, sizeof(path), "/bench/%d", rand() % nb);
+		msgs[i] = dbus_message_new(DBUS_MESSAGE_TYPE_SIGNAL);
+		if (!msgs[i])
+			exit(1);
+		dbus_message_set_path(msgs[i], path);
+		dbus_message_set_member(msgs[i], "Sig");
+		dbus_message_set_sender(msgs[i], ":1.1");
+		if (with_interface)
+			dbus_message_set_interface(msgs[i], BENCH_ITF);
+	}
+
+	return msgs;
+}
+
+/* Mean time of a lookup in ns, or -1 if a signal is not matched */
+static double bench_lookup(struct cdbus_context_t * ctx, DBusConnection * cnx,
+			DBusMessage ** msgs, int nb_msgs, int nb_lookups)
+{
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0 ; i < nb_lookups ; i++) {
+		if (!signal_lookup(ctx, cnx, msgs[i % nb_msgs]))
+			return -1;
+	}
+
+	return (now() - start) * 1e9 / nb_lookups;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1, 10, 100, 1000, 10000 };
+	struct cdbus_user_data_t user_data = { bench_table, NULL };
+	struct cdbus_context_t * ctx;
+	DBusConnection * cnx;
+	DBusMessage ** indexed;
+	DBusMessage ** scanned;
+	char path[32];
+	int nb_lookups;
+	int n, i;
+
+	if (!getenv("DBUS_SESSION_BUS_ADDRESS")) {
+		fprintf(stderr, "run it with dbus-run-session -- %s\n", argv[0]);
+		return 1;
+	}
+
+	ctx = cdbus_context_new();
+	if (!ctx)
+		return 1;
+	cnx = cdbus_context_get_connection(ctx, DBUS_BUS_SESSION);
+	if (!cnx)
+		return 1;
+
+	printf("%8s %12s %12s\n", "subs", "index (ns)", "scan (ns)");
+	for (n = 0 ; n < sizeof(sizes) / sizeof(sizes[0]) ; n++) {
+		for (i = 0 ; i < sizes[n] ; i++) {
+			snprintf(path, sizeof(path), "/bench/%d", i);
+			if (cdbus_register_signals(cnx, NULL, path, &user_data) < 0)
+				return 1;
+		}
+		dbus_connection_flush(cnx);
+
+		srand(1);
+		indexed = bench_messages(sizes[n], 1);
+		scanned = bench_messages(sizes[n], 0);
+		if (!indexed || !scanned)
+			return 1;
+
+		/* The scans are shortened so that each size takes a while */
+		nb_lookups = NB_LOOKUPS / (sizes[n] > 100 ? sizes[n] / 100 : 1);
+		printf("%8d %12.0f %12.0f\n", sizes[n],
+			bench_lookup(ctx, cnx, indexed, sizes[n], NB_LOOKUPS),
+			bench_lookup(ctx, cnx, scanned, sizes[n], nb_lookups));
+
+		for (i = 0 ; i < sizes[n] ; i++) {
+			dbus_message_unref(indexed[i]);
+			dbus_message_unref(scanned[i]);
+			snprintf(path, sizeof(path), "/bench/%d", i);
+			cdbus_unregister_signals(cnx, NULL, path);
+		}
+		free(indexed);
+		free(scanned);
+	}
+
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	cdbus_context_free(ctx);
+
+	return 0;
+}
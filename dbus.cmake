@@ -9,7 +9,7 @@ endif($ENV{DBUS_SESSION_BUS})
 macro(add_cdbus_object SRCS OBJECT XML)
 string(REPLACE "/" "_" _object ${OBJECT})
 add_custom_command(OUTPUT ${_object}.c ${_object}.h
-			   COMMAND ${PROJECT_SOURCE_DIR}/xml2cdbus.py ${XML}
+			   COMMAND ${PROJECT_SOURCE_DIR}/xml2cdbus.py ${ARGN} ${XML}
 			   DEPENDS ${PROJECT_SOURCE_DIR}/xml2cdbus.py ${XML})
 list(APPEND ${SRCS} ${_object}.c)
 endmacro(add_cdbus_object)
@@ -0,0 +1,234 @@
+/*
+ * A chained hash table implementation with multi-thread support
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+#include "config.h"
+
+#define HASH_MIN_SIZE 16
+
+/* The number of buckets is kept a power of two, at least as big as the
+   number of items */
+static int __hash_resize(struct hash_t *table, int size)
+{
+	struct hash_item_t **buckets;
+	struct hash_item_t ***tails;
+	struct hash_item_t *item, *next;
+	int i;
+
+	buckets = malloc(sizeof(*buckets) * size);
+	if (!buckets)
+		return -1;
+	memset(buckets, 0, sizeof(*buckets) * size);
+
+	/* The items are appended to their new bucket, so that the ones
+	   sharing a hash value keep their insertion order */
+	tails = malloc(sizeof(*tails) * size);
+	if (!tails) {
+		free(buckets);
+		return -1;
+	}
+	for (i = 0 ; i < size ; i++)
+		tails[i] = &buckets[i];
+
+	for (i = 0 ; i < table->size ; i++) {
+		for (item = table->buckets[i] ; item ; item = next) {
+			next = item->next;
+			item->next = NULL;
+			*tails[item->hash & (size - 1)] = item;
+			tails[item->hash & (size - 1)] = &item->next;
+		}
+	}
+	free(tails);
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+	return 0;
+}
+
+int __hash_get_nb(struct hash_t *table)
+{
+	return table->nb;
+}
+
+int __hash_add(struct hash_t *table, struct hash_item_t *item, unsigned int hash)
+{
+	struct hash_item_t **bucket;
+
+	if (!table || !item)
+		return -1;
+	if (item->table)
+		return -1;
+
+	if (table->nb >= table->size) {
+		if (__hash_resize(table, table->size ? table->size * 2 : HASH_MIN_SIZE) < 0)
+			return -1;
+	}
+
+	/* Items are appended so that items sharing a hash value are walked
+	   in insertion order */
+	bucket = &table->buckets[hash & (table->size - 1)];
+	while (*bucket)
+		bucket = &(*bucket)->next;
+
+	item->hash = hash;
+	item->next = NULL;
+	item->table = table;
+	*bucket = item;
+	table->nb++;
+	return 0;
+}
+
+int __hash_rem_item(struct hash_item_t *item)
+{
+	struct hash_t *table;
+	struct hash_item_t **bucket;
+
+	if (!item)
+		return -1;
+
+	table = item->table;
+	if (!table)
+		return -1;
+
+	bucket = &table->buckets[item->hash & (table->size - 1)];
+	while (*bucket && (*bucket != item))
+		bucket = &(*bucket)->next;
+
+	if (!*bucket)
+		return -1;
+
+	*bucket = item->next;
+	table->nb--;
+
+	item->next = NULL;
+	item->table = NULL;
+
+	return 0;
+}
+
+struct hash_item_t* __hash_get_first(struct hash_t *table, unsigned int hash)
+{
+	struct hash_item_t *item;
+
+	if (!table || !table->nb)
+		return NULL;
+
+	for (item = table->buckets[hash & (table->size - 1)] ; item ; item = item->next) {
+		if (item->hash == hash)
+			return item;
+	}
+
+	return NULL;
+}
+
+struct hash_item_t* __hash_get_next(struct hash_item_t *item)
+{
+	unsigned int hash;
+
+	if (!item)
+		return NULL;
+
+	hash = item->hash;
+	for (item = item->next ; item ; item = item->next) {
+		if (item->hash == hash)
+			return item;
+	}
+
+	return NULL;
+}
+
+int hash_lock(struct hash_t *table)
+{
+	if (!table)
+		return -1;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_lock(&table->lock);
+#endif
+#ifdef LIBUTILS_IRQ_LOCK
+	irq_disable();
+#endif
+	return 0;
+}
+
+int hash_unlock(struct hash_t *table)
+{
+	if (!table)
+		return -1;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_unlock(&table->lock);
+#endif
+#ifdef LIBUTILS_IRQ_LOCK
+	irq_enable();
+#endif
+	return 0;
+}
+
+int hash_get_nb(struct hash_t *table)
+{
+	int ret;
+	if (hash_lock(table) < 0)
+		return -1;
+
+	ret = __hash_get_nb(table);
+	hash_unlock(table);
+	return ret;
+}
+
+int hash_add(struct hash_t *table, struct hash_item_t *item, unsigned int hash)
+{
+	int ret;
+	if (hash_lock(table) < 0)
+		return -1;
+
+	ret = __hash_add(table, item, hash);
+	hash_unlock(table);
+	return ret;
+}
+
+int hash_rem_item(struct hash_item_t *item)
+{
+	int ret;
+	struct hash_t * table = item->table;
+	if (hash_lock(table) < 0)
+		return -1;
+
+	ret = __hash_rem_item(item);
+	hash_unlock(table);
+	return ret;
+}
+
+void hash_free(struct hash_t *table)
+{
+	if (hash_lock(table) < 0)
+		return;
+
+	free(table->buckets);
+	table->buckets = NULL;
+	table->nb = table->size = 0;
+	hash_unlock(table);
+}
@@ -0,0 +1,110 @@
+/*
+ * A chained hash table implementation with multi-thread support
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "macro.h"
+
+struct hash_t;
+
+/* The table only stores the hash value, comparing the keys of the items
+   sharing a hash value is left to the caller */
+struct hash_item_t {
+	unsigned int hash;
+	struct hash_item_t *next;
+	struct hash_t *table;
+};
+
+struct hash_t {
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_t lock;
+#endif
+	struct hash_item_t **buckets;
+	int nb;
+	int size;
+};
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+#define DECLARE_HASH_INIT(table)				       \
+	struct hash_t (table) = { .buckets = NULL,		       \
+				  .nb = 0,			       \
+				  .size = 0,			       \
+				  .lock = PTHREAD_MUTEX_INITIALIZER    \
+	}
+#define HASH_INIT(table) do {				\
+		(table).buckets = NULL;			\
+		(table).nb = (table).size = 0;		\
+		pthread_mutex_init(&(table).lock, NULL); \
+	} while(0)
+
+#else
+#define DECLARE_HASH_INIT(table)				       \
+	struct hash_t (table) = { .buckets = NULL,		       \
+				  .nb = 0,			       \
+				  .size = 0			       \
+	}
+#define HASH_INIT(table) do {				\
+		(table).buckets = NULL;			\
+		(table).nb = (table).size = 0;		\
+	} while(0)
+#endif
+
+#define HASH_ITEM_INIT(item) do {				\
+		(item).hash = 0;				\
+		(item).next = NULL;				\
+		(item).table = NULL;				\
+	} while(0)
+
+/* Iterate over the items whose hash value is hash */
+#define __for_each_hash_item(table, hashval, hash_item, member, ptr)	\
+  for ((hash_item) = __hash_get_first(table, hashval),			\
+	 (ptr) = (hash_item) ? container_of((hash_item), typeof(*(ptr)), member) : NULL ; \
+       (ptr) ;								\
+       (hash_item) = __hash_get_next(hash_item),			\
+	 (ptr) = (hash_item) ? container_of((hash_item), typeof(*(ptr)), member) : NULL)
+
+#define hash_item_get_table(item) ((item)->table)
+
+int hash_get_nb(struct hash_t *table);
+int hash_add(struct hash_t *table, struct hash_item_t *item, unsigned int hash);
+int hash_rem_item(struct hash_item_t *item);
+
+void hash_free(struct hash_t *table);
+
+int hash_lock(struct hash_t *table);
+int hash_unlock(struct hash_t *table);
+
+
+/* Following functions must only be called if the table is locked */
+
+int __hash_get_nb(struct hash_t *table);
+int __hash_add(struct hash_t *table, struct hash_item_t *item, unsigned int hash);
+int __hash_rem_item(struct hash_item_t *item);
+struct hash_item_t* __hash_get_first(struct hash_t *table, unsigned int hash);
+struct hash_item_t* __hash_get_next(struct hash_item_t *item);
+
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * A binary min-heap implementation with multi-thread support
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include "heap.h"
+#include "config.h"
+
+#define HEAP_MIN_SIZE 16
+
+static void __heap_set(struct heap_t *heap, int index, struct heap_item_t *item)
+{
+	heap->items[index] = item;
+	item->index = index;
+}
+
+static void __heap_sift_up(struct heap_t *heap, int index)
+{
+	struct heap_item_t *item = heap->items[index];
+	int parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (heap->items[parent]->key <= item->key)
+			break;
+		__heap_set(heap, index, heap->items[parent]);
+		index = parent;
+	}
+	__heap_set(heap, index, item);
+}
+
+static void __heap_sift_down(struct heap_t *heap, int index)
+{
+	struct heap_item_t *item = heap->items[index];
+	int child;
+
+	while ((child = 2 * index + 1) < heap->nb) {
+		if ((child + 1 < heap->nb)
+			&& (heap->items[child + 1]->key < heap->items[child]->key))
+			child++;
+		if (item->key <= heap->items[child]->key)
+			break;
+		__heap_set(heap, index, heap->items[child]);
+		index = child;
+	}
+	__heap_set(heap, index, item);
+}
+
+int __heap_get_nb(struct heap_t *heap)
+{
+	return heap->nb;
+}
+
+int __heap_add(struct heap_t *heap, struct heap_item_t *item)
+{
+	struct heap_item_t **items;
+	int size;
+
+	if (!heap || !item)
+		return -1;
+	if (item->heap)
+		return -1;
+
+	if (heap->nb == heap->size) {
+		size = heap->size ? heap->size * 2 : HEAP_MIN_SIZE;
+		items = realloc(heap->items, sizeof(*items) * size);
+		if (!items)
+			return -1;
+		heap->items = items;
+		heap->size = size;
+	}
+
+	item->heap = heap;
+	heap->nb++;
+	__heap_set(heap, heap->nb - 1, item);
+	__heap_sift_up(heap, heap->nb - 1);
+	return 0;
+}
+
+int __heap_rem_item(struct heap_item_t *item)
+{
+	struct heap_t *heap;
+	struct heap_item_t *last;
+	int index;
+
+	if (!item)
+		return -1;
+
+	heap = item->heap;
+	if (!heap)
+		return -1;
+
+	index = item->index;
+	last = heap->items[heap->nb - 1];
+	heap->nb--;
+
+	if (last != item) {
+		__heap_set(heap, index, last);
+		if ((index > 0) && (heap->items[(index - 1) / 2]->key > last->key))
+			__heap_sift_up(heap, index);
+		else
+			__heap_sift_down(heap, index);
+	}
+
+	item->index = -1;
+	item->heap = NULL;
+
+	return 0;
+}
+
+struct heap_item_t* __heap_get_first(struct heap_t *heap)
+{
+	if (!heap || !heap->nb)
+		return NULL;
+
+	return heap->items[0];
+}
+
+int heap_lock(struct heap_t *heap)
+{
+	if (!heap)
+		return -1;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_lock(&heap->lock);
+#endif
+#ifdef LIBUTILS_IRQ_LOCK
+	irq_disable();
+#endif
+	return 0;
+}
+
+int heap_unlock(struct heap_t *heap)
+{
+	if (!heap)
+		return -1;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_unlock(&heap->lock);
+#endif
+#ifdef LIBUTILS_IRQ_LOCK
+	irq_enable();
+#endif
+	return 0;
+}
+
+int heap_get_nb(struct heap_t *heap)
+{
+	int ret;
+	if (heap_lock(heap) < 0)
+		return -1;
+
+	ret = __heap_get_nb(heap);
+	heap_unlock(heap);
+	return ret;
+}
+
+int heap_add(struct heap_t *heap, struct heap_item_t *item)
+{
+	int ret;
+	if (heap_lock(heap) < 0)
+		return -1;
+
+	ret = __heap_add(heap, item);
+	heap_unlock(heap);
+	return ret;
+}
+
+int heap_rem_item(struct heap_item_t *item)
+{
+	int ret;
+	struct heap_t * heap = item->heap;
+	if (heap_lock(heap) < 0)
+		return -1;
+
+	ret = __heap_rem_item(item);
+	heap_unlock(heap);
+	return ret;
+}
+
+struct heap_item_t* heap_get_first(struct heap_t *heap)
+{
+	struct heap_item_t *ret;
+	if (heap_lock(heap) < 0)
+		return NULL;
+
+	ret = __heap_get_first(heap);
+	heap_unlock(heap);
+	return ret;
+}
+
+void heap_free(struct heap_t *heap)
+{
+	if (heap_lock(heap) < 0)
+		return;
+
+	free(heap->items);
+	heap->items = NULL;
+	heap->nb = heap->size = 0;
+	heap_unlock(heap);
+}
@@ -0,0 +1,100 @@
+/*
+ * A binary min-heap implementation with multi-thread support
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "macro.h"
+
+struct heap_t;
+
+struct heap_item_t {
+	unsigned long long key;
+	int index;
+	struct heap_t *heap;
+};
+
+struct heap_t {
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_t lock;
+#endif
+	struct heap_item_t **items;
+	int nb;
+	int size;
+};
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+#define DECLARE_HEAP_INIT(heap)					       \
+	struct heap_t (heap) = { .items = NULL,			       \
+				 .nb = 0,			       \
+				 .size = 0,			       \
+				 .lock = PTHREAD_MUTEX_INITIALIZER     \
+	}
+#define HEAP_INIT(heap) do {				\
+		(heap).items = NULL;			\
+		(heap).nb = (heap).size = 0;		\
+		pthread_mutex_init(&(heap).lock, NULL); \
+	} while(0)
+
+#else
+#define DECLARE_HEAP_INIT(heap)					       \
+	struct heap_t (heap) = { .items = NULL,			       \
+				 .nb = 0,			       \
+				 .size = 0			       \
+	}
+#define HEAP_INIT(heap) do {				\
+		(heap).items = NULL;			\
+		(heap).nb = (heap).size = 0;		\
+	} while(0)
+#endif
+
+#define HEAP_ITEM_INIT(item) do {				\
+		(item).key = 0;					\
+		(item).index = -1;				\
+		(item).heap = NULL;				\
+	} while(0)
+
+#define heap_item_get_heap(item) ((item)->heap)
+
+int heap_get_nb(struct heap_t *heap);
+int heap_add(struct heap_t *heap, struct heap_item_t *item);
+int heap_rem_item(struct heap_item_t *item);
+struct heap_item_t* heap_get_first(struct heap_t *heap);
+
+void heap_free(struct heap_t *heap);
+
+int heap_lock(struct heap_t *heap);
+int heap_unlock(struct heap_t *heap);
+
+
+/* Following functions must only be called if the heap is locked */
+
+int __heap_get_nb(struct heap_t *heap);
+int __heap_add(struct heap_t *heap, struct heap_item_t *item);
+int __heap_rem_item(struct heap_item_t *item);
+struct heap_item_t* __heap_get_first(struct heap_t *heap);
+
+
+#endif
@@ -21,66 +21,602 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifdef CDBUS_USDT
+/* The probes of the library have semaphores, set while a tracer is
+   attached, so that their arguments are only computed when needed */
+#define _SDT_HAS_SEMAPHORES 1
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include "list.h"
+#include "heap.h"
+#include "hash.h"
 #include "libcdbus.h"
 #include "log.h"
 #include "libcdbus-version.h"
 #include "macro.h"
 
-#define EXTSTR_BUFF_SIZE 16
+#define EPOLL_MAX_EVENTS 16
+
+#define EXTSTR_BUFF_SIZE 256
+#define CDBUS_ARENA_ALIGN 16
+#define BULK_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
 #define EXTSTR_BUFFER(s) ((s)->buffer + (s)->size)
 #define EXTSTR_REM_SIZE(s) ((s)->buf_size - (s)->size)
 
+#ifdef CDBUS_USDT
+#define CDBUS_SEMAPHORE(name)						\
+	unsigned short libcdbus_##name##_semaphore			\
+	__attribute__((unused, visibility("hidden"), section(".probes")))
+#define CDBUS_PROBE_ENABLED(name) __builtin_expect(libcdbus_##name##_semaphore, 0)
+
+CDBUS_SEMAPHORE(events_begin);
+CDBUS_SEMAPHORE(events_end);
+CDBUS_SEMAPHORE(dispatch_begin);
+CDBUS_SEMAPHORE(dispatch_end);
+CDBUS_SEMAPHORE(object_dispatch);
+CDBUS_SEMAPHORE(timeouts_begin);
+CDBUS_SEMAPHORE(timeouts_end);
+#else
+#define CDBUS_PROBE_ENABLED(name) 0
+#endif
+
 struct extensible_string_t {
 	int size;
 	char * buffer;
 	int buf_size;
 };
 
+struct watch_t;
+
+/* Watches sharing the same file descriptor. libdbus uses distinct watches
+   for reading and writing on the same fd, but an fd can only be registered
+   once in an epoll instance */
+struct watch_fd_t {
+	int fd;
+	struct watch_t *watches;
+};
+
+/* The watches without DBusWatch are internal to the library (timerfd,
+   wakeup eventfd), their handler is called when the fd is readable */
 struct watch_t {
-	struct list_item_t litem;
 	DBusWatch *dbwatch;
+	void (*handle)(struct cdbus_context_t *ctx);
+	int fd;
 	DBusConnection *cnx;
+	struct cdbus_context_t *ctx;
 	struct pollfd *pollfd;
+	int slot;
+	struct watch_fd_t *wfd;
+	struct watch_t *fd_next;
+};
+
+/* The pollfd set is a persistent array of struct pollfd, one entry per
+   watch, followed by the slots reserved by the user. It is updated
+   incrementally by the watch callbacks. The generation counter is
+   incremented each time the array is moved or its layout changes. */
+struct pollfd_set_t {
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_t lock;
+#endif
+	struct pollfd *fds;
+	/* Array last handed out by cdbus_get_pollfds. When the set grows,
+	   it is retired instead of being freed: another thread may be
+	   blocked in poll on it until it fetches the new one */
+	struct pollfd *given;
+	struct pollfd *retired;
+	struct watch_t **watches;
+	int nb;
+	int reserved;
+	int size;
+	unsigned int generation;
+	/* epoll instance mirroring the set, -1 until it is requested */
+	int epoll_fd;
 };
 
 struct timeout_t;
 typedef void (*timeout_cb)(struct timeout_t *timeout, void *data);
 
+/* The timeouts are stored in a min-heap ordered by their absolute
+   deadline on the monotonic clock, in ms */
 struct timeout_t {
-	struct list_item_t ordered;
+	struct heap_item_t hitem;
 	DBusTimeout *dbtimeout;
 	DBusConnection *cnx;
+	struct cdbus_context_t *ctx;
 	int interval;
-	int value;
 	int oneshot;
 	timeout_cb cb;
 	void * cb_data;
 };
 
+/* Signal waiting in the queue of a connection until the loop sends it */
+struct queued_signal_t {
+	struct list_item_t item;
+	struct hash_item_t hitem;
+	DBusMessage *msg;
+	unsigned long long deadline;
+};
+
+/* Per-connection data, allocated once when the connection is set up */
+struct connection_t {
+	/* linked in the dispatch list while a dispatch is pending */
+	struct list_item_t dispatch_item;
+	DBusConnection *cnx;
+	struct cdbus_context_t *ctx;
+	/* Queued signals in emission order, protected by the list lock.
+	   window is the coalescing window in ms, negative when the signals
+	   are not coalesced */
+	int queue_signals;
+	int window;
+	struct list_t signal_queue;
+	/* Queued signals indexed by path, interface, member and
+	   destination, only filled when coalescing */
+	struct hash_t queue_index;
+	/* Armed on the deadline of the oldest queued signal */
+	struct timeout_t flush_timeout;
+};
+
+/* Introspection data of an object table, everything before the children
+   nodes. It is built once per table */
+struct xml_cache_t {
+	struct list_item_t item;
+	struct cdbus_interface_entry_t *table;
+	char *xml;
+	int size;
+};
+
+/* Cached value of a property, packed as a variant in a message body. NULL
+   until the property is first updated */
+struct property_value_t {
+	DBusMessage *value;
+	int changed;
+};
+
+/* Properties of an interface of an object */
+struct property_set_t {
+	struct cdbus_interface_entry_t *itf;
+	struct property_value_t *values;
+	int nb;
+	/* Body of the GetAll reply, built again after a change */
+	DBusMessage *all;
+	int changed;
+};
+
+/* Registered object. The introspection reply is cached until an object or
+   a manager is registered or unregistered at its path or below it */
+struct object_t {
+	/* linked in the object list of the context */
+	struct list_item_t item;
+	/* linked in the object index of the context when registered in a
+	   subtree */
+	struct hash_item_t hitem;
+	struct subtree_t *subtree;
+	struct cdbus_context_t *ctx;
+	struct cdbus_user_data_t *user_data;
+	char *xml;
+	int xml_stale;
+	/* Worker pools running the methods of the object */
+	struct list_t pools;
+	DBusConnection *cnx;
+	char *path;
+#ifdef LIBUTILS_PTHREAD_LOCK
+	/* Protects the properties, they may be updated by any thread */
+	pthread_mutex_t lock;
+#endif
+	struct property_set_t *props;
+	int nb_props;
+	/* Armed when a property changes, the PropertiesChanged signals are
+	   sent when it expires */
+	struct timeout_t changed_timeout;
+	/* InterfacesAdded is pending, it is sent along with the values set
+	   in the loop iteration of the registration */
+	int announce;
+	/* The registration holds a reference, the threads updating the
+	   properties hold one while they do it */
+	int refs;
+};
+
+/* The objects registered below the path of an object manager are reported
+   by GetManagedObjects. An object is managed by the closest manager above
+   it */
+struct object_manager_t {
+	struct list_item_t item;
+	DBusConnection *cnx;
+	char *path;
+};
+
+/* Fallback registered with libdbus for a path prefix. The objects
+   registered below it have no registration of their own, they are looked
+   up by path in the object index of the context */
+struct subtree_t {
+	struct list_item_t item;
+	struct cdbus_context_t *ctx;
+	DBusConnection *cnx;
+	char *path;
+};
+
+/* Path at or above some of the objects or managers of a connection, up
+   to the root. The introspection of a subtree lists the children of the
+   node of a path, GetManagedObjects walks the nodes below its manager */
+struct path_node_t {
+	/* linked in the node index of the context */
+	struct hash_item_t hitem;
+	/* linked in the children of the parent node */
+	struct list_item_t item;
+	struct list_t children;
+	struct path_node_t *parent;
+	DBusConnection *cnx;
+	/* Number of objects and managers at the path or below it */
+	int refs;
+	char *path;
+	/* Object and manager registered at the path, if any */
+	struct object_t *object;
+	struct object_manager_t *manager;
+};
+
+/* Method call handed over to a worker pool. The object is only compared,
+   its jobs are removed from the pools when it is unregistered */
+struct pool_job_t {
+	struct list_item_t item;
+	DBusConnection *cnx;
+	DBusMessage *msg;
+	struct cdbus_message_entry_t *msg_entry;
+	void *user_data;
+	struct object_t *object;
+	/* Worker running the job */
+	pthread_t thread;
+};
+
+struct cdbus_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_t jobs;
+	/* Jobs being run by the workers, done is signaled when one ends */
+	struct list_t running;
+	pthread_cond_t done;
+	pthread_t *threads;
+	int nb_threads;
+	int stop;
+};
+
+/* Pool running the methods of an object matching interface and member, a
+   NULL interface or member matches any value */
+struct pool_binding_t {
+	struct list_item_t item;
+	char *interface;
+	char *member;
+	struct cdbus_pool_t *pool;
+};
+
+/* Index entry of a signal subscription, one per interface of its table */
+struct signal_key_t {
+	struct hash_item_t item;
+	struct signal_t *signal;
+	const char *interface;
+};
+
 struct signal_t {
 	struct list_item_t item;
 	DBusConnection * cnx;
 	char * sender;
 	char * object;
 	char * match_rule;
+	/* Registration order, the earliest subscription wins when several
+	   match a signal */
+	unsigned int seq;
+	struct signal_key_t *keys;
+	int nb_keys;
 	struct cdbus_user_data_t data;
 };
 
-static DECLARE_LIST_INIT(watch_list);
-static DECLARE_LIST_INIT(timeout_ordered_list);
-static DECLARE_LIST_INIT(signal_list);
+/* The context holds the state of an event loop: the watches, the timeouts
+   and the signal subscriptions of the connections set up with it. Distinct
+   contexts share nothing, so each one can be run by its own thread */
+struct cdbus_context_t {
+	struct pollfd_set_t pollfd_set;
+	struct heap_t timeout_heap;
+	/* timerfd armed on the earliest deadline of the heap, -1 until it is
+	   requested. Protected by the heap lock */
+	int timer_fd;
+	unsigned long long timer_deadline;
+	struct watch_t timer_watch;
+	/* eventfd written when a message is queued by another thread, -1
+	   until a worker pool is used */
+	int wakeup_fd;
+	struct watch_t wakeup_watch;
+	struct list_t dispatch_list;
+	struct list_t signal_list;
+	/* Subscriptions indexed by connection, path, sender and interface. A
+	   NULL path or sender is stored as is and matches any value */
+	struct hash_t signal_index;
+	unsigned int signal_seq;
+	/* Registered objects and object managers of all the connections */
+	struct list_t object_list;
+	struct list_t manager_list;
+	/* Subtrees, they do not overlap, and the objects registered in them
+	   indexed by connection and path, as well as the nodes of their
+	   paths */
+	struct list_t subtree_list;
+	struct hash_t object_index;
+	struct hash_t node_index;
+};
+
+/* Context used by the functions without context argument */
+static struct cdbus_context_t default_context = {
+#ifdef LIBUTILS_PTHREAD_LOCK
+	.pollfd_set.lock = PTHREAD_MUTEX_INITIALIZER,
+	.timeout_heap.lock = PTHREAD_MUTEX_INITIALIZER,
+	.dispatch_list.lock = PTHREAD_MUTEX_INITIALIZER,
+	.signal_list.lock = PTHREAD_MUTEX_INITIALIZER,
+	.signal_index.lock = PTHREAD_MUTEX_INITIALIZER,
+	.object_list.lock = PTHREAD_MUTEX_INITIALIZER,
+	.manager_list.lock = PTHREAD_MUTEX_INITIALIZER,
+	.subtree_list.lock = PTHREAD_MUTEX_INITIALIZER,
+	.object_index.lock = PTHREAD_MUTEX_INITIALIZER,
+	.node_index.lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+	.pollfd_set.generation = 1,
+	.pollfd_set.epoll_fd = -1,
+	.timer_fd = -1,
+	.wakeup_fd = -1,
+};
+/* Slot of the struct connection_t in the DBusConnection */
+static dbus_int32_t connection_slot = -1;
+static DECLARE_LIST_INIT(xml_cache_list);
+
+#define CDBUS_INTERFACE_OBJECT_MANAGER "org.freedesktop.DBus.ObjectManager"
+
+/* Table of the placeholder registered at the path of an object manager
+   when no object is */
+static struct cdbus_interface_entry_t manager_table[] = {
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+static struct cdbus_user_data_t manager_user_data = { manager_table, NULL };
+
+
+/* Return the flags of a watch, 0 if it is disabled */
+static int watch_get_flags(struct watch_t *watch)
+{
+	if (!watch->dbwatch)
+		return DBUS_WATCH_READABLE;
+	if (dbus_watch_get_enabled(watch->dbwatch) == FALSE)
+		return 0;
+	return dbus_watch_get_flags(watch->dbwatch);
+}
+
+static void pollfd_set_lock(struct pollfd_set_t *set)
+{
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_lock(&set->lock);
+#endif
+}
+
+static void pollfd_set_unlock(struct pollfd_set_t *set)
+{
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_unlock(&set->lock);
+#endif
+}
+
+/* Must be called with the set locked */
+static int __pollfd_set_resize(struct pollfd_set_t *set, int nb, int reserved)
+{
+	struct pollfd *fds;
+	struct watch_t **watches;
+	int size;
+
+	if (nb + reserved <= set->size)
+		return 0;
+
+	size = set->size ? set->size : 8;
+	while (size < nb + reserved)
+		size *= 2;
+
+	watches = realloc(set->watches, sizeof(*watches) * size);
+	if (!watches)
+		return -1;
+	set->watches = watches;
+
+	/* The array is not reallocated in place, the one given to the user
+	   must stay valid until it is fetched again */
+	fds = malloc(sizeof(*fds) * size);
+	if (!fds)
+		return -1;
+	if (set->size)
+		memcpy(fds, set->fds, sizeof(*fds) * set->size);
+	memset(fds + set->size, 0, sizeof(*fds) * (size - set->size));
+	if (set->fds && (set->fds == set->given)) {
+		free(set->retired);
+		set->retired = set->fds;
+	} else {
+		free(set->fds);
+	}
+	set->fds = fds;
+	set->size = size;
+	set->generation++;
+
+	return 0;
+}
+
+/* Must be called with the set locked */
+static void __pollfd_set_update(struct pollfd_set_t *set, struct watch_t *watch)
+{
+	struct pollfd *pollfd = &set->fds[watch->slot];
+	int flags;
+
+	pollfd->fd = -1;
+	pollfd->events = 0;
+	pollfd->revents = 0;
+
+	/* poll ignores the entries with a negative fd, so a disabled
+	   watch keeps its slot */
+	flags = watch_get_flags(watch);
+	if (!flags)
+		return;
+
+	if (flags & DBUS_WATCH_READABLE)
+		pollfd->events |= POLLIN | POLLPRI;
+	if (flags & DBUS_WATCH_WRITABLE)
+		pollfd->events |= POLLOUT | POLLWRBAND;
+	pollfd->fd = watch->fd;
+}
+
+/* Must be called with the set locked. Register the fd in the epoll
+   instance with the events of all the enabled watches sharing it */
+static void __pollfd_set_epoll_sync(struct pollfd_set_t *set,
+				struct watch_fd_t *wfd)
+{
+	struct epoll_event ev;
+	struct watch_t *watch;
+	int flags;
+
+	if (set->epoll_fd < 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	for (watch = wfd->watches ; watch ; watch = watch->fd_next) {
+		flags = watch_get_flags(watch);
+		if (flags & DBUS_WATCH_READABLE)
+			ev.events |= EPOLLIN | EPOLLPRI;
+		if (flags & DBUS_WATCH_WRITABLE)
+			ev.events |= EPOLLOUT;
+	}
+
+	/* A fd without enabled watch is removed, otherwise error and
+	   hangup events would be reported continuously */
+	if (!ev.events) {
+		epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, wfd->fd, &ev);
+		return;
+	}
+
+	ev.data.ptr = wfd;
+	if ((epoll_ctl(set->epoll_fd, EPOLL_CTL_MOD, wfd->fd, &ev) < 0)
+		&& (errno == ENOENT))
+		epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, wfd->fd, &ev);
+}
+
+/* Must be called with the set locked */
+static int __pollfd_set_attach_fd(struct pollfd_set_t *set,
+				struct watch_t *watch)
+{
+	struct watch_fd_t *wfd = NULL;
+	int i;
+
+	for (i = 0 ; i < set->nb ; i++) {
+		if (set->watches[i]->wfd && (set->watches[i]->wfd->fd == watch->fd)) {
+			wfd = set->watches[i]->wfd;
+			break;
+		}
+	}
+
+	if (!wfd) {
+		wfd = malloc(sizeof(*wfd));
+		if (!wfd)
+			return -1;
+		wfd->fd = watch->fd;
+		wfd->watches = NULL;
+	}
+
+	watch->wfd = wfd;
+	watch->fd_next = wfd->watches;
+	wfd->watches = watch;
+
+	return 0;
+}
+
+/* Must be called with the set locked */
+static void __pollfd_set_detach_fd(struct pollfd_set_t *set,
+				struct watch_t *watch)
+{
+	struct watch_fd_t *wfd = watch->wfd;
+	struct watch_t **curr;
+
+	for (curr = &wfd->watches ; *curr ; curr = &(*curr)->fd_next) {
+		if (*curr == watch) {
+			*curr = watch->fd_next;
+			break;
+		}
+	}
+	watch->wfd = NULL;
+	watch->fd_next = NULL;
+
+	__pollfd_set_epoll_sync(set, wfd);
+	if (!wfd->watches)
+		free(wfd);
+}
+
+static int pollfd_set_add(struct pollfd_set_t *set, struct watch_t *watch)
+{
+	pollfd_set_lock(set);
+
+	if (__pollfd_set_resize(set, set->nb + 1, set->reserved) < 0) {
+		pollfd_set_unlock(set);
+		return -1;
+	}
+	if (__pollfd_set_attach_fd(set, watch) < 0) {
+		pollfd_set_unlock(set);
+		return -1;
+	}
+	__pollfd_set_epoll_sync(set, watch->wfd);
+
+	/* Keep the user slots right after the watch slots */
+	memmove(set->fds + set->nb + 1, set->fds + set->nb,
+		sizeof(*set->fds) * set->reserved);
+
+	watch->slot = set->nb;
+	set->watches[watch->slot] = watch;
+	set->nb++;
+	__pollfd_set_update(set, watch);
+	set->generation++;
+
+	pollfd_set_unlock(set);
+	return 0;
+}
+
+static void pollfd_set_rem(struct pollfd_set_t *set, struct watch_t *watch)
+{
+	struct watch_t *last;
+
+	pollfd_set_lock(set);
 
+	__pollfd_set_detach_fd(set, watch);
+
+	/* Move the last watch into the freed slot */
+	last = set->watches[set->nb - 1];
+	if (last != watch) {
+		set->fds[watch->slot] = set->fds[last->slot];
+		set->watches[watch->slot] = last;
+		last->slot = watch->slot;
+	}
+	set->nb--;
+	memmove(set->fds + set->nb, set->fds + set->nb + 1,
+		sizeof(*set->fds) * set->reserved);
+	set->generation++;
+
+	pollfd_set_unlock(set);
+}
 
 static dbus_bool_t add_watch(DBusWatch *dbwatch, void *data)
 {
 	struct watch_t *watch;
-	DBusConnection *cnx = (DBusConnection *)data;
+	struct connection_t *connection = data;
 
 	LOG(LOG_DEBUG, "add watch\n");
 
@@ -90,10 +626,14 @@ static dbus_bool_t add_watch(DBusWatch *dbwatch, void *data)
 	memset(watch, 0, sizeof(*watch));
 
 	watch->dbwatch = dbwatch;
-	watch->cnx = cnx;
-	if (list_add_tail(&watch_list, &watch->litem) < 0)
+	watch->fd = dbus_watch_get_unix_fd(dbwatch);
+	watch->cnx = connection->cnx;
+	watch->ctx = connection->ctx;
+	if (pollfd_set_add(&watch->ctx->pollfd_set, watch) < 0)
 		goto err_free;
 
+	dbus_watch_set_data(dbwatch, watch, NULL);
+
 	return TRUE;
 
 err_free:
@@ -104,49 +644,206 @@ err_free:
 static void rem_watch(DBusWatch *dbwatch, void *data)
 {
 	struct watch_t *watch;
-	struct list_item_t *item;
 
 	LOG(LOG_DEBUG, "rem watch\n");
 
-	list_lock(&watch_list);
-	__for_each_list_item(&watch_list, item, litem, watch) {
-		if (watch->dbwatch == dbwatch)
-			break;
-	}
-	list_unlock(&watch_list);
-
-	if (!item)
+	watch = dbus_watch_get_data(dbwatch);
+	if (!watch)
 		return;
 
-	list_rem_item(item);
+	dbus_watch_set_data(dbwatch, NULL, NULL);
+	pollfd_set_rem(&watch->ctx->pollfd_set, watch);
 	free(watch);
 }
 
-static int timeout_enable(struct timeout_t *timeout)
+static void watch_toggled(DBusWatch *dbwatch, void *data)
 {
-	struct list_item_t *item;
-	struct timeout_t *ordered_timeout;
+	struct watch_t *watch;
 
-	timeout->value = timeout->interval;
+	LOG(LOG_DEBUG, "watch toggled\n");
 
-	list_lock(&timeout_ordered_list);
-	__for_each_list_item(&timeout_ordered_list, item, ordered, ordered_timeout) {
-		if (ordered_timeout->value > timeout->value)
-			break;
+	watch = dbus_watch_get_data(dbwatch);
+	if (!watch)
+		return;
+
+	pollfd_set_lock(&watch->ctx->pollfd_set);
+	__pollfd_set_update(&watch->ctx->pollfd_set, watch);
+	__pollfd_set_epoll_sync(&watch->ctx->pollfd_set, watch->wfd);
+	pollfd_set_unlock(&watch->ctx->pollfd_set);
+}
+
+static void timer_handle(struct cdbus_context_t *ctx)
+{
+	unsigned long long expirations;
+
+	/* Clear the readable state of the timerfd, the timer is armed again
+	   by the timeout handle function. It has expired, so it must be
+	   set even if the next deadline is the same */
+	if (read(ctx->timer_fd, &expirations, sizeof(expirations)) < 0)
+		LOG(LOG_DEBUG, "timerfd read failed\n");
+	heap_lock(&ctx->timeout_heap);
+	ctx->timer_deadline = 0;
+	heap_unlock(&ctx->timeout_heap);
+
+	cdbus_context_timeout_handle(ctx);
+}
+
+static void wakeup_handle(struct cdbus_context_t *ctx)
+{
+	unsigned long long count;
+
+	/* The loop has been woken up, the watches have already been
+	   updated by the thread which queued the message */
+	if (read(ctx->wakeup_fd, &count, sizeof(count)) < 0)
+		LOG(LOG_DEBUG, "eventfd read failed\n");
+}
+
+static void wakeup_main(void *data)
+{
+	struct cdbus_context_t *ctx = data;
+	unsigned long long count = 1;
+
+	if (write(ctx->wakeup_fd, &count, sizeof(count)) < 0)
+		LOG(LOG_DEBUG, "eventfd write failed\n");
+}
+
+/* Add the wakeup eventfd to the watches of the context, so that the loop
+   thread notices the messages queued by other threads */
+static int context_enable_wakeup(struct cdbus_context_t *ctx)
+{
+	int fd;
+
+	pollfd_set_lock(&ctx->pollfd_set);
+	fd = ctx->wakeup_fd;
+	pollfd_set_unlock(&ctx->pollfd_set);
+	if (fd >= 0)
+		return 0;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	memset(&ctx->wakeup_watch, 0, sizeof(ctx->wakeup_watch));
+	ctx->wakeup_watch.fd = fd;
+	ctx->wakeup_watch.ctx = ctx;
+	ctx->wakeup_watch.handle = wakeup_handle;
+	ctx->wakeup_fd = fd;
+	if (pollfd_set_add(&ctx->pollfd_set, &ctx->wakeup_watch) < 0) {
+		ctx->wakeup_fd = -1;
+		close(fd);
+		return -1;
 	}
-	if (item)
-		__list_insert_before(&timeout->ordered, item);
-	else
-		__list_add_tail(&timeout_ordered_list, &timeout->ordered);
 
-	list_unlock(&timeout_ordered_list);
+	return 0;
+}
 
+/* Messages queued on the connection by other threads wake the loop up */
+static int connection_enable_wakeup(DBusConnection *cnx,
+				struct cdbus_context_t *ctx)
+{
+	if (context_enable_wakeup(ctx) < 0)
+		return -1;
+	dbus_connection_set_wakeup_main_function(cnx, wakeup_main, ctx, NULL);
 	return 0;
 }
 
+static void watch_handle(struct watch_t *watch, short revents)
+{
+	int flags = 0;
+
+	if (!watch->dbwatch) {
+		watch->handle(watch->ctx);
+		return;
+	}
+
+	if (dbus_watch_get_enabled(watch->dbwatch) == FALSE)
+		return;
+
+	if (revents & POLLERR)
+		flags |= DBUS_WATCH_ERROR;
+	if (revents & POLLHUP)
+		flags |= DBUS_WATCH_HANGUP;
+	if (revents & (POLLIN | POLLPRI))
+		flags |= DBUS_WATCH_READABLE;
+	if (revents & (POLLOUT | POLLWRBAND))
+		flags |= DBUS_WATCH_WRITABLE;
+	LOG(LOG_DEBUG, "watch handle\n");
+	dbus_watch_handle(watch->dbwatch, flags);
+}
+
+static unsigned long long monotonic_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long long monotonic_us()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Must be called with the heap locked. Arm the timerfd on the earliest
+   deadline if it changed */
+static void __timer_rearm(struct cdbus_context_t *ctx)
+{
+	struct itimerspec spec;
+	struct heap_item_t *item;
+	unsigned long long deadline = 0;
+
+	if (ctx->timer_fd < 0)
+		return;
+
+	item = __heap_get_first(&ctx->timeout_heap);
+	if (item)
+		deadline = item->key ? item->key : 1;
+	/* A pending dispatch is handled as an already expired timeout */
+	if (list_get_nb(&ctx->dispatch_list))
+		deadline = 1;
+	if (deadline == ctx->timer_deadline)
+		return;
+
+	/* A null it_value disarms the timer */
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = deadline / 1000;
+	spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+	if (timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+		return;
+	ctx->timer_deadline = deadline;
+}
+
+static int timeout_enable_at(struct timeout_t *timeout,
+			unsigned long long deadline)
+{
+	struct cdbus_context_t *ctx = timeout->ctx;
+	int ret;
+
+	heap_lock(&ctx->timeout_heap);
+	timeout->hitem.key = deadline;
+	ret = __heap_add(&ctx->timeout_heap, &timeout->hitem);
+	__timer_rearm(ctx);
+	heap_unlock(&ctx->timeout_heap);
+
+	return ret;
+}
+
+static int timeout_enable(struct timeout_t *timeout)
+{
+	return timeout_enable_at(timeout, monotonic_ms() + timeout->interval);
+}
+
 static int timeout_disable(struct timeout_t *timeout)
 {
-	list_rem_item(&timeout->ordered);
+	struct cdbus_context_t *ctx = timeout->ctx;
+
+	heap_lock(&ctx->timeout_heap);
+	__heap_rem_item(&timeout->hitem);
+	__timer_rearm(ctx);
+	heap_unlock(&ctx->timeout_heap);
 	return 0;
 }
 
@@ -177,8 +874,8 @@ static void timeout_toggled(DBusTimeout *dbtimeout, void *data)
 
 	/* We disable the timeout, because this function could be called
 	   without really toggling the timer but simply to change the interval
-	   value. In our implementation, a timeout could be added twice in the
-	   list */
+	   value. The deadline must then be computed again from the new
+	   interval */
 	timeout_disable(timeout);
 
 	if (dbus_timeout_get_enabled(dbtimeout) == TRUE) {
@@ -189,16 +886,18 @@ static void timeout_toggled(DBusTimeout *dbtimeout, void *data)
 static dbus_bool_t add_timeout(DBusTimeout *dbtimeout, void *data)
 {
 	struct timeout_t *timeout;
-	DBusConnection *cnx = (DBusConnection *)data;
+	struct connection_t *connection = data;
 
 	LOG(LOG_DEBUG, "add timeout\n");
 	timeout = malloc(sizeof(*timeout));
 	if (!timeout)
 		return FALSE;
 	memset(timeout, 0, sizeof(*timeout));
+	HEAP_ITEM_INIT(timeout->hitem);
 
 	timeout->dbtimeout = dbtimeout;
-	timeout->cnx = cnx;
+	timeout->cnx = connection->cnx;
+	timeout->ctx = connection->ctx;
 
 	dbus_timeout_set_data(dbtimeout, timeout, free_timeout);
 
@@ -221,826 +920,4946 @@ static void rem_timeout(DBusTimeout *dbtimeout, void *data)
 	}
 }
 
-static void dispatch(struct timeout_t *timeout, void* data)
+static void dispatch(struct connection_t *connection)
 {
-	while (dbus_connection_dispatch(timeout->cnx) ==
+	CDBUS_PROBE1(dispatch_begin, connection->cnx);
+	while (dbus_connection_dispatch(connection->cnx) ==
 		DBUS_DISPATCH_DATA_REMAINS) {
 		LOG(LOG_DEBUG, "connection dispatch\n");
 	}
+	CDBUS_PROBE1(dispatch_end, connection->cnx);
 }
 
-static struct timeout_t* new_dispatch_timeout(DBusConnection *cnx)
+/* Mark the connection as needing a dispatch. This is a no-op if a dispatch
+   is already pending, and nothing is allocated */
+static void dispatch_schedule(struct connection_t *connection)
 {
-	struct timeout_t *timeout;
+	struct cdbus_context_t *ctx = connection->ctx;
 
-	LOG(LOG_DEBUG, "new dispatch timeout\n");
-	timeout = malloc(sizeof(*timeout));
-	if (!timeout)
-		return NULL;
+	if (list_add_tail(&ctx->dispatch_list, &connection->dispatch_item) < 0)
+		return;
 
-	memset(timeout, 0, sizeof(*timeout));
+	heap_lock(&ctx->timeout_heap);
+	__timer_rearm(ctx);
+	heap_unlock(&ctx->timeout_heap);
+}
 
-	timeout->cnx = cnx;
-	timeout->value = timeout->interval = 0;
-	timeout->cb = dispatch;
-	timeout->cb_data = NULL;
-	timeout->oneshot = 1;
+static void dispatch_pending(struct cdbus_context_t *ctx)
+{
+	struct list_item_t *item;
+	struct connection_t *connection;
 
-	return timeout;
+	while ((item = list_get_first(&ctx->dispatch_list))) {
+		list_rem_item(item);
+		connection = container_of(item, struct connection_t,
+					dispatch_item);
+		dispatch(connection);
+	}
 }
 
 static void dispatch_status(DBusConnection *cnx, DBusDispatchStatus new_status,
 		void *data)
 {
-	struct timeout_t *timeout;
+	struct connection_t *connection = data;
 
+	if (new_status != DBUS_DISPATCH_DATA_REMAINS)
+		return;
 	if (!dbus_connection_get_is_connected(cnx))
 		return;
 
-	timeout = new_dispatch_timeout(cnx);
-	if (timeout)
-		timeout_enable(timeout);
+	dispatch_schedule(connection);
 }
 
-static cdbus_proxy_fcn_t find_member(const char * member,
-			struct cdbus_message_entry_t * itf_table)
+static void free_connection(void *data)
 {
-	struct cdbus_message_entry_t * msg_entry = itf_table;
- 	while (msg_entry->msg_name) {
-		if (!strcmp(msg_entry->msg_name, member))
-			break;
-		msg_entry++;
+	struct connection_t *connection = data;
+	struct list_item_t *item;
+	struct queued_signal_t *signal;
+
+	LOG(LOG_DEBUG, "free connection\n");
+	list_rem_item(&connection->dispatch_item);
+
+	/* The connection is gone, the queued signals can't be sent */
+	timeout_disable(&connection->flush_timeout);
+	list_lock(&connection->signal_queue);
+	while ((item = __list_get_first(&connection->signal_queue))) {
+		__list_rem_item(item);
+		signal = container_of(item, struct queued_signal_t, item);
+		dbus_message_unref(signal->msg);
+		free(signal);
 	}
+	list_unlock(&connection->signal_queue);
+	hash_free(&connection->queue_index);
 
-	if (!msg_entry->msg_name)
-		return NULL;
-	return msg_entry->msg_fcn;
+	free(connection);
 }
 
-static cdbus_proxy_fcn_t find_member_with_interface(const char * interface,
-					const char * member,
-					struct cdbus_interface_entry_t * table)
+/* Return the context of a connection set up by libcdbus, the default
+   context otherwise */
+static struct cdbus_context_t * get_context(DBusConnection *cnx)
 {
-	struct cdbus_interface_entry_t * itf_entry = table;
+	struct connection_t *connection = NULL;
 
+	if (connection_slot >= 0)
+		connection = dbus_connection_get_data(cnx, connection_slot);
+	if (!connection)
+		return &default_context;
 
- 	while (itf_entry->itf_name) {
-		if (!strcmp(itf_entry->itf_name, interface))
-			break;
-		itf_entry++;
-	}
+	return connection->ctx;
+}
 
-	if (!itf_entry->itf_name)
+/* Return the data of a connection set up by libcdbus, NULL otherwise */
+static struct connection_t * connection_lookup(DBusConnection *cnx)
+{
+	if (connection_slot < 0)
 		return NULL;
-	return find_member(member, itf_entry->itf_table);
+
+	return dbus_connection_get_data(cnx, connection_slot);
 }
 
-static cdbus_proxy_fcn_t find_member_all_interfaces(const char * member,
-					struct cdbus_interface_entry_t * table)
+/* FNV-1a hash, must be kept in sync with xml2cdbus.py */
+static unsigned int hash_string(const char * str, unsigned int seed)
 {
-	struct cdbus_interface_entry_t * itf_entry = table;
-	cdbus_proxy_fcn_t fcn = NULL;
-
+	unsigned int hash = 2166136261U ^ seed;
 
- 	while (itf_entry->itf_name) {
-		fcn = find_member(member, itf_entry->itf_table);
-		if (fcn)
-			return fcn;
-		itf_entry++;
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
 	}
+	hash ^= hash >> 16;
 
-	return NULL;
+	return hash;
 }
 
-static DBusHandlerResult message_handler(DBusConnection * cnx,
-					DBusMessage * msg,
-					void * user_data)
+/* Return the index of the entry which may match key, or -1 */
+static int hash_lookup(const struct cdbus_hash_t * hash, const char * key)
 {
-	struct list_item_t * item;
-	struct signal_t * signal;
-	cdbus_proxy_fcn_t proxy;
+	unsigned int seed;
 
-	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
-		goto not_handled;
+	seed = hash->disp[hash_string(key, 0) & hash->disp_mask];
+	return hash->slots[hash_string(key, seed) & hash->mask];
+}
 
-	for_each_list_item(&signal_list, item, item, signal) {
-		if (!signal->data.object_table)
-			continue;
-		if ((signal->cnx = cnx)
-			&& (!signal->object || dbus_message_has_path(msg, signal->object))
-			&& (!signal->sender || dbus_message_has_sender(msg, signal->sender)))
-			break;
+static struct cdbus_message_entry_t * find_member(const char * member,
+			struct cdbus_interface_entry_t * itf_entry)
+{
+	struct cdbus_message_entry_t * msg_entry = itf_entry->itf_table;
+	int index;
+
+	if (itf_entry->itf_hash) {
+		index = hash_lookup(itf_entry->itf_hash, member);
+		if ((index < 0) || strcmp(msg_entry[index].msg_name, member))
+			return NULL;
+		return &msg_entry[index];
 	}
 
-	if (!signal)
-		goto signal_not_handled;
-
-	if (dbus_message_get_interface(msg))
-		proxy = find_member_with_interface(dbus_message_get_interface(msg),
-						dbus_message_get_member(msg),
-						signal->data.object_table);
-	else
-		proxy = find_member_all_interfaces(dbus_message_get_member(msg),
-						signal->data.object_table);
+ 	while (msg_entry->msg_name) {
+		if (!strcmp(msg_entry->msg_name, member))
+			break;
+		msg_entry++;
+	}
 
-	if (!proxy)
-		goto signal_not_handled;
+	if (!msg_entry->msg_name)
+		return NULL;
+	return msg_entry;
+}
 
-	if (proxy(cnx, msg, signal->data.user_data) < 0)
-		goto signal_not_handled;
+static struct cdbus_interface_entry_t * find_interface(const char * interface,
+					struct cdbus_interface_entry_t * table)
+{
+	struct cdbus_interface_entry_t * itf_entry = table;
+	int index;
 
+	if (table->obj_hash) {
+		index = hash_lookup(table->obj_hash, interface);
+		if ((index < 0) || strcmp(table[index].itf_name, interface))
+			return NULL;
+		return &table[index];
+	}
 
-	LOG(LOG_DEBUG, "signal %s.%s from %s (%s) catched\n",
-		dbus_message_get_interface(msg),
-		dbus_message_get_member(msg),
-		dbus_message_get_path(msg),
-		dbus_message_get_sender(msg));
+ 	while (itf_entry->itf_name) {
+		if (!strcmp(itf_entry->itf_name, interface))
+			return itf_entry;
+		itf_entry++;
+	}
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	return NULL;
+}
 
-signal_not_handled:
-	LOG(LOG_DEBUG, "signal %s.%s from %s (%s) ignored\n",
-		dbus_message_get_interface(msg),
-		dbus_message_get_member(msg),
-		dbus_message_get_path(msg),
-		dbus_message_get_sender(msg));
+static struct cdbus_message_entry_t * find_member_with_interface(const char * interface,
+					const char * member,
+					struct cdbus_interface_entry_t * table)
+{
+	struct cdbus_interface_entry_t * itf_entry;
 
-not_handled:
-	return  DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	itf_entry = find_interface(interface, table);
+	if (!itf_entry)
+		return NULL;
+	return find_member(member, itf_entry);
 }
 
-
-DBusConnection* cdbus_get_connection(DBusBusType bus_type)
+static struct cdbus_message_entry_t * find_member_all_interfaces(const char * member,
+					struct cdbus_interface_entry_t * table)
 {
-	DBusError error;
-	DBusConnection *cnx;
+	struct cdbus_interface_entry_t * itf_entry = table;
+	struct cdbus_message_entry_t * msg_entry = NULL;
 
-	struct timeout_t *timeout;
 
-	dbus_error_init(&error);
+ 	while (itf_entry->itf_name) {
+		msg_entry = find_member(member, itf_entry);
+		if (msg_entry)
+			return msg_entry;
+		itf_entry++;
+	}
 
-	/* we call timeout handle function as soon as possible, to
-	   get the reference time */
-	cdbus_timeout_handle();
+	return NULL;
+}
 
-	/* get a connection to the bus */
-	cnx = dbus_bus_get(bus_type, &error);
-	if (!cnx || (dbus_error_is_set(&error) == TRUE)) {
-		goto err;
+/* Call being run by the thread. The replies sent by the handler, and the
+   deferred one, are accounted to the statistics of its member */
+struct member_call_t {
+	struct cdbus_member_stats_t *stats;
+	unsigned long long start;
+	int deferred;
+};
+
+static __thread struct member_call_t *current_call;
+
+/* Wire size of a fixed type */
+static int fixed_size(int type)
+{
+	switch (type) {
+	case DBUS_TYPE_BYTE:
+		return 1;
+	case DBUS_TYPE_INT16:
+	case DBUS_TYPE_UINT16:
+		return 2;
+	case DBUS_TYPE_INT64:
+	case DBUS_TYPE_UINT64:
+	case DBUS_TYPE_DOUBLE:
+		return 8;
+	default:
+		return 4;
 	}
+}
 
-	/* setup the connection by installing handlers */
-	dbus_connection_set_watch_functions(cnx, add_watch, rem_watch, NULL,
-					cnx,
-					NULL);
-	dbus_connection_set_timeout_functions(cnx, add_timeout, rem_timeout,
-					timeout_toggled, cnx, NULL);
-	dbus_connection_set_dispatch_status_function(cnx, dispatch_status, NULL,
-						NULL);
+/* Body bytes of the values from iter, without the alignment padding. The
+   values are read in place: the fixed arrays are counted as a whole and
+   nothing is copied, unlike dbus_message_marshal */
+static unsigned long long iter_size(DBusMessageIter * iter)
+{
+	DBusMessageIter sub;
+	unsigned long long size = 0;
+	const char *str;
+	void *items;
+	int elt_type;
+	int type;
+	int nb;
+
+	while ((type = dbus_message_iter_get_arg_type(iter))
+		!= DBUS_TYPE_INVALID) {
+		if (dbus_type_is_fixed(type)) {
+			size += fixed_size(type);
+		} else if (dbus_type_is_basic(type)) {
+			dbus_message_iter_get_basic(iter, &str);
+			/* The length of a signature is a byte */
+			size += strlen(str) + ((type == DBUS_TYPE_SIGNATURE) ?
+				2 : 5);
+		} else {
+			dbus_message_iter_recurse(iter, &sub);
+			elt_type = DBUS_TYPE_INVALID;
+			if (type == DBUS_TYPE_ARRAY) {
+				size += 4;
+				elt_type = dbus_message_iter_get_element_type(iter);
+			} else if (type == DBUS_TYPE_VARIANT) {
+				str = dbus_message_iter_get_signature(&sub);
+				size += str ? strlen(str) + 2 : 2;
+				dbus_free((char *)str);
+			}
+			if ((elt_type != DBUS_TYPE_INVALID)
+				&& (elt_type != DBUS_TYPE_UNIX_FD)
+				&& dbus_type_is_fixed(elt_type)) {
+				dbus_message_iter_get_fixed_array(&sub, &items,
+								&nb);
+				size += (unsigned long long)nb
+					* fixed_size(elt_type);
+			} else {
+				size += iter_size(&sub);
+			}
+		}
+		dbus_message_iter_next(iter);
+	}
 
+	return size;
+}
 
-	timeout = new_dispatch_timeout(cnx);
-	if (!timeout)
-		goto connection_unref;
+/* Body size of the message, libdbus doesn't export the length it holds */
+static unsigned long long message_size(DBusMessage * msg)
+{
+	DBusMessageIter iter;
 
-	timeout_enable(timeout);
+	if (dbus_message_iter_init(msg, &iter) == FALSE)
+		return 0;
 
-	dbus_connection_add_filter(cnx, message_handler, NULL, NULL);
+	return iter_size(&iter);
+}
 
-	dbus_error_free(&error);
+static void stats_add(unsigned long long * counter, unsigned long long value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
 
-	return cnx;
+/* Add the body size of msg to the counter if the byte counters of the
+   member are enabled */
+static void stats_add_size(struct cdbus_member_stats_t * stats,
+			unsigned long long * counter, DBusMessage * msg)
+{
+	if (__atomic_load_n(&stats->count_bytes, __ATOMIC_RELAXED))
+		stats_add(counter, message_size(msg));
+}
 
-connection_unref:
-	dbus_connection_unref(cnx);
-err:
-	dbus_error_free(&error);
-	return NULL;
+static void stats_record_time(struct cdbus_member_stats_t * stats,
+			unsigned long long start)
+{
+	unsigned long long time = monotonic_us() - start;
+	unsigned long long max = __atomic_load_n(&stats->time_max, __ATOMIC_RELAXED);
+	int bucket = time ? 64 - __builtin_clzll(time) : 0;
+
+	if (bucket >= CDBUS_STATS_BUCKETS)
+		bucket = CDBUS_STATS_BUCKETS - 1;
+	stats_add(&stats->latency[bucket], 1);
+	stats_add(&stats->time_total, time);
+
+	while ((time > max)
+		&& !__atomic_compare_exchange_n(&stats->time_max, &max, time, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+		;
 }
 
-int cdbus_request_name(DBusConnection* cnx, char * name, int replace)
+/* Run the proxy of the member, recording its statistics if the table has
+   some */
+static int member_call(struct cdbus_message_entry_t * msg_entry,
+		DBusConnection * cnx, DBusMessage * msg, void * user_data)
 {
-	int flags = 0;
-	DBusError error;
-	int ret = 0;
+	struct member_call_t call, *prev;
+	int ret;
 
-	flags |= DBUS_NAME_FLAG_ALLOW_REPLACEMENT;
-	flags |= DBUS_NAME_FLAG_DO_NOT_QUEUE;
-	if (replace)
-		flags |= DBUS_NAME_FLAG_REPLACE_EXISTING;
+	if (!msg_entry->msg_stats)
+		return msg_entry->msg_fcn(cnx, msg, user_data);
 
-	dbus_error_init(&error);
+	call.stats = msg_entry->msg_stats;
+	call.start = monotonic_us();
+	call.deferred = 0;
+	stats_add(&call.stats->calls, 1);
+	stats_add_size(call.stats, &call.stats->bytes_in, msg);
 
-	/* request the connection name */
-	ret = dbus_bus_request_name(cnx, name, flags, &error);
-	if ((ret < 0) || (dbus_error_is_set(&error) == TRUE))
-		ret = -1;
+	prev = current_call;
+	current_call = &call;
+	ret = msg_entry->msg_fcn(cnx, msg, user_data);
+	current_call = prev;
 
+	if (ret < 0)
+		stats_add(&call.stats->errors, 1);
+	/* The time of a deferred call is recorded when the reply is sent */
+	if (!call.deferred)
+		stats_record_time(call.stats, call.start);
 
-	dbus_error_free(&error);
 	return ret;
 }
 
-const char * cdbus_version_string()
+static int str_equal(const char * str1, const char * str2)
 {
-	return libcdbus_version_string;
+	if (!str1 || !str2)
+		return str1 == str2;
+	return !strcmp(str1, str2);
 }
 
-/*
-   This function allocate an array of struct pollfd containing (nfds +
-   reserve_slots) entries where nfds is the number of fds needed by libcdbus.
-   The user can set reserve_slots to a value different from 0 to preallocate
-   entries for its own file descriptors.
-   If nfds and reserve_slots are null, the allocation is not done.
-   Process pollfd must be called after the poll call to free the array.
- */
-int cdbus_build_pollfds(struct pollfd ** fds, int *nfds, int reserve_slots)
+/* Return 1 if path is a descendant of parent */
+static int path_is_below(const char * path, const char * parent)
 {
-	struct list_item_t *item;
-	struct watch_t *watch;
-	struct pollfd *curr;
-	int fd;
-	int flags;
-
-	if (!fds || !nfds) {
-		return -1;
-	}
+	size_t len = strlen(parent);
 
-	/* To avoid the parsing of the list to find enabled watch,
-	   we set nfds to the number of element in the watch list.
-	   So, maybe there will be some free pollfd at the end of the array */
-	*nfds = list_get_nb(&watch_list);
-	if (*nfds < 0)
-		return -1;
-	if ((reserve_slots + *nfds) == 0)
+	if (strncmp(path, parent, len))
 		return 0;
+	if (len == 1)
+		return path[1] != '\0';
+	return path[len] == '/';
+}
 
-	*fds = malloc(sizeof(struct pollfd) * (*nfds + reserve_slots));
-	if (!*fds)
-		return -1;
-	memset(*fds, 0, sizeof(struct pollfd) * (*nfds + reserve_slots));
-
-	*nfds = 0;
-	curr = *fds;
-
-	list_lock(&watch_list);
-
-	__for_each_list_item(&watch_list, item, litem, watch) {
-		if (dbus_watch_get_enabled(watch->dbwatch) == TRUE) {
-			fd = dbus_watch_get_unix_fd(watch->dbwatch);
-			flags = dbus_watch_get_flags(watch->dbwatch);
-			if (fd >= 0) {
-				curr->fd = fd;
-				if (flags & DBUS_WATCH_READABLE)
-					curr->events |= POLLIN | POLLPRI;
-				if (flags & DBUS_WATCH_WRITABLE)
-					curr->events |= POLLOUT | POLLWRBAND;
-				/* The pointer to the pollfd struct is stored
-				   in the watch structure to speedup the process
-				   function */
-				watch->pollfd = curr;
-				(*nfds)++;
-				curr++;
-			}
-		}
-	}
+/* Must be called with the manager list locked */
+static struct object_manager_t * __manager_at(struct cdbus_context_t * ctx,
+					DBusConnection * cnx,
+					const char * path)
+{
+	struct list_item_t * item;
+	struct object_manager_t * manager;
 
-	list_unlock(&watch_list);
+	__for_each_list_item(&ctx->manager_list, item, item, manager) {
+		if ((manager->cnx == cnx) && !strcmp(manager->path, path))
+			break;
+	}
 
-	return 0;
+	return manager;
 }
 
-/* Check events in the pollfd array and call dbus_watch_handle accordingly */
-int cdbus_process_pollfds(struct pollfd * fds, int nfds)
+/* Must be called with the manager list locked. Return the closest manager
+   above path */
+static struct object_manager_t * __manager_of(struct cdbus_context_t * ctx,
+					DBusConnection * cnx,
+					const char * path)
 {
-	struct list_item_t *item;
-	struct watch_t *watch;
-	int fd;
-	int flags = 0;
+	struct list_item_t * item;
+	struct object_manager_t * manager;
+	struct object_manager_t * best = NULL;
 
-	if (!fds || (nfds < 0))
-		return -1;
+	__for_each_list_item(&ctx->manager_list, item, item, manager) {
+		if ((manager->cnx != cnx) || !path_is_below(path, manager->path))
+			continue;
+		if (!best || (strlen(manager->path) > strlen(best->path)))
+			best = manager;
+	}
 
-	if (!nfds)
-		goto free;
+	return best;
+}
 
-	list_lock(&watch_list);
-	item = __list_get_first(&watch_list);
-	list_unlock(&watch_list);
-	while (item) {
-		list_lock(&watch_list);
-		watch = container_of(item, struct watch_t, litem);
-		item = __list_get_next(item);
-		list_unlock(&watch_list);
-		fd = dbus_watch_get_unix_fd(watch->dbwatch);
-		if (watch->pollfd && (fd >=0)) {
-			if (watch->pollfd->revents) {
-				if (watch->pollfd->revents & POLLERR)
-					flags |= DBUS_WATCH_ERROR;
-				if (watch->pollfd->revents & POLLHUP)
-					flags |= DBUS_WATCH_HANGUP;
-				if (watch->pollfd->revents & (POLLIN | POLLPRI))
-					flags |= DBUS_WATCH_READABLE;
-				if (watch->pollfd->revents &
-					(POLLOUT | POLLWRBAND))
-					flags |= DBUS_WATCH_WRITABLE;
-				LOG(LOG_DEBUG, "watch handle\n");
-				dbus_watch_handle(watch->dbwatch, flags);
-			}
-		}
+/* Must be called with the subtree list locked. Return the subtree whose
+   path is path or one of its ancestors */
+static struct subtree_t * __subtree_of(struct cdbus_context_t * ctx,
+				DBusConnection * cnx,
+				const char * path)
+{
+	struct list_item_t * item;
+	struct subtree_t * subtree;
 
+	__for_each_list_item(&ctx->subtree_list, item, item, subtree) {
+		if ((subtree->cnx == cnx) && (!strcmp(subtree->path, path)
+						|| path_is_below(path, subtree->path)))
+			break;
 	}
 
+	return subtree;
+}
+
+/* Must be called with the object index locked */
+static struct object_t * __object_index_lookup(struct cdbus_context_t * ctx,
+					DBusConnection * cnx,
+					const char * path)
+{
+	struct hash_item_t * hitem;
+	struct object_t * object;
 
-free:
-	free(fds);
+	__for_each_hash_item(&ctx->object_index,
+			hash_string(path, (unsigned int)(uintptr_t)cnx),
+			hitem, hitem, object) {
+		if ((object->cnx == cnx) && !strcmp(object->path, path))
+			break;
+	}
 
-	return 0;
+	return object;
 }
 
-/* Return the time to the next timeout (in ms) */
-int cdbus_next_timeout_event()
+/* Must be called with the node index locked */
+static struct path_node_t * __path_node_lookup(struct cdbus_context_t * ctx,
+					DBusConnection * cnx,
+					const char * path)
 {
-	struct list_item_t *item;
-	struct timeout_t *timeout;
-	item = list_get_first(&timeout_ordered_list);
+	struct hash_item_t * hitem;
+	struct path_node_t * node;
 
-	if (!item)
-		return -1;
+	__for_each_hash_item(&ctx->node_index,
+			hash_string(path, (unsigned int)(uintptr_t)cnx),
+			hitem, hitem, node) {
+		if ((node->cnx == cnx) && !strcmp(node->path, path))
+			break;
+	}
 
-	timeout = container_of(item, struct timeout_t, ordered);
-	return (timeout->value < 0) ? 0 : timeout->value;
+	return node;
 }
 
-/* This function must be called when a timeout occurs */
-int cdbus_timeout_handle()
+/* Must be called with the node index locked. The object at the path of
+   node or below it is gone, the nodes left without object are freed */
+static void __path_node_release(struct path_node_t * node)
 {
-	static struct timespec previous = { 0, 0 };
-	struct timespec now;
-	struct timeout_t *timeout;
-	struct list_item_t *item;
-	struct list_t expired;
-	int ms;
+	struct path_node_t * parent;
 
-	LIST_INIT(expired);
+	for ( ; node ; node = parent) {
+		parent = node->parent;
+		if (--node->refs)
+			continue;
+		if (parent)
+			__list_rem_item(&node->item);
+		__hash_rem_item(&node->hitem);
+#ifdef LIBUTILS_PTHREAD_LOCK
+		pthread_mutex_destroy(&node->children.lock);
+#endif
+		free(node->path);
+		free(node);
+	}
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
+/* Must be called with the node index locked */
+static struct path_node_t * __path_node_get(struct cdbus_context_t * ctx,
+					DBusConnection * cnx,
+					char * path)
+{
+	struct path_node_t * node;
+
+	node = __path_node_lookup(ctx, cnx, path);
+	if (node)
+		return node;
 
-	if (previous.tv_sec == 0 && previous.tv_nsec == 0) {
-		/* The first time the function is called,
-		   the timeouts are not updated since we haven't time
-		   reference */
-		goto post_update;
+	node = malloc(sizeof(*node));
+	if (!node)
+		return NULL;
+	memset(node, 0, sizeof(*node));
+	HASH_ITEM_INIT(node->hitem);
+	LIST_ITEM_INIT(node->item);
+	LIST_INIT(node->children);
+	node->cnx = cnx;
+	node->path = strdup(path);
+	if (!node->path
+		|| (__hash_add(&ctx->node_index, &node->hitem,
+			hash_string(path, (unsigned int)(uintptr_t)cnx)) < 0)) {
+#ifdef LIBUTILS_PTHREAD_LOCK
+		pthread_mutex_destroy(&node->children.lock);
+#endif
+		free(node->path);
+		free(node);
+		return NULL;
 	}
 
-	ms = (now.tv_sec - previous.tv_sec) * 1000;
-	ms += (now.tv_nsec - previous.tv_nsec) / 1000000;
+	return node;
+}
 
-	/* sanity check */
-	if (ms < 0)
-		ms = 0;
+/* Must be called with the node index locked. Count one more object or
+   manager in the node of path and in the ones of its ancestors up to the
+   root, the missing ones are created. Return the node of path */
+static struct path_node_t * __path_nodes_ref(struct cdbus_context_t * ctx,
+					DBusConnection * cnx,
+					const char * path)
+{
+	struct path_node_t * first = NULL;
+	struct path_node_t * child = NULL;
+	struct path_node_t * node;
+	char * buf;
+	char * slash;
 
-	list_lock(&timeout_ordered_list);
-	__for_each_list_item(&timeout_ordered_list, item, ordered, timeout) {
+	buf = strdup(path);
+	if (!buf)
+		return NULL;
 
-		timeout->value -= ms;
-		if (timeout->value <= 0) {
-			__list_rem_item(&timeout->ordered);
-			list_add_tail(&expired, &timeout->ordered);
+	while (1) {
+		node = __path_node_get(ctx, cnx, buf);
+		if (!node)
+			break;
+		node->refs++;
+		if (!first)
+			first = node;
+		if (child && !child->parent) {
+			child->parent = node;
+			__list_add_tail(&node->children, &child->item);
 		}
+		if (!strcmp(buf, "/"))
+			break;
+		child = node;
+		slash = strrchr(buf, '/');
+		if (slash == buf)
+			slash[1] = 0;
+		else
+			*slash = 0;
 	}
-	list_unlock(&timeout_ordered_list);
-
+	/* The nodes counted so far are linked up to the one of path */
+	if (!node && first) {
+		__path_node_release(first);
+		first = NULL;
+	}
+	free(buf);
 
-	/* Handle the timers that had expired */
-	list_lock(&expired);
-	item = __list_get_first(&expired);
-	list_unlock(&expired);
-	while (item) {
-		list_lock(&expired);
-		timeout = container_of(item, struct timeout_t, ordered);
-		item = __list_get_next(item);
-		list_unlock(&expired);
-		__list_rem_item(&timeout->ordered);
+	return first;
+}
 
-		if (timeout->dbtimeout) {
-			LOG(LOG_DEBUG, "timeout handle\n");
-			dbus_timeout_handle(timeout->dbtimeout);
-			timeout_enable(timeout);
-		}
-		if (timeout->cb) {
-			timeout->cb(timeout, timeout->cb_data);
-			if (timeout->oneshot) {
-				free(timeout);
-			} else {
-				timeout_enable(timeout);
-			}
+/* Add the object to the node of its path, there is at most one object
+   per path */
+static int path_nodes_add(struct object_t * object)
+{
+	struct cdbus_context_t * ctx = object->ctx;
+	struct path_node_t * node;
+	int ret = -1;
+
+	hash_lock(&ctx->node_index);
+	node = __path_node_lookup(ctx, object->cnx, object->path);
+	if (!node || !node->object) {
+		node = __path_nodes_ref(ctx, object->cnx, object->path);
+		if (node) {
+			node->object = object;
+			ret = 0;
 		}
 	}
+	hash_unlock(&ctx->node_index);
 
-post_update:
-	previous.tv_sec = now.tv_sec;
-	previous.tv_nsec = now.tv_nsec;
-
-	return 0;
+	return ret;
 }
 
-static int extstr_init(struct extensible_string_t * str)
+static void path_nodes_rem(struct object_t * object)
 {
-	str->size = 0;
-	str->buf_size = 0;
-	str->buffer = malloc(EXTSTR_BUFF_SIZE);
-	if (!str->buffer)
-		return -1;
-	str->buf_size = EXTSTR_BUFF_SIZE;
-	return 0;
+	struct cdbus_context_t * ctx = object->ctx;
+	struct path_node_t * node;
+
+	hash_lock(&ctx->node_index);
+	node = __path_node_lookup(ctx, object->cnx, object->path);
+	if (node && (node->object == object)) {
+		node->object = NULL;
+		__path_node_release(node);
+	}
+	hash_unlock(&ctx->node_index);
 }
 
-static void extstr_free(struct extensible_string_t * str)
+static void manager_node_release(struct cdbus_context_t * ctx,
+				struct object_manager_t * manager)
 {
-	if (str->buffer) {
-		free(str->buffer);
-		str->buffer = NULL;
+	struct path_node_t * node;
+
+	hash_lock(&ctx->node_index);
+	node = __path_node_lookup(ctx, manager->cnx, manager->path);
+	if (node && (node->manager == manager)) {
+		node->manager = NULL;
+		__path_node_release(node);
 	}
-	str->size = 0;
-	str->buf_size = 0;
+	hash_unlock(&ctx->node_index);
 }
 
-static int extstr_extend(struct extensible_string_t * str)
+static int object_index_add(struct object_t * object)
 {
-	char * buf;
-	buf = realloc(str->buffer, str->buf_size + EXTSTR_BUFF_SIZE);
+	struct hash_t * index = &object->ctx->object_index;
+	int ret = -1;
 
-	if (!buf)
-		return -1;
+	hash_lock(index);
+	if (!__object_index_lookup(object->ctx, object->cnx, object->path))
+		ret = __hash_add(index, &object->hitem,
+				hash_string(object->path,
+					(unsigned int)(uintptr_t)object->cnx));
+	hash_unlock(index);
 
-	str->buffer = buf;
-	str->buf_size += EXTSTR_BUFF_SIZE;
-	return 0;
+	return ret;
 }
 
-static int extstr_append_sprintf(struct extensible_string_t * str,
-			const char * format, ...)
+/* Return the object registered at path, in a subtree or with libdbus */
+static struct object_t * object_lookup(DBusConnection * cnx,
+				const char * path)
 {
-	va_list ap;
-	int n;
-	int extended = 0;
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct subtree_t * subtree;
+	struct object_t * object = NULL;
+	void * data = NULL;
+
+	list_lock(&ctx->subtree_list);
+	subtree = __subtree_of(ctx, cnx, path);
+	list_unlock(&ctx->subtree_list);
+
+	/* All the objects of a subtree are in the index */
+	if (subtree) {
+		hash_lock(&ctx->object_index);
+		object = __object_index_lookup(ctx, cnx, path);
+		hash_unlock(&ctx->object_index);
+		return object;
+	}
 
-	do {
-		extended = 0;
+	if (!dbus_connection_get_object_path_data(cnx, path, &data))
+		return NULL;
 
-		va_start(ap, format);
-		n = vsnprintf(EXTSTR_BUFFER(str),
-			EXTSTR_REM_SIZE(str),
-			format,
-			ap);
-		va_end(ap);
+	return data;
+}
 
-		if (n >= EXTSTR_REM_SIZE(str)) {
-			extended = 1;
-			if (extstr_extend(str) < 0)
-				return -1;
-		} else {
-			str->size += n;
+static void object_ref(struct object_t * object)
+{
+	__atomic_add_fetch(&object->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void object_unref(struct object_t * object)
+{
+	if (__atomic_sub_fetch(&object->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_destroy(&object->lock);
+#endif
+	if (object->xml)
+		free(object->xml);
+	free(object->path);
+	free(object);
+}
+
+/* Same as object_lookup, with a reference taken on the object. The
+   reference is taken under the lock the unregistration takes before
+   dropping its own: the object index for the objects of a subtree, the
+   object list for the others as libdbus forgets them before calling
+   object_unregister */
+static struct object_t * object_get(DBusConnection * cnx, const char * path)
+{
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct subtree_t * subtree;
+	struct object_t * object = NULL;
+	void * data = NULL;
+
+	list_lock(&ctx->subtree_list);
+	subtree = __subtree_of(ctx, cnx, path);
+	list_unlock(&ctx->subtree_list);
+
+	if (subtree) {
+		hash_lock(&ctx->object_index);
+		object = __object_index_lookup(ctx, cnx, path);
+		if (object)
+			object_ref(object);
+		hash_unlock(&ctx->object_index);
+		return object;
+	}
+
+	list_lock(&ctx->object_list);
+	if (dbus_connection_get_object_path_data(cnx, path, &data) && data) {
+		object = data;
+		object_ref(object);
+	}
+	list_unlock(&ctx->object_list);
+
+	return object;
+}
+
+/* Something was registered or unregistered at path: the cached
+   introspection data of the object at path and of the ones at its
+   ancestors, whose children nodes may have changed, is stale */
+static void object_xml_invalidate(DBusConnection * cnx, const char * path)
+{
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct list_item_t * item;
+	struct object_t * object;
+	char * parent;
+	char * slash;
+
+	parent = strdup(path);
+	if (!parent) {
+		for_each_list_item(&ctx->object_list, item, item, object)
+			object->xml_stale = 1;
+		return;
+	}
+
+	while (1) {
+		object = object_lookup(cnx, parent);
+		if (object)
+			object->xml_stale = 1;
+		slash = strrchr(parent, '/');
+		if (!slash || ((slash == parent) && !slash[1]))
+			break;
+		if (slash == parent)
+			slash[1] = 0;
+		else
+			*slash = 0;
+	}
+	free(parent);
+}
+
+static unsigned int signal_hash(DBusConnection * cnx, const char * path,
+			const char * sender, const char * interface)
+{
+	unsigned int hash;
+
+	hash = hash_string(interface, (unsigned int)(uintptr_t)cnx);
+	hash = hash_string(path ? path : "", hash);
+	return hash_string(sender ? sender : "", hash);
+}
+
+/* Return the earliest subscription between best and the ones registered
+   with exactly this key */
+static struct signal_t * __signal_lookup(struct cdbus_context_t * ctx,
+					DBusConnection * cnx,
+					const char * path,
+					const char * sender,
+					const char * interface,
+					struct signal_t * best)
+{
+	struct hash_item_t * hitem;
+	struct signal_key_t * key;
+	struct signal_t * signal;
+
+	__for_each_hash_item(&ctx->signal_index,
+			signal_hash(cnx, path, sender, interface),
+			hitem, item, key) {
+		signal = key->signal;
+		if ((signal->cnx != cnx)
+			|| strcmp(key->interface, interface)
+			|| !str_equal(signal->object, path)
+			|| !str_equal(signal->sender, sender))
+			continue;
+		if (!best || (signal->seq < best->seq))
+			best = signal;
+	}
+
+	return best;
+}
+
+static struct signal_t * signal_lookup(struct cdbus_context_t * ctx,
+				DBusConnection * cnx, DBusMessage * msg)
+{
+	struct list_item_t * item;
+	struct signal_t * signal = NULL;
+	const char * interface = dbus_message_get_interface(msg);
+	const char * path = dbus_message_get_path(msg);
+	const char * sender = dbus_message_get_sender(msg);
+
+	/* Signals always have an interface on a bus, fall back to a scan of
+	   the subscriptions otherwise */
+	if (!interface) {
+		for_each_list_item(&ctx->signal_list, item, item, signal) {
+			if ((signal->cnx == cnx)
+				&& (!signal->object || dbus_message_has_path(msg, signal->object))
+				&& (!signal->sender || dbus_message_has_sender(msg, signal->sender)))
+				break;
 		}
+		return signal;
+	}
 
-	} while (extended);
+	hash_lock(&ctx->signal_index);
+	if (path && sender)
+		signal = __signal_lookup(ctx, cnx, path, sender, interface, signal);
+	if (path)
+		signal = __signal_lookup(ctx, cnx, path, NULL, interface, signal);
+	if (sender)
+		signal = __signal_lookup(ctx, cnx, NULL, sender, interface, signal);
+	signal = __signal_lookup(ctx, cnx, NULL, NULL, interface, signal);
+	hash_unlock(&ctx->signal_index);
 
-	return 0;
+	return signal;
 }
 
-static int generate_argument_xml(struct extensible_string_t * str,
-			struct cdbus_arg_entry_t * arg)
+static DBusHandlerResult message_handler(DBusConnection * cnx,
+					DBusMessage * msg,
+					void * user_data)
 {
-	int ret;
-	ret = extstr_append_sprintf(str,
-				"<arg name=\"%s\" "
-				"type=\"%s\" "
-				"direction=\"%s\" />",
-				arg->arg_name,
-				arg->signature,
-				(arg->direction == CDBUS_DIRECTION_IN) ? "in" : "out");
-	return ret;
+	struct connection_t * connection = user_data;
+	struct signal_t * signal;
+	struct cdbus_message_entry_t * msg_entry;
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
+		goto not_handled;
+
+	signal = signal_lookup(connection->ctx, cnx, msg);
+
+	if (!signal)
+		goto signal_not_handled;
+
+	if (dbus_message_get_interface(msg))
+		msg_entry = find_member_with_interface(dbus_message_get_interface(msg),
+						dbus_message_get_member(msg),
+						signal->data.object_table);
+	else
+		msg_entry = find_member_all_interfaces(dbus_message_get_member(msg),
+						signal->data.object_table);
+
+	if (!msg_entry)
+		goto signal_not_handled;
+
+	if (member_call(msg_entry, cnx, msg, signal->data.user_data) < 0)
+		goto signal_not_handled;
+
+
+	LOG(LOG_DEBUG, "signal %s.%s from %s (%s) catched\n",
+		dbus_message_get_interface(msg),
+		dbus_message_get_member(msg),
+		dbus_message_get_path(msg),
+		dbus_message_get_sender(msg));
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+
+signal_not_handled:
+	LOG(LOG_DEBUG, "signal %s.%s from %s (%s) ignored\n",
+		dbus_message_get_interface(msg),
+		dbus_message_get_member(msg),
+		dbus_message_get_path(msg),
+		dbus_message_get_sender(msg));
+
+not_handled:
+	return  DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
 
-static int generate_message_xml(struct extensible_string_t * str,
-			struct cdbus_message_entry_t * msg)
+static unsigned int queued_signal_hash(DBusMessage *msg)
 {
-	int ret;
-	struct cdbus_arg_entry_t *arg = msg->msg_table;
+	const char *member = dbus_message_get_member(msg);
+	const char *interface = dbus_message_get_interface(msg);
+	const char *path = dbus_message_get_path(msg);
+	const char *destination = dbus_message_get_destination(msg);
+	unsigned int hash;
+
+	hash = hash_string(member ? member : "", 0);
+	hash = hash_string(interface ? interface : "", hash);
+	hash = hash_string(path ? path : "", hash);
+	return hash_string(destination ? destination : "", hash);
+}
 
-	if (!msg->is_signal) {
-		ret = extstr_append_sprintf(str,
-					"<method name=\"%s\">",
-					msg->msg_name);
+static int queued_signal_match(DBusMessage *msg1, DBusMessage *msg2)
+{
+	return str_equal(dbus_message_get_member(msg1),
+			dbus_message_get_member(msg2))
+		&& str_equal(dbus_message_get_interface(msg1),
+			dbus_message_get_interface(msg2))
+		&& str_equal(dbus_message_get_path(msg1),
+			dbus_message_get_path(msg2))
+		&& str_equal(dbus_message_get_destination(msg1),
+			dbus_message_get_destination(msg2));
+}
+
+/* Must be called with the queue locked. Arm the flush timeout on the
+   deadline of the oldest queued signal, return 1 if the deadline
+   changed */
+static int __signal_queue_arm(struct connection_t *connection)
+{
+	struct timeout_t *timeout = &connection->flush_timeout;
+	struct cdbus_context_t *ctx = connection->ctx;
+	struct list_item_t *item;
+	struct queued_signal_t *signal;
+	int ret = 0;
+
+	heap_lock(&ctx->timeout_heap);
+	item = __list_get_first(&connection->signal_queue);
+	if (!item) {
+		__heap_rem_item(&timeout->hitem);
 	} else {
-		ret = extstr_append_sprintf(str,
-					"<signal name=\"%s\">",
-					msg->msg_name);
+		signal = container_of(item, struct queued_signal_t, item);
+		if (!heap_item_get_heap(&timeout->hitem)
+			|| (timeout->hitem.key != signal->deadline)) {
+			__heap_rem_item(&timeout->hitem);
+			timeout->hitem.key = signal->deadline;
+			__heap_add(&ctx->timeout_heap, &timeout->hitem);
+			ret = 1;
+		}
 	}
-	if (ret < 0)
-		return -1;
+	__timer_rearm(ctx);
+	heap_unlock(&ctx->timeout_heap);
 
-	while(arg->arg_name) {
-		generate_argument_xml(str, arg);
-		arg++;
+	return ret;
+}
+
+/* Must be called with the queue locked. Send the queued signals whose
+   deadline is reached, or all of them if all is set */
+static void __signal_queue_send(struct connection_t *connection, int all)
+{
+	unsigned long long now = monotonic_ms();
+	struct list_item_t *item;
+	struct queued_signal_t *signal;
+
+	while ((item = __list_get_first(&connection->signal_queue))) {
+		signal = container_of(item, struct queued_signal_t, item);
+		if (!all && (signal->deadline > now))
+			break;
+		__list_rem_item(item);
+		__hash_rem_item(&signal->hitem);
+		dbus_connection_send(connection->cnx, signal->msg, NULL);
+		dbus_message_unref(signal->msg);
+		free(signal);
 	}
+	__signal_queue_arm(connection);
+}
 
-	if (!msg->is_signal) {
-		ret = extstr_append_sprintf(str,
-					"</method>");
-	} else {
-		ret = extstr_append_sprintf(str,
-					"</signal>");
+static void signal_queue_timeout(struct timeout_t *timeout, void *data)
+{
+	struct connection_t *connection = data;
+
+	list_lock(&connection->signal_queue);
+	__signal_queue_send(connection, 0);
+	list_unlock(&connection->signal_queue);
+}
+
+/* Send a signal, through the queue of the connection if it is enabled. It
+   replaces a queued emission of the same signal if coalesce is set and the
+   connection coalesces. The caller keeps its reference on msg */
+static int signal_send(DBusConnection * cnx, DBusMessage * msg, int coalesce)
+{
+	struct connection_t *connection = connection_lookup(cnx);
+	struct hash_item_t *hitem;
+	struct queued_signal_t *signal;
+	unsigned int hash = 0;
+	int wakeup;
+
+	if (!connection)
+		return (dbus_connection_send(cnx, msg, NULL) == TRUE) ? 0 : -1;
+
+	list_lock(&connection->signal_queue);
+	if (!connection->queue_signals) {
+		list_unlock(&connection->signal_queue);
+		return (dbus_connection_send(cnx, msg, NULL) == TRUE) ? 0 : -1;
 	}
-	if (ret < 0)
+
+	coalesce = coalesce && (connection->window >= 0);
+	if (coalesce) {
+		/* Only the latest emission of a queued signal is kept */
+		hash = queued_signal_hash(msg);
+		__for_each_hash_item(&connection->queue_index, hash, hitem,
+				hitem, signal) {
+			if (queued_signal_match(signal->msg, msg)) {
+				dbus_message_ref(msg);
+				dbus_message_unref(signal->msg);
+				signal->msg = msg;
+				list_unlock(&connection->signal_queue);
+				return 0;
+			}
+		}
+	}
+
+	signal = malloc(sizeof(*signal));
+	if (!signal) {
+		list_unlock(&connection->signal_queue);
+		return -1;
+	}
+	LIST_ITEM_INIT(signal->item);
+	HASH_ITEM_INIT(signal->hitem);
+	signal->msg = dbus_message_ref(msg);
+	signal->deadline = monotonic_ms();
+	if (coalesce)
+		signal->deadline += connection->window;
+
+	if (coalesce
+		&& (__hash_add(&connection->queue_index, &signal->hitem,
+				hash) < 0)) {
+		dbus_message_unref(signal->msg);
+		free(signal);
+		list_unlock(&connection->signal_queue);
 		return -1;
+	}
+	__list_add_tail(&connection->signal_queue, &signal->item);
+	wakeup = __signal_queue_arm(connection);
+	list_unlock(&connection->signal_queue);
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	/* The loop may be waiting in poll with a later deadline */
+	if (wakeup && (connection->ctx->wakeup_fd >= 0))
+		wakeup_main(connection->ctx);
+#else
+	(void)wakeup;
+#endif
 
 	return 0;
 }
 
-static int generate_interface_xml(struct extensible_string_t * str,
-			struct cdbus_interface_entry_t * itf)
+
+struct cdbus_context_t * cdbus_context_new()
 {
-	int ret;
-	struct cdbus_message_entry_t *msg = itf->itf_table;
+	struct cdbus_context_t *ctx;
 
-	ret = extstr_append_sprintf(str,
-				"<interface name=\"%s\">",
-				itf->itf_name);
-	if (ret < 0)
-		return -1;
+	/* The connections of distinct contexts may be used by distinct
+	   threads */
+	if (dbus_threads_init_default() == FALSE)
+		return NULL;
 
-	while (msg->msg_name) {
-		ret = generate_message_xml(str, msg);
-		if (ret < 0)
-			return -1;
-		msg++;
+	ctx = malloc(sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	memset(ctx, 0, sizeof(*ctx));
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_init(&ctx->pollfd_set.lock, NULL);
+#endif
+	ctx->pollfd_set.generation = 1;
+	ctx->pollfd_set.epoll_fd = -1;
+	HEAP_INIT(ctx->timeout_heap);
+	ctx->timer_fd = -1;
+	ctx->wakeup_fd = -1;
+	LIST_INIT(ctx->dispatch_list);
+	LIST_INIT(ctx->signal_list);
+	HASH_INIT(ctx->signal_index);
+	LIST_INIT(ctx->object_list);
+	LIST_INIT(ctx->manager_list);
+	LIST_INIT(ctx->subtree_list);
+	HASH_INIT(ctx->object_index);
+	HASH_INIT(ctx->node_index);
+
+	return ctx;
+}
+
+/* The connections of the context must have been closed and released
+   before */
+void cdbus_context_free(struct cdbus_context_t * ctx)
+{
+	if (!ctx || (ctx == &default_context))
+		return;
+
+	/* Only the internal watches are left in the set */
+	if (ctx->timer_fd >= 0) {
+		pollfd_set_rem(&ctx->pollfd_set, &ctx->timer_watch);
+		close(ctx->timer_fd);
+	}
+	if (ctx->wakeup_fd >= 0) {
+		pollfd_set_rem(&ctx->pollfd_set, &ctx->wakeup_watch);
+		close(ctx->wakeup_fd);
+	}
+	if (ctx->pollfd_set.epoll_fd >= 0)
+		close(ctx->pollfd_set.epoll_fd);
+	free(ctx->pollfd_set.fds);
+	free(ctx->pollfd_set.retired);
+	free(ctx->pollfd_set.watches);
+	heap_free(&ctx->timeout_heap);
+	hash_free(&ctx->signal_index);
+	hash_free(&ctx->object_index);
+	hash_free(&ctx->node_index);
+	free(ctx);
+}
+
+/*
+   Return a connection to the bus whose watches, timeouts and signals are
+   handled by the context. The connections of the default context are the
+   shared connections of libdbus, the other contexts get private
+   connections which must be closed with dbus_connection_close before
+   being released.
+ */
+DBusConnection* cdbus_context_get_connection(struct cdbus_context_t * ctx,
+					DBusBusType bus_type)
+{
+	DBusError error;
+	DBusConnection *cnx;
+
+	struct connection_t *connection;
+
+	if (!ctx)
+		return NULL;
+
+	if (dbus_connection_allocate_data_slot(&connection_slot) == FALSE)
+		return NULL;
+
+	dbus_error_init(&error);
+
+	/* get a connection to the bus */
+	if (ctx == &default_context)
+		cnx = dbus_bus_get(bus_type, &error);
+	else
+		cnx = dbus_bus_get_private(bus_type, &error);
+	if (!cnx || (dbus_error_is_set(&error) == TRUE)) {
+		goto err;
+	}
+
+	/* The shared connections are only set up once */
+	if (dbus_connection_get_data(cnx, connection_slot)) {
+		dbus_error_free(&error);
+		return cnx;
+	}
+
+	connection = malloc(sizeof(*connection));
+	if (!connection)
+		goto connection_unref;
+	memset(connection, 0, sizeof(*connection));
+	LIST_ITEM_INIT(connection->dispatch_item);
+	connection->cnx = cnx;
+	connection->ctx = ctx;
+	LIST_INIT(connection->signal_queue);
+	HASH_INIT(connection->queue_index);
+	HEAP_ITEM_INIT(connection->flush_timeout.hitem);
+	connection->flush_timeout.cnx = cnx;
+	connection->flush_timeout.ctx = ctx;
+	connection->flush_timeout.cb = signal_queue_timeout;
+	connection->flush_timeout.cb_data = connection;
+
+	if (dbus_connection_set_data(cnx, connection_slot, connection,
+					free_connection) == FALSE) {
+		free(connection);
+		goto connection_unref;
 	}
 
-	ret = extstr_append_sprintf(str,
-				"</interface>");
-	if (ret < 0)
+	/* setup the connection by installing handlers */
+	dbus_connection_set_watch_functions(cnx, add_watch, rem_watch,
+					watch_toggled, connection,
+					NULL);
+	dbus_connection_set_timeout_functions(cnx, add_timeout, rem_timeout,
+					timeout_toggled, connection, NULL);
+	dbus_connection_set_dispatch_status_function(cnx, dispatch_status,
+						connection, NULL);
+
+	/* messages may have been received before the handlers were set */
+	dispatch_schedule(connection);
+
+	dbus_connection_add_filter(cnx, message_handler, connection, NULL);
+
+	dbus_error_free(&error);
+
+	return cnx;
+
+connection_unref:
+	if (ctx != &default_context)
+		dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+err:
+	dbus_error_free(&error);
+	return NULL;
+}
+
+DBusConnection* cdbus_get_connection(DBusBusType bus_type)
+{
+	return cdbus_context_get_connection(&default_context, bus_type);
+}
+
+int cdbus_request_name(DBusConnection* cnx, char * name, int replace)
+{
+	int flags = 0;
+	DBusError error;
+	int ret = 0;
+
+	flags |= DBUS_NAME_FLAG_ALLOW_REPLACEMENT;
+	flags |= DBUS_NAME_FLAG_DO_NOT_QUEUE;
+	if (replace)
+		flags |= DBUS_NAME_FLAG_REPLACE_EXISTING;
+
+	dbus_error_init(&error);
+
+	/* request the connection name */
+	ret = dbus_bus_request_name(cnx, name, flags, &error);
+	if ((ret < 0) || (dbus_error_is_set(&error) == TRUE))
+		ret = -1;
+
+
+	dbus_error_free(&error);
+	return ret;
+}
+
+const char * cdbus_version_string()
+{
+	return libcdbus_version_string;
+}
+
+/*
+   This function allocate an array of struct pollfd containing (nfds +
+   reserve_slots) entries where nfds is the number of fds needed by libcdbus.
+   The user can set reserve_slots to a value different from 0 to preallocate
+   entries for its own file descriptors.
+   If nfds and reserve_slots are null, the allocation is not done.
+   Process pollfd must be called after the poll call to free the array.
+   The entries of the disabled watches have a negative fd.
+ */
+int cdbus_context_build_pollfds(struct cdbus_context_t * ctx,
+			struct pollfd ** fds, int *nfds, int reserve_slots)
+{
+	int i;
+
+	if (!fds || !nfds) {
+		return -1;
+	}
+
+	pollfd_set_lock(&ctx->pollfd_set);
+
+	*nfds = ctx->pollfd_set.nb;
+	if ((reserve_slots + *nfds) == 0) {
+		pollfd_set_unlock(&ctx->pollfd_set);
+		return 0;
+	}
+
+	*fds = malloc(sizeof(struct pollfd) * (*nfds + reserve_slots));
+	if (!*fds) {
+		pollfd_set_unlock(&ctx->pollfd_set);
+		return -1;
+	}
+	memset(*fds + *nfds, 0, sizeof(struct pollfd) * reserve_slots);
+	memcpy(*fds, ctx->pollfd_set.fds, sizeof(struct pollfd) * *nfds);
+
+	/* The pointer to the pollfd struct is stored in the watch
+	   structure so that the process function could find it back
+	   even if the set changed in between */
+	for (i = 0 ; i < *nfds ; i++)
+		ctx->pollfd_set.watches[i]->pollfd = *fds + i;
+
+	pollfd_set_unlock(&ctx->pollfd_set);
+
+	return 0;
+}
+
+int cdbus_build_pollfds(struct pollfd ** fds, int *nfds, int reserve_slots)
+{
+	return cdbus_context_build_pollfds(&default_context, fds, nfds,
+					reserve_slots);
+}
+
+/* Check events in the pollfd array and call dbus_watch_handle accordingly */
+int cdbus_context_process_pollfds(struct cdbus_context_t * ctx,
+			struct pollfd * fds, int nfds)
+{
+	struct watch_t *watch;
+	unsigned int generation;
+	short revents;
+	int i;
+
+	if (!fds || (nfds < 0))
+		return -1;
+
+	if (!nfds)
+		goto free;
+
+	CDBUS_PROBE1(events_begin, nfds);
+	pollfd_set_lock(&ctx->pollfd_set);
+	for (i = 0 ; i < ctx->pollfd_set.nb ; i++) {
+		watch = ctx->pollfd_set.watches[i];
+		if (!watch->pollfd || (watch->pollfd < fds)
+			|| (watch->pollfd >= fds + nfds))
+			continue;
+		revents = (watch->pollfd->fd >= 0) ? watch->pollfd->revents : 0;
+		watch->pollfd = NULL;
+		if (!revents)
+			continue;
+
+		/* The set may be modified by dbus_watch_handle, so we
+		   restart from the beginning if it was: the handled watches
+		   have a NULL pollfd pointer */
+		generation = ctx->pollfd_set.generation;
+		pollfd_set_unlock(&ctx->pollfd_set);
+		watch_handle(watch, revents);
+		pollfd_set_lock(&ctx->pollfd_set);
+		if (ctx->pollfd_set.generation != generation)
+			i = -1;
+	}
+	pollfd_set_unlock(&ctx->pollfd_set);
+	CDBUS_PROBE1(events_end, nfds);
+
+free:
+	free(fds);
+
+	return 0;
+}
+
+int cdbus_process_pollfds(struct pollfd * fds, int nfds)
+{
+	return cdbus_context_process_pollfds(&default_context, fds, nfds);
+}
+
+/*
+   This function gives access to the persistent pollfd array maintained by
+   libcdbus. The array contains (nfds + reserve_slots) entries where nfds is
+   the number of watches. The reserved slots are located right after the
+   watches entries and their content is kept by libcdbus when the set is
+   modified.
+   The array is owned by the library and its content is only meaningful as
+   long as the generation counter is not modified, the user must call this
+   function again each time cdbus_pollfds_generation() returns a value
+   different from *generation. When the set grows, the array returned by the
+   previous call is not freed before this function is called again, so a
+   thread may safely be blocked in poll on it meanwhile.
+ */
+int cdbus_context_get_pollfds(struct cdbus_context_t * ctx,
+		struct pollfd ** fds, int *nfds, int reserve_slots,
+		unsigned int *generation)
+{
+	if (!fds || !nfds || (reserve_slots < 0))
+		return -1;
+
+	pollfd_set_lock(&ctx->pollfd_set);
+
+	if (reserve_slots != ctx->pollfd_set.reserved) {
+		if (__pollfd_set_resize(&ctx->pollfd_set, ctx->pollfd_set.nb,
+						reserve_slots) < 0) {
+			pollfd_set_unlock(&ctx->pollfd_set);
+			return -1;
+		}
+		if (reserve_slots > ctx->pollfd_set.reserved)
+			memset(ctx->pollfd_set.fds + ctx->pollfd_set.nb + ctx->pollfd_set.reserved, 0,
+				sizeof(struct pollfd) *
+				(reserve_slots - ctx->pollfd_set.reserved));
+		ctx->pollfd_set.reserved = reserve_slots;
+		ctx->pollfd_set.generation++;
+	}
+
+	/* The user is done with the previous array */
+	free(ctx->pollfd_set.retired);
+	ctx->pollfd_set.retired = NULL;
+	ctx->pollfd_set.given = ctx->pollfd_set.fds;
+
+	*fds = ctx->pollfd_set.fds;
+	*nfds = ctx->pollfd_set.nb;
+	if (generation)
+		*generation = ctx->pollfd_set.generation;
+
+	pollfd_set_unlock(&ctx->pollfd_set);
+
+	return 0;
+}
+
+int cdbus_get_pollfds(struct pollfd ** fds, int *nfds, int reserve_slots,
+		unsigned int *generation)
+{
+	return cdbus_context_get_pollfds(&default_context, fds, nfds, reserve_slots,
+					generation);
+}
+
+unsigned int cdbus_context_pollfds_generation(struct cdbus_context_t * ctx)
+{
+	unsigned int generation;
+
+	pollfd_set_lock(&ctx->pollfd_set);
+	generation = ctx->pollfd_set.generation;
+	pollfd_set_unlock(&ctx->pollfd_set);
+
+	return generation;
+}
+
+unsigned int cdbus_pollfds_generation()
+{
+	return cdbus_context_pollfds_generation(&default_context);
+}
+
+/* Check events in the persistent pollfd array returned by cdbus_get_pollfds
+   and call dbus_watch_handle accordingly. The array is not freed.
+   The handling stops if the set is modified by a watch handler, the
+   remaining events will be reported again by the next poll call. */
+int cdbus_context_handle_pollfds(struct cdbus_context_t * ctx,
+			struct pollfd * fds, int nfds)
+{
+	struct watch_t *watch;
+	unsigned int generation;
+	short revents;
+	int i;
+
+	if (!fds || (nfds < 0))
+		return -1;
+
+	pollfd_set_lock(&ctx->pollfd_set);
+	generation = ctx->pollfd_set.generation;
+	pollfd_set_unlock(&ctx->pollfd_set);
+
+	for (i = 0 ; i < nfds ; i++) {
+		pollfd_set_lock(&ctx->pollfd_set);
+		if ((ctx->pollfd_set.generation != generation)
+			|| (fds != ctx->pollfd_set.fds) || (i >= ctx->pollfd_set.nb)) {
+			pollfd_set_unlock(&ctx->pollfd_set);
+			break;
+		}
+		revents = fds[i].revents;
+		fds[i].revents = 0;
+		watch = ctx->pollfd_set.watches[i];
+		pollfd_set_unlock(&ctx->pollfd_set);
+
+		if (revents && (fds[i].fd >= 0))
+			watch_handle(watch, revents);
+	}
+
+	return 0;
+}
+
+int cdbus_handle_pollfds(struct pollfd * fds, int nfds)
+{
+	return cdbus_context_handle_pollfds(&default_context, fds, nfds);
+}
+
+/*
+   This function returns a file descriptor which becomes readable when one of
+   the watches of libcdbus is ready. It can be added to any poll, select or
+   epoll based main loop in place of the whole pollfd set. The epoll instance
+   is created on the first call and is then kept in sync by the watch
+   callbacks.
+   cdbus_handle_events must be called when the fd is readable.
+ */
+int cdbus_context_get_epoll_fd(struct cdbus_context_t * ctx)
+{
+	int i;
+
+	pollfd_set_lock(&ctx->pollfd_set);
+
+	if (ctx->pollfd_set.epoll_fd < 0) {
+		ctx->pollfd_set.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (ctx->pollfd_set.epoll_fd < 0) {
+			pollfd_set_unlock(&ctx->pollfd_set);
+			return -1;
+		}
+		for (i = 0 ; i < ctx->pollfd_set.nb ; i++)
+			__pollfd_set_epoll_sync(&ctx->pollfd_set,
+						ctx->pollfd_set.watches[i]->wfd);
+	}
+
+	pollfd_set_unlock(&ctx->pollfd_set);
+
+	return ctx->pollfd_set.epoll_fd;
+}
+
+int cdbus_get_epoll_fd()
+{
+	return cdbus_context_get_epoll_fd(&default_context);
+}
+
+/* Handle the ready watches of the epoll instance returned by
+   cdbus_get_epoll_fd, then the expired timeouts. This function never
+   blocks. Only the ready watches are visited. */
+int cdbus_context_handle_events(struct cdbus_context_t * ctx)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	struct watch_fd_t *wfd;
+	struct watch_t *watch;
+	unsigned int generation;
+	short revents;
+	int epoll_fd;
+	int nb;
+	int i;
+
+	pollfd_set_lock(&ctx->pollfd_set);
+	epoll_fd = ctx->pollfd_set.epoll_fd;
+	generation = ctx->pollfd_set.generation;
+	pollfd_set_unlock(&ctx->pollfd_set);
+
+	if (epoll_fd < 0)
+		return -1;
+
+	do {
+		nb = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, 0);
+	} while ((nb < 0) && (errno == EINTR));
+	if (nb < 0)
+		return -1;
+
+	CDBUS_PROBE1(events_begin, nb);
+	for (i = 0 ; i < nb ; i++) {
+		revents = 0;
+		if (events[i].events & EPOLLERR)
+			revents |= POLLERR;
+		if (events[i].events & EPOLLHUP)
+			revents |= POLLHUP;
+		if (events[i].events & (EPOLLIN | EPOLLPRI))
+			revents |= POLLIN;
+		if (events[i].events & EPOLLOUT)
+			revents |= POLLOUT;
+
+		/* The watches sharing the fd are handled one by one. If a
+		   handler modified the set, the remaining events are left
+		   for the next call: epoll is level triggered */
+		pollfd_set_lock(&ctx->pollfd_set);
+		if (ctx->pollfd_set.generation != generation) {
+			pollfd_set_unlock(&ctx->pollfd_set);
+			break;
+		}
+		wfd = events[i].data.ptr;
+		watch = wfd->watches;
+		while (watch) {
+			pollfd_set_unlock(&ctx->pollfd_set);
+			watch_handle(watch, revents);
+			pollfd_set_lock(&ctx->pollfd_set);
+			if (ctx->pollfd_set.generation != generation)
+				break;
+			watch = watch->fd_next;
+		}
+		pollfd_set_unlock(&ctx->pollfd_set);
+	}
+	CDBUS_PROBE1(events_end, nb);
+
+	cdbus_context_timeout_handle(ctx);
+
+	return 0;
+}
+
+int cdbus_handle_events()
+{
+	return cdbus_context_handle_events(&default_context);
+}
+
+/*
+   This function switches the timeouts to the timerfd mode: libcdbus arms a
+   single timerfd on the earliest deadline and adds it to the pollfd set and
+   to the epoll instance, like any other watch. The expired timeouts are then
+   handled by cdbus_handle_pollfds, cdbus_process_pollfds or
+   cdbus_handle_events, and cdbus_next_timeout_event always returns -1.
+   Return the timerfd, or -1 on error.
+ */
+int cdbus_context_enable_timerfd(struct cdbus_context_t * ctx)
+{
+	int fd;
+
+	heap_lock(&ctx->timeout_heap);
+	fd = ctx->timer_fd;
+	heap_unlock(&ctx->timeout_heap);
+	if (fd >= 0)
+		return fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	memset(&ctx->timer_watch, 0, sizeof(ctx->timer_watch));
+	ctx->timer_watch.fd = fd;
+	ctx->timer_watch.ctx = ctx;
+	ctx->timer_watch.handle = timer_handle;
+	if (pollfd_set_add(&ctx->pollfd_set, &ctx->timer_watch) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	heap_lock(&ctx->timeout_heap);
+	ctx->timer_fd = fd;
+	ctx->timer_deadline = 0;
+	__timer_rearm(ctx);
+	heap_unlock(&ctx->timeout_heap);
+
+	return fd;
+}
+
+int cdbus_enable_timerfd()
+{
+	return cdbus_context_enable_timerfd(&default_context);
+}
+
+/* Return the time to the next timeout (in ms) */
+int cdbus_context_next_timeout_event(struct cdbus_context_t * ctx)
+{
+	struct heap_item_t *item;
+	unsigned long long deadline;
+	unsigned long long now;
+
+	heap_lock(&ctx->timeout_heap);
+	if (ctx->timer_fd >= 0) {
+		/* In timerfd mode, the expiration is reported by the
+		   timerfd */
+		heap_unlock(&ctx->timeout_heap);
+		return -1;
+	}
+	item = __heap_get_first(&ctx->timeout_heap);
+	if (item)
+		deadline = item->key;
+	heap_unlock(&ctx->timeout_heap);
+
+	if (list_get_nb(&ctx->dispatch_list))
+		return 0;
+	if (!item)
+		return -1;
+
+	now = monotonic_ms();
+	return (deadline <= now) ? 0 : (int)(deadline - now);
+}
+
+int cdbus_next_timeout_event()
+{
+	return cdbus_context_next_timeout_event(&default_context);
+}
+
+/* This function must be called when a timeout occurs */
+int cdbus_context_timeout_handle(struct cdbus_context_t * ctx)
+{
+	unsigned long long now;
+	struct timeout_t *timeout;
+	struct heap_item_t *item;
+	int nb = 0;
+
+	now = monotonic_ms();
+	CDBUS_PROBE1(timeouts_begin, ctx);
+
+	/* Only the expired timers are visited */
+	while (1) {
+		heap_lock(&ctx->timeout_heap);
+		item = __heap_get_first(&ctx->timeout_heap);
+		if (!item || (item->key > now)) {
+			__timer_rearm(ctx);
+			heap_unlock(&ctx->timeout_heap);
+			break;
+		}
+		__heap_rem_item(item);
+		heap_unlock(&ctx->timeout_heap);
+
+		timeout = container_of(item, struct timeout_t, hitem);
+		nb++;
+
+		if (timeout->dbtimeout) {
+			/* D-Bus timeouts are periodic, the timeout is
+			   rearmed before the handler is called because the
+			   handler may remove it. The deadline is at least
+			   one ms in the future so that a null interval can't
+			   make this loop endless */
+			timeout_enable_at(timeout, now +
+					(timeout->interval ? timeout->interval : 1));
+			LOG(LOG_DEBUG, "timeout handle\n");
+			dbus_timeout_handle(timeout->dbtimeout);
+		} else if (timeout->cb) {
+			if (!timeout->oneshot)
+				timeout_enable_at(timeout, now +
+					(timeout->interval ? timeout->interval : 1));
+			timeout->cb(timeout, timeout->cb_data);
+			if (timeout->oneshot)
+				free(timeout);
+		}
+	}
+
+	/* The timeout handlers may have queued messages too */
+	dispatch_pending(ctx);
+
+	/* The timerfd was armed for the dispatches, it must now be armed on
+	   the earliest deadline */
+	heap_lock(&ctx->timeout_heap);
+	__timer_rearm(ctx);
+	heap_unlock(&ctx->timeout_heap);
+	CDBUS_PROBE1(timeouts_end, nb);
+
+	return 0;
+}
+
+int cdbus_timeout_handle()
+{
+	return cdbus_context_timeout_handle(&default_context);
+}
+
+static int extstr_init(struct extensible_string_t * str)
+{
+	str->size = 0;
+	str->buf_size = 0;
+	str->buffer = malloc(EXTSTR_BUFF_SIZE);
+	if (!str->buffer)
+		return -1;
+	str->buf_size = EXTSTR_BUFF_SIZE;
+	str->buffer[0] = 0;
+	return 0;
+}
+
+static void extstr_free(struct extensible_string_t * str)
+{
+	if (str->buffer) {
+		free(str->buffer);
+		str->buffer = NULL;
+	}
+	str->size = 0;
+	str->buf_size = 0;
+}
+
+/* Make room for at least len more characters and the trailing null byte.
+   The buffer size is doubled to keep the number of realloc low */
+static int extstr_extend(struct extensible_string_t * str, int len)
+{
+	char * buf;
+	int buf_size = str->buf_size;
+
+	if (str->size + len < buf_size)
+		return 0;
+
+	while (str->size + len >= buf_size)
+		buf_size *= 2;
+
+	buf = realloc(str->buffer, buf_size);
+
+	if (!buf)
+		return -1;
+
+	str->buffer = buf;
+	str->buf_size = buf_size;
+	return 0;
+}
+
+static int extstr_append(struct extensible_string_t * str,
+			const char * string, int len)
+{
+	if (extstr_extend(str, len) < 0)
+		return -1;
+
+	memcpy(EXTSTR_BUFFER(str), string, len);
+	str->size += len;
+	str->buffer[str->size] = 0;
+	return 0;
+}
+
+static int extstr_append_sprintf(struct extensible_string_t * str,
+			const char * format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(EXTSTR_BUFFER(str),
+		EXTSTR_REM_SIZE(str),
+		format,
+		ap);
+	va_end(ap);
+
+	if (n < 0)
+		return -1;
+
+	/* The output has been truncated: the buffer is extended to the
+	   needed size and the string formatted again */
+	if (n >= EXTSTR_REM_SIZE(str)) {
+		if (extstr_extend(str, n) < 0)
+			return -1;
+
+		va_start(ap, format);
+		n = vsnprintf(EXTSTR_BUFFER(str),
+			EXTSTR_REM_SIZE(str),
+			format,
+			ap);
+		va_end(ap);
+	}
+
+	str->size += n;
+
+	return 0;
+}
+
+static int generate_argument_xml(struct extensible_string_t * str,
+			struct cdbus_arg_entry_t * arg)
+{
+	int ret;
+	ret = extstr_append_sprintf(str,
+				"<arg name=\"%s\" "
+				"type=\"%s\" "
+				"direction=\"%s\" />",
+				arg->arg_name,
+				arg->signature,
+				(arg->direction == CDBUS_DIRECTION_IN) ? "in" : "out");
+	return ret;
+}
+
+
+static int generate_message_xml(struct extensible_string_t * str,
+			struct cdbus_message_entry_t * msg)
+{
+	int ret;
+	struct cdbus_arg_entry_t *arg = msg->msg_table;
+
+	if (!msg->is_signal) {
+		ret = extstr_append_sprintf(str,
+					"<method name=\"%s\">",
+					msg->msg_name);
+	} else {
+		ret = extstr_append_sprintf(str,
+					"<signal name=\"%s\">",
+					msg->msg_name);
+	}
+	if (ret < 0)
+		return -1;
+
+	while(arg->arg_name) {
+		generate_argument_xml(str, arg);
+		arg++;
+	}
+
+	if (!msg->is_signal) {
+		ret = extstr_append_sprintf(str,
+					"</method>");
+	} else {
+		ret = extstr_append_sprintf(str,
+					"</signal>");
+	}
+	if (ret < 0)
+		return -1;
+
+	return 0;
+}
+
+static const char * property_access_names[] = {
+	[CDBUS_PROPERTY_READ] = "read",
+	[CDBUS_PROPERTY_WRITE] = "write",
+	[CDBUS_PROPERTY_READ | CDBUS_PROPERTY_WRITE] = "readwrite",
+};
+
+static const char * property_emits_names[] = {
+	[CDBUS_PROPERTY_EMITS_CHANGED] = "true",
+	[CDBUS_PROPERTY_EMITS_INVALIDATES] = "invalidates",
+	[CDBUS_PROPERTY_EMITS_NONE] = "false",
+};
+
+static int generate_property_xml(struct extensible_string_t * str,
+			struct cdbus_property_entry_t * prop)
+{
+	if (prop->emits == CDBUS_PROPERTY_EMITS_CHANGED)
+		return extstr_append_sprintf(str,
+					"<property name=\"%s\" "
+					"type=\"%s\" "
+					"access=\"%s\" />",
+					prop->prop_name,
+					prop->signature,
+					property_access_names[prop->access]);
+
+	return extstr_append_sprintf(str,
+				"<property name=\"%s\" "
+				"type=\"%s\" "
+				"access=\"%s\">"
+				"<annotation name=\"%s\" value=\"%s\" />"
+				"</property>",
+				prop->prop_name,
+				prop->signature,
+				property_access_names[prop->access],
+				"org.freedesktop.DBus.Property.EmitsChangedSignal",
+				property_emits_names[prop->emits]);
+}
+
+static int generate_interface_xml(struct extensible_string_t * str,
+			struct cdbus_interface_entry_t * itf)
+{
+	int ret;
+	struct cdbus_message_entry_t *msg = itf->itf_table;
+	struct cdbus_property_entry_t *prop = itf->itf_props;
+
+	if (itf->itf_xml)
+		return extstr_append(str, itf->itf_xml, strlen(itf->itf_xml));
+
+	ret = extstr_append_sprintf(str,
+				"<interface name=\"%s\">",
+				itf->itf_name);
+	if (ret < 0)
+		return -1;
+
+	while (msg->msg_name) {
+		ret = generate_message_xml(str, msg);
+		if (ret < 0)
+			return -1;
+		msg++;
+	}
+
+	while (prop && prop->prop_name) {
+		ret = generate_property_xml(str, prop);
+		if (ret < 0)
+			return -1;
+		prop++;
+	}
+
+	ret = extstr_append_sprintf(str,
+				"</interface>");
+	if (ret < 0)
+		return -1;
+
+	return 0;
+}
+
+
+static const char properties_xml[] =
+	"<interface name=\"" DBUS_INTERFACE_PROPERTIES "\">"
+	"<method name=\"Get\">"
+	"<arg name=\"interface_name\" type=\"s\" direction=\"in\" />"
+	"<arg name=\"property_name\" type=\"s\" direction=\"in\" />"
+	"<arg name=\"value\" type=\"v\" direction=\"out\" />"
+	"</method>"
+	"<method name=\"GetAll\">"
+	"<arg name=\"interface_name\" type=\"s\" direction=\"in\" />"
+	"<arg name=\"props\" type=\"a{sv}\" direction=\"out\" />"
+	"</method>"
+	"<method name=\"Set\">"
+	"<arg name=\"interface_name\" type=\"s\" direction=\"in\" />"
+	"<arg name=\"property_name\" type=\"s\" direction=\"in\" />"
+	"<arg name=\"value\" type=\"v\" direction=\"in\" />"
+	"</method>"
+	"<signal name=\"PropertiesChanged\">"
+	"<arg name=\"interface_name\" type=\"s\" />"
+	"<arg name=\"changed_properties\" type=\"a{sv}\" />"
+	"<arg name=\"invalidated_properties\" type=\"as\" />"
+	"</signal>"
+	"</interface>";
+
+static const char stats_xml[] =
+	"<interface name=\"" CDBUS_INTERFACE_STATS "\">"
+	"<method name=\"GetStats\">"
+	"<arg name=\"stats\" type=\"a(ssttttttat)\" direction=\"out\" />"
+	"</method>"
+	"<method name=\"Reset\">"
+	"</method>"
+	"</interface>";
+
+/* Return 1 if statistics are gathered for the members of the table */
+static int table_has_stats(struct cdbus_interface_entry_t * table)
+{
+	struct cdbus_interface_entry_t *itf;
+	struct cdbus_message_entry_t *msg;
+
+	for (itf = table ; itf->itf_name ; itf++) {
+		for (msg = itf->itf_table ; msg->msg_name ; msg++) {
+			if (msg->msg_stats)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int generate_table_xml(struct extensible_string_t * str,
+			struct cdbus_interface_entry_t * table)
+{
+	int ret;
+	int props = 0;
+
+	struct cdbus_interface_entry_t *itf = table;
+	ret = extstr_append_sprintf(str, "%s\n",
+				DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE);
+	if (ret < 0)
+		return -1;
+
+	ret = extstr_append_sprintf(str, "<node>");
+	if (ret < 0)
+		return -1;
+
+	while(itf->itf_name) {
+		ret = generate_interface_xml(str, itf);
+		if (ret < 0)
+			return -1;
+		if (itf->itf_props)
+			props = 1;
+		itf++;
+	}
+
+	/* The Properties and Stats interfaces are implemented by libcdbus */
+	if (props && !find_interface(DBUS_INTERFACE_PROPERTIES, table)) {
+		ret = extstr_append(str, properties_xml,
+				strlen(properties_xml));
+		if (ret < 0)
+			return -1;
+	}
+
+	if (table_has_stats(table) && !find_interface(CDBUS_INTERFACE_STATS, table))
+		return extstr_append(str, stats_xml, strlen(stats_xml));
+
+	return 0;
+}
+
+/* Return the cached introspection data of the table, build it if needed */
+static struct xml_cache_t * get_table_xml(struct cdbus_interface_entry_t * table)
+{
+	struct list_item_t *item;
+	struct xml_cache_t *cache;
+	struct extensible_string_t str;
+
+	list_lock(&xml_cache_list);
+	__for_each_list_item(&xml_cache_list, item, item, cache) {
+		if (cache->table == table)
+			break;
+	}
+
+	if (cache)
+		goto unlock;
+
+	if (extstr_init(&str) < 0)
+		goto unlock;
+
+	if (generate_table_xml(&str, table) < 0)
+		goto free;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		goto free;
+	memset(cache, 0, sizeof(*cache));
+	LIST_ITEM_INIT(cache->item);
+
+	cache->table = table;
+	cache->xml = str.buffer;
+	cache->size = str.size;
+	__list_add_tail(&xml_cache_list, &cache->item);
+	goto unlock;
+
+free:
+	extstr_free(&str);
+unlock:
+	list_unlock(&xml_cache_list);
+	return cache;
+}
+
+static const char object_manager_xml[] =
+	"<interface name=\"" CDBUS_INTERFACE_OBJECT_MANAGER "\">"
+	"<method name=\"GetManagedObjects\">"
+	"<arg name=\"objects\" type=\"a{oa{sa{sv}}}\" direction=\"out\" />"
+	"</method>"
+	"<signal name=\"InterfacesAdded\">"
+	"<arg name=\"object\" type=\"o\" />"
+	"<arg name=\"interfaces\" type=\"a{sa{sv}}\" />"
+	"</signal>"
+	"<signal name=\"InterfacesRemoved\">"
+	"<arg name=\"object\" type=\"o\" />"
+	"<arg name=\"interfaces\" type=\"as\" />"
+	"</signal>"
+	"</interface>";
+
+static int name_cmp(const void * name1, const void * name2)
+{
+	return strcmp(*(char * const *)name1, *(char * const *)name2);
+}
+
+static int name_array_add(char *** names, int * nb, int * size,
+			const char * name, size_t len)
+{
+	char ** array;
+
+	if (*nb == *size) {
+		array = realloc(*names, sizeof(*array) * (*size ? *size * 2 : 16));
+		if (!array)
+			return -1;
+		*names = array;
+		*size = *size ? *size * 2 : 16;
+	}
+
+	(*names)[*nb] = strndup(name, len);
+	if (!(*names)[*nb])
+		return -1;
+	(*nb)++;
+
+	return 0;
+}
+
+/* Append the children nodes of path, the ones registered with libdbus and
+   the children of its node in the subtree path belongs to */
+static int generate_children_xml(DBusConnection * cnx,
+				struct cdbus_context_t * ctx,
+				const char * path,
+				struct extensible_string_t * str)
+{
+	struct list_item_t *item;
+	struct path_node_t *node;
+	struct path_node_t *child;
+	struct subtree_t *subtree;
+	char **strarr, **curr;
+	char **names = NULL;
+	const char *name;
+	size_t len = strlen(path);
+	int nb = 0, size = 0;
+	int ret = 0;
+	int i;
+
+	if (dbus_connection_list_registered(cnx, path, &strarr)) {
+		for (curr = strarr ; *curr && !ret ; curr++)
+			ret = name_array_add(&names, &nb, &size, *curr,
+					strlen(*curr));
+		dbus_free_string_array(strarr);
+	}
+
+	list_lock(&ctx->subtree_list);
+	subtree = __subtree_of(ctx, cnx, path);
+	list_unlock(&ctx->subtree_list);
+
+	if (subtree && !ret) {
+		hash_lock(&ctx->node_index);
+		node = __path_node_lookup(ctx, cnx, path);
+		if (node) {
+			__for_each_list_item(&node->children, item, item,
+					child) {
+				name = child->path + ((len > 1) ? len + 1 : 1);
+				ret = name_array_add(&names, &nb, &size, name,
+						strlen(name));
+				if (ret < 0)
+					break;
+			}
+		}
+		hash_unlock(&ctx->node_index);
+	}
+
+	/* The children are listed in order, a path may also have been
+	   registered with libdbus */
+	if (!ret && nb)
+		qsort(names, nb, sizeof(*names), name_cmp);
+	for (i = 0 ; (i < nb) && !ret ; i++) {
+		if (i && !strcmp(names[i], names[i - 1]))
+			continue;
+		ret = extstr_append_sprintf(str, "<node name=\"%s\"/>",
+					names[i]);
+	}
+
+	for (i = 0 ; i < nb ; i++)
+		free(names[i]);
+	free(names);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+static int generate_object_xml(DBusConnection * cnx,
+			DBusMessage * msg,
+			struct extensible_string_t * str,
+			struct object_t * object)
+{
+	int ret;
+
+	struct xml_cache_t *cache;
+	struct object_manager_t *manager;
+
+	cache = get_table_xml(object->user_data->object_table);
+	if (!cache)
+		return -1;
+
+	ret = extstr_append(str, cache->xml, cache->size);
+	if (ret < 0)
+		return -1;
+
+	list_lock(&object->ctx->manager_list);
+	manager = __manager_at(object->ctx, cnx, dbus_message_get_path(msg));
+	list_unlock(&object->ctx->manager_list);
+	if (manager) {
+		ret = extstr_append(str, object_manager_xml,
+				strlen(object_manager_xml));
+		if (ret < 0)
+			return -1;
+	}
+
+	ret = generate_children_xml(cnx, object->ctx,
+				dbus_message_get_path(msg), str);
+	if (ret < 0)
+		return -1;
+
+	ret = extstr_append_sprintf(str, "</node>");
+
+	if (ret < 0)
+		return -1;
+
+	return 0;
+}
+
+
+static int object_introspect(DBusConnection *cnx,
+		DBusMessage *msg,
+		struct object_t * object)
+{
+	struct extensible_string_t str;
+	int ret = 0;
+	DBusMessage *reply;
+
+	/* The children nodes only change when objects are registered or
+	   unregistered below the path */
+	if (!object->xml || object->xml_stale) {
+		if (extstr_init(&str) < 0)
+			return -1;
+
+		ret = generate_object_xml(cnx, msg, &str, object);
+		if (ret < 0) {
+			extstr_free(&str);
+			return -1;
+		}
+
+		if (object->xml)
+			free(object->xml);
+		object->xml = str.buffer;
+		object->xml_stale = 0;
+	}
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return -1;
+
+	if (dbus_message_append_args(reply,
+					DBUS_TYPE_STRING,
+					&object->xml,
+					DBUS_TYPE_INVALID) == FALSE) {
+		ret = -1;
+		goto msg_unref;
+	}
+
+	dbus_connection_send(cnx, reply, NULL);
+
+msg_unref:
+	dbus_message_unref(reply);
+	return ret;
+}
+
+static int send_error(DBusConnection *cnx, DBusMessage *msg,
+		const char *name, const char *message)
+{
+	DBusMessage *reply;
+
+	reply = dbus_message_new_error(msg, name, message);
+	if (!reply)
+		return -1;
+
+	dbus_connection_send(cnx, reply, NULL);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+static void pool_job_free(struct pool_job_t *job)
+{
+	dbus_message_unref(job->msg);
+	dbus_connection_unref(job->cnx);
+	free(job);
+}
+
+/* Answer a call which won't be run and free it */
+static void pool_job_drop(struct pool_job_t *job, const char *reason)
+{
+	if (!dbus_message_get_no_reply(job->msg)
+		&& (send_error(job->cnx, job->msg, DBUS_ERROR_FAILED, reason) < 0))
+		LOG(LOG_WARNING, "Failed to answer member %s of object %s\n",
+			dbus_message_get_member(job->msg),
+			dbus_message_get_path(job->msg));
+	pool_job_free(job);
+}
+
+/* Drop the queued calls of the object and wait for the running ones,
+   except the one of the calling worker if any */
+static void pool_drain(struct cdbus_pool_t *pool, struct object_t *object)
+{
+	DECLARE_LIST_INIT(dropped);
+	struct list_item_t *item;
+	struct pool_job_t *job;
+	int running;
+
+	pthread_mutex_lock(&pool->lock);
+	__for_each_list_item(&pool->jobs, item, item, job) {
+		if (job->object != object)
+			continue;
+		__list_rem_item(&job->item);
+		__list_add_tail(&dropped, &job->item);
+	}
+
+	do {
+		running = 0;
+		__for_each_list_item(&pool->running, item, item, job) {
+			if ((job->object == object)
+				&& !pthread_equal(job->thread, pthread_self()))
+				running = 1;
+		}
+		if (running)
+			pthread_cond_wait(&pool->done, &pool->lock);
+	} while (running);
+	pthread_mutex_unlock(&pool->lock);
+
+	while ((item = __list_get_first(&dropped))) {
+		__list_rem_item(item);
+		pool_job_drop(container_of(item, struct pool_job_t, item),
+			"The object was unregistered");
+	}
+}
+
+static void *pool_worker(void *data)
+{
+	struct cdbus_pool_t *pool = data;
+	struct list_item_t *item;
+	struct pool_job_t *job;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stop && !__list_get_nb(&pool->jobs))
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->stop)
+			break;
+
+		item = __list_get_first(&pool->jobs);
+		__list_rem_item(item);
+		job = container_of(item, struct pool_job_t, item);
+		job->thread = pthread_self();
+		__list_add_tail(&pool->running, &job->item);
+		pthread_mutex_unlock(&pool->lock);
+
+		/* The proxy unpacks the arguments, calls the handler and sends
+		   the reply from this thread */
+		if (member_call(job->msg_entry, job->cnx, job->msg,
+				job->user_data) < 0)
+			LOG(LOG_WARNING, "Failed to execute handler for member %s "
+				"of object %s\n", dbus_message_get_member(job->msg),
+				dbus_message_get_path(job->msg));
+
+		pthread_mutex_lock(&pool->lock);
+		__list_rem_item(&job->item);
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+		pool_job_free(job);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static int pool_push(struct cdbus_pool_t *pool, struct object_t *object,
+		DBusConnection *cnx, DBusMessage *msg,
+		struct cdbus_message_entry_t *msg_entry, void *user_data)
+{
+	struct pool_job_t *job;
+
+	job = malloc(sizeof(*job));
+	if (!job)
+		return -1;
+	LIST_ITEM_INIT(job->item);
+	job->cnx = dbus_connection_ref(cnx);
+	job->msg = dbus_message_ref(msg);
+	job->msg_entry = msg_entry;
+	job->user_data = user_data;
+	job->object = object;
+
+	pthread_mutex_lock(&pool->lock);
+	__list_add_tail(&pool->jobs, &job->item);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/*
+   Create a pool of nb_threads worker threads. The methods bound to the pool
+   with cdbus_object_set_pool are run by the workers, which also send the
+   replies. The library must be built with THREAD_SAFE, the watches being
+   updated from the worker threads.
+ */
+struct cdbus_pool_t * cdbus_pool_create(int nb_threads)
+{
+	struct cdbus_pool_t *pool;
+
+#ifndef LIBUTILS_PTHREAD_LOCK
+	LOG(LOG_ERR, "libcdbus is not thread safe, pools are not supported\n");
+	return NULL;
+#endif
+
+	if (nb_threads <= 0)
+		return NULL;
+
+	if (dbus_threads_init_default() == FALSE)
+		return NULL;
+
+	pool = malloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+
+	pool->threads = malloc(sizeof(*pool->threads) * nb_threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	LIST_INIT(pool->jobs);
+	LIST_INIT(pool->running);
+
+	for (pool->nb_threads = 0 ; pool->nb_threads < nb_threads ;
+	     pool->nb_threads++) {
+		if (pthread_create(&pool->threads[pool->nb_threads], NULL,
+					pool_worker, pool)) {
+			cdbus_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/* Stop the workers once they have finished their current call, the
+   pending calls are answered with an error. The pool must not be bound to
+   any object anymore */
+void cdbus_pool_destroy(struct cdbus_pool_t * pool)
+{
+	struct list_item_t *item;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0 ; i < pool->nb_threads ; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	while ((item = __list_get_first(&pool->jobs))) {
+		__list_rem_item(item);
+		pool_job_drop(container_of(item, struct pool_job_t, item),
+			"The worker pool was destroyed");
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/* Return the pool of the most specific binding matching the method */
+static struct cdbus_pool_t * object_get_pool(struct object_t * object,
+					const char * interface,
+					const char * member)
+{
+	struct list_item_t * item;
+	struct pool_binding_t * binding;
+	struct cdbus_pool_t * pool = NULL;
+	int score = -1;
+	int curr;
+
+	__for_each_list_item(&object->pools, item, item, binding) {
+		if (binding->interface && !str_equal(binding->interface, interface))
+			continue;
+		if (binding->member && strcmp(binding->member, member))
+			continue;
+		curr = (binding->interface ? 2 : 0) + (binding->member ? 1 : 0);
+		if (curr > score) {
+			score = curr;
+			pool = binding->pool;
+		}
+	}
+
+	return pool;
+}
+
+static void object_lock(struct object_t *object)
+{
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_lock(&object->lock);
+#endif
+}
+
+static void object_unlock(struct object_t *object)
+{
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_unlock(&object->lock);
+#endif
+}
+
+/* Append a copy of the remaining values of from to to. The fixed arrays
+   are copied at once */
+static int iter_copy(DBusMessageIter *from, DBusMessageIter *to)
+{
+	DBusMessageIter from_sub, to_sub;
+	union {
+		dbus_uint64_t u64;
+		double dbl;
+		const char *str;
+		int fd;
+	} value;
+	const void *items;
+	char *signature;
+	int type, elt_type, nb, ret;
+
+	while ((type = dbus_message_iter_get_arg_type(from))
+		!= DBUS_TYPE_INVALID) {
+		if (dbus_type_is_basic(type)) {
+			dbus_message_iter_get_basic(from, &value);
+			ret = dbus_message_iter_append_basic(to, type, &value);
+			/* Both calls duplicate the descriptor */
+			if (type == DBUS_TYPE_UNIX_FD)
+				close(value.fd);
+			if (ret == FALSE)
+				return -1;
+			dbus_message_iter_next(from);
+			continue;
+		}
+
+		/* The array signature is given without its leading 'a' */
+		signature = NULL;
+		dbus_message_iter_recurse(from, &from_sub);
+		if (type == DBUS_TYPE_VARIANT)
+			signature = dbus_message_iter_get_signature(&from_sub);
+		else if (type == DBUS_TYPE_ARRAY)
+			signature = dbus_message_iter_get_signature(from);
+		ret = dbus_message_iter_open_container(to, type,
+				(signature && (type == DBUS_TYPE_ARRAY)) ?
+				signature + 1 : signature, &to_sub);
+		dbus_free(signature);
+		if (ret == FALSE)
+			return -1;
+
+		elt_type = DBUS_TYPE_INVALID;
+		if (type == DBUS_TYPE_ARRAY)
+			elt_type = dbus_message_iter_get_element_type(from);
+		if ((elt_type != DBUS_TYPE_INVALID)
+			&& (elt_type != DBUS_TYPE_UNIX_FD)
+			&& dbus_type_is_fixed(elt_type)) {
+			dbus_message_iter_get_fixed_array(&from_sub, &items, &nb);
+			ret = (dbus_message_iter_append_fixed_array(&to_sub,
+						elt_type, &items, nb) == TRUE) ?
+				0 : -1;
+		} else {
+			ret = iter_copy(&from_sub, &to_sub);
+		}
+		if ((dbus_message_iter_close_container(to, &to_sub) == FALSE)
+			|| (ret < 0))
+			return -1;
+		dbus_message_iter_next(from);
+	}
+
+	return 0;
+}
+
+/* Append a copy of the body of msg to iter */
+static int message_copy_body(DBusMessage *msg, DBusMessageIter *iter)
+{
+	DBusMessageIter from;
+
+	dbus_message_iter_init(msg, &from);
+	return iter_copy(&from, iter);
+}
+
+/* Allocate the property sets of the interfaces having properties */
+static int object_props_init(struct object_t *object)
+{
+	struct cdbus_interface_entry_t *itf;
+	struct cdbus_property_entry_t *prop;
+	struct property_set_t *set;
+	int nb = 0;
+
+	for (itf = object->user_data->object_table ; itf->itf_name ; itf++)
+		if (itf->itf_props)
+			nb++;
+	if (!nb)
+		return 0;
+
+	object->props = calloc(nb, sizeof(*object->props));
+	if (!object->props)
+		return -1;
+
+	for (itf = object->user_data->object_table ; itf->itf_name ; itf++) {
+		if (!itf->itf_props)
+			continue;
+		set = &object->props[object->nb_props++];
+		set->itf = itf;
+		for (prop = itf->itf_props ; prop->prop_name ; prop++)
+			set->nb++;
+		set->values = calloc(set->nb ? set->nb : 1,
+				sizeof(*set->values));
+		if (!set->values)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void object_props_free(struct object_t *object)
+{
+	struct property_set_t *set;
+	int i, j;
+
+	for (i = 0 ; i < object->nb_props ; i++) {
+		set = &object->props[i];
+		for (j = 0 ; set->values && (j < set->nb) ; j++)
+			if (set->values[j].value)
+				dbus_message_unref(set->values[j].value);
+		free(set->values);
+		if (set->all)
+			dbus_message_unref(set->all);
+	}
+	free(object->props);
+	object->props = NULL;
+	object->nb_props = 0;
+}
+
+static struct property_set_t * object_props_lookup(struct object_t *object,
+						const char *interface)
+{
+	int i;
+
+	for (i = 0 ; i < object->nb_props ; i++)
+		if (!strcmp(object->props[i].itf->itf_name, interface))
+			return &object->props[i];
+
+	return NULL;
+}
+
+static int property_lookup(struct property_set_t *set, const char *name)
+{
+	int i;
+
+	for (i = 0 ; i < set->nb ; i++)
+		if (!strcmp(set->itf->itf_props[i].prop_name, name))
+			return i;
+
+	return -1;
+}
+
+/* Arm the changed timeout of the object on the next loop iteration, return
+   1 if it was not armed */
+static int object_schedule(struct object_t *object)
+{
+	struct cdbus_context_t *ctx = object->ctx;
+	struct timeout_t *timeout = &object->changed_timeout;
+	int ret = 0;
+
+	heap_lock(&ctx->timeout_heap);
+	if (!heap_item_get_heap(&timeout->hitem)) {
+		timeout->hitem.key = monotonic_ms();
+		__heap_add(&ctx->timeout_heap, &timeout->hitem);
+		__timer_rearm(ctx);
+		ret = 1;
+	}
+	heap_unlock(&ctx->timeout_heap);
+
+	return ret;
+}
+
+/* Must be called with the object locked. Take over the reference on value
+   and schedule the PropertiesChanged signal, return 1 if the loop must be
+   woken up */
+static int __property_store(struct object_t *object,
+			struct property_set_t *set, int index,
+			DBusMessage *value)
+{
+	struct property_value_t *val = &set->values[index];
+
+	if (val->value)
+		dbus_message_unref(val->value);
+	val->value = value;
+	if (set->all) {
+		dbus_message_unref(set->all);
+		set->all = NULL;
+	}
+
+	if (set->itf->itf_props[index].emits == CDBUS_PROPERTY_EMITS_NONE)
+		return 0;
+	val->changed = 1;
+	set->changed = 1;
+
+	/* The changes are sent on the next loop iteration */
+	return object_schedule(object);
+}
+
+/* Must be called with the object locked */
+static void __property_set_clear_changed(struct property_set_t *set)
+{
+	int i;
+
+	for (i = 0 ; i < set->nb ; i++)
+		set->values[i].changed = 0;
+	set->changed = 0;
+}
+
+/* Must be called with the object locked. Append the a{sv} of the readable
+   properties holding a value */
+static int __property_set_append_all(struct property_set_t *set,
+				DBusMessageIter *iter)
+{
+	struct cdbus_property_entry_t *prop;
+	DBusMessageIter sub_iter, entry_iter;
+	int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}",
+					&sub_iter);
+	for (i = 0 ; i < set->nb ; i++) {
+		prop = &set->itf->itf_props[i];
+		if (!(prop->access & CDBUS_PROPERTY_READ) || !set->values[i].value)
+			continue;
+		dbus_message_iter_open_container(&sub_iter,
+						DBUS_TYPE_DICT_ENTRY, NULL,
+						&entry_iter);
+		dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING,
+					&prop->prop_name);
+		if (message_copy_body(set->values[i].value, &entry_iter) < 0) {
+			dbus_message_iter_abandon_container(&sub_iter,
+							&entry_iter);
+			dbus_message_iter_abandon_container(iter, &sub_iter);
+			return -1;
+		}
+		dbus_message_iter_close_container(&sub_iter, &entry_iter);
+	}
+	dbus_message_iter_close_container(iter, &sub_iter);
+
+	return 0;
+}
+
+/* Must be called with the object locked */
+static DBusMessage * __properties_changed_message(struct object_t *object,
+						struct property_set_t *set)
+{
+	struct cdbus_property_entry_t *prop;
+	struct property_value_t *val;
+	DBusMessageIter iter, sub_iter, entry_iter;
+	DBusMessage *msg;
+	const char *itf_name = set->itf->itf_name;
+	int i;
+
+	msg = dbus_message_new_signal(object->path, DBUS_INTERFACE_PROPERTIES,
+				"PropertiesChanged");
+	if (!msg)
+		return NULL;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &itf_name);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
+					&sub_iter);
+	for (i = 0 ; i < set->nb ; i++) {
+		prop = &set->itf->itf_props[i];
+		val = &set->values[i];
+		if (!val->changed || (prop->emits != CDBUS_PROPERTY_EMITS_CHANGED))
+			continue;
+		dbus_message_iter_open_container(&sub_iter,
+						DBUS_TYPE_DICT_ENTRY, NULL,
+						&entry_iter);
+		dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING,
+					&prop->prop_name);
+		if (message_copy_body(val->value, &entry_iter) < 0)
+			goto err;
+		dbus_message_iter_close_container(&sub_iter, &entry_iter);
+	}
+	dbus_message_iter_close_container(&iter, &sub_iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s",
+					&sub_iter);
+	for (i = 0 ; i < set->nb ; i++) {
+		prop = &set->itf->itf_props[i];
+		val = &set->values[i];
+		if (val->changed
+			&& (prop->emits == CDBUS_PROPERTY_EMITS_INVALIDATES))
+			dbus_message_iter_append_basic(&sub_iter,
+						DBUS_TYPE_STRING,
+						&prop->prop_name);
+	}
+	dbus_message_iter_close_container(&iter, &sub_iter);
+
+	return msg;
+
+err:
+	dbus_message_iter_abandon_container(&sub_iter, &entry_iter);
+	dbus_message_iter_abandon_container(&iter, &sub_iter);
+	dbus_message_unref(msg);
+	return NULL;
+}
+
+/* Must be called with the object locked. The body of the GetAll reply is
+   built once and copied for each request until a property changes */
+static DBusMessage * __property_set_get_all(struct property_set_t *set)
+{
+	DBusMessageIter iter;
+	DBusMessage *all;
+
+	if (set->all)
+		return set->all;
+
+	all = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!all)
+		return NULL;
+	dbus_message_set_no_reply(all, TRUE);
+
+	dbus_message_iter_init_append(all, &iter);
+	if (__property_set_append_all(set, &iter) < 0) {
+		dbus_message_unref(all);
+		return NULL;
+	}
+
+	set->all = all;
+	return all;
+}
+
+static int property_get_all(DBusConnection *cnx, DBusMessage *msg,
+			struct object_t *object, const char *interface)
+{
+	struct property_set_t *set;
+	DBusMessage *reply = NULL;
+	DBusMessage *all;
+	DBusMessageIter iter, sub_iter;
+
+	set = object_props_lookup(object, interface);
+	if (!set) {
+		/* The other interfaces of the object have no property */
+		if (!find_interface(interface, object->user_data->object_table))
+			return send_error(cnx, msg, DBUS_ERROR_UNKNOWN_INTERFACE,
+					interface);
+		reply = dbus_message_new_method_return(msg);
+		if (!reply)
+			return -1;
+		dbus_message_iter_init_append(reply, &iter);
+		dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+						"{sv}", &sub_iter);
+		dbus_message_iter_close_container(&iter, &sub_iter);
+		goto send;
+	}
+
+	object_lock(object);
+	all = __property_set_get_all(set);
+	if (all)
+		reply = dbus_message_copy(all);
+	object_unlock(object);
+	if (!reply)
+		return -1;
+
+	dbus_message_set_reply_serial(reply, dbus_message_get_serial(msg));
+	if (dbus_message_get_sender(msg))
+		dbus_message_set_destination(reply,
+					dbus_message_get_sender(msg));
+
+send:
+	dbus_connection_send(cnx, reply, NULL);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+static int property_get(DBusConnection *cnx, DBusMessage *msg,
+			struct object_t *object, const char *interface,
+			const char *name)
+{
+	struct property_set_t *set;
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	int index, ret;
+
+	set = object_props_lookup(object, interface);
+	index = set ? property_lookup(set, name) : -1;
+	if (index < 0)
+		return send_error(cnx, msg, DBUS_ERROR_UNKNOWN_PROPERTY, name);
+	if (!(set->itf->itf_props[index].access & CDBUS_PROPERTY_READ))
+		return send_error(cnx, msg, DBUS_ERROR_ACCESS_DENIED, name);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return -1;
+	dbus_message_iter_init_append(reply, &iter);
+
+	object_lock(object);
+	ret = set->values[index].value ?
+		message_copy_body(set->values[index].value, &iter) : -1;
+	object_unlock(object);
+	if (ret < 0) {
+		dbus_message_unref(reply);
+		return send_error(cnx, msg, DBUS_ERROR_FAILED,
+				"property not set");
+	}
+
+	dbus_connection_send(cnx, reply, NULL);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+static int property_set(DBusConnection *cnx, DBusMessage *msg,
+			struct object_t *object, const char *interface,
+			const char *name, DBusMessageIter *iter)
+{
+	struct cdbus_property_entry_t *prop;
+	struct property_set_t *set;
+	DBusMessage *value;
+	DBusMessageIter sub_iter, value_iter;
+	char *signature;
+	int index, ret;
+
+	set = object_props_lookup(object, interface);
+	index = set ? property_lookup(set, name) : -1;
+	if (index < 0)
+		return send_error(cnx, msg, DBUS_ERROR_UNKNOWN_PROPERTY, name);
+	prop = &set->itf->itf_props[index];
+	if (!(prop->access & CDBUS_PROPERTY_WRITE))
+		return send_error(cnx, msg, DBUS_ERROR_PROPERTY_READ_ONLY,
+				name);
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT)
+		return send_error(cnx, msg, DBUS_ERROR_INVALID_ARGS, name);
+	dbus_message_iter_recurse(iter, &sub_iter);
+	signature = dbus_message_iter_get_signature(&sub_iter);
+	ret = signature ? strcmp(signature, prop->signature) : -1;
+	dbus_free(signature);
+	if (ret)
+		return send_error(cnx, msg, DBUS_ERROR_INVALID_ARGS, name);
+
+	/* The new value is cached once the handler has accepted it */
+	if (prop->set_fcn
+		&& (prop->set_fcn(cnx, msg, &sub_iter,
+				object->user_data->user_data) < 0))
+		return send_error(cnx, msg, DBUS_ERROR_FAILED, name);
+
+	value = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!value)
+		return -1;
+	dbus_message_iter_init_append(value, &value_iter);
+	if (iter_copy(iter, &value_iter) < 0) {
+		dbus_message_unref(value);
+		return -1;
+	}
+
+	/* Set is handled by the loop thread, no need to wake it up */
+	object_lock(object);
+	__property_store(object, set, index, value);
+	object_unlock(object);
+
+	value = dbus_message_new_method_return(msg);
+	if (!value)
+		return -1;
+	dbus_connection_send(cnx, value, NULL);
+	dbus_message_unref(value);
+	return 0;
+}
+
+/* Serve the org.freedesktop.DBus.Properties methods from the cache */
+static int property_dispatch(DBusConnection *cnx, DBusMessage *msg,
+			struct object_t *object, const char *member)
+{
+	DBusMessageIter iter;
+	const char *interface = NULL;
+	const char *name = NULL;
+
+	dbus_message_iter_init(msg, &iter);
+	if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING) {
+		dbus_message_iter_get_basic(&iter, &interface);
+		dbus_message_iter_next(&iter);
+	}
+	if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING) {
+		dbus_message_iter_get_basic(&iter, &name);
+		dbus_message_iter_next(&iter);
+	}
+	if (!interface)
+		return send_error(cnx, msg, DBUS_ERROR_INVALID_ARGS, member);
+
+	if (!strcmp(member, "GetAll"))
+		return property_get_all(cnx, msg, object, interface);
+	if (!name)
+		return send_error(cnx, msg, DBUS_ERROR_INVALID_ARGS, member);
+	if (!strcmp(member, "Get"))
+		return property_get(cnx, msg, object, interface, name);
+	if (!strcmp(member, "Set"))
+		return property_set(cnx, msg, object, interface, name, &iter);
+
+	return send_error(cnx, msg, DBUS_ERROR_UNKNOWN_METHOD, member);
+}
+
+/* Append the a{sa{sv}} of the interfaces of the object and their
+   properties */
+static int object_append_interfaces(struct object_t *object,
+				DBusMessageIter *iter)
+{
+	struct cdbus_interface_entry_t *itf;
+	struct property_set_t *set;
+	DBusMessageIter sub_iter, entry_iter, props_iter;
+	int ret = 0;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sa{sv}}",
+					&sub_iter);
+	for (itf = object->user_data->object_table ; itf->itf_name ; itf++) {
+		dbus_message_iter_open_container(&sub_iter,
+						DBUS_TYPE_DICT_ENTRY, NULL,
+						&entry_iter);
+		dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING,
+					&itf->itf_name);
+		set = itf->itf_props ? object_props_lookup(object,
+							itf->itf_name) : NULL;
+		if (set) {
+			object_lock(object);
+			ret = __property_set_append_all(set, &entry_iter);
+			object_unlock(object);
+		} else {
+			dbus_message_iter_open_container(&entry_iter,
+							DBUS_TYPE_ARRAY, "{sv}",
+							&props_iter);
+			dbus_message_iter_close_container(&entry_iter,
+							&props_iter);
+		}
+		if (ret < 0) {
+			dbus_message_iter_abandon_container(&sub_iter,
+							&entry_iter);
+			dbus_message_iter_abandon_container(iter, &sub_iter);
+			return -1;
+		}
+		dbus_message_iter_close_container(&sub_iter, &entry_iter);
+	}
+	dbus_message_iter_close_container(iter, &sub_iter);
+
+	return 0;
+}
+
+/* Return the path of the manager of the object, NULL if it is not
+   managed. The placeholders of the managers are never reported */
+static char * object_manager_path(struct object_t *object)
+{
+	struct object_manager_t *manager;
+	char *path = NULL;
+
+	if (object->user_data == &manager_user_data)
+		return NULL;
+
+	list_lock(&object->ctx->manager_list);
+	manager = __manager_of(object->ctx, object->cnx, object->path);
+	if (manager)
+		path = strdup(manager->path);
+	list_unlock(&object->ctx->manager_list);
+
+	return path;
+}
+
+/* Send InterfacesAdded with the current values of the properties, return
+   -1 if the object is not managed */
+static int interfaces_added(struct object_t *object)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter;
+	char *path;
+	int i;
+
+	path = object_manager_path(object);
+	if (!path)
+		return -1;
+	msg = dbus_message_new_signal(path, CDBUS_INTERFACE_OBJECT_MANAGER,
+				"InterfacesAdded");
+	free(path);
+	if (!msg)
+		return -1;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
+				&object->path);
+	/* The signals of the objects of a manager differ by their first
+	   argument only, they must not replace each other */
+	if (object_append_interfaces(object, &iter) == 0)
+		signal_send(object->cnx, msg, 0);
+	dbus_message_unref(msg);
+
+	/* The values sent are the ones of the changes */
+	object_lock(object);
+	for (i = 0 ; i < object->nb_props ; i++)
+		__property_set_clear_changed(&object->props[i]);
+	object_unlock(object);
+
+	return 0;
+}
+
+static void interfaces_removed(struct object_t *object)
+{
+	struct cdbus_interface_entry_t *itf;
+	DBusMessage *msg;
+	DBusMessageIter iter, sub_iter;
+	char *path;
+
+	path = object_manager_path(object);
+	if (!path)
+		return;
+	msg = dbus_message_new_signal(path, CDBUS_INTERFACE_OBJECT_MANAGER,
+				"InterfacesRemoved");
+	free(path);
+	if (!msg)
+		return;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
+				&object->path);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s",
+					&sub_iter);
+	for (itf = object->user_data->object_table ; itf->itf_name ; itf++)
+		dbus_message_iter_append_basic(&sub_iter, DBUS_TYPE_STRING,
+					&itf->itf_name);
+	dbus_message_iter_close_container(&iter, &sub_iter);
+
+	signal_send(object->cnx, msg, 0);
+	dbus_message_unref(msg);
+}
+
+/* Send one PropertiesChanged signal per interface, merging the changes
+   made since the last one. The InterfacesAdded signal of a new object
+   carries them instead */
+static void properties_changed(struct timeout_t *timeout, void *data)
+{
+	struct object_t *object = data;
+	struct property_set_t *set;
+	DBusMessage *msg;
+	int i;
+
+	timeout_disable(timeout);
+
+	if (object->announce) {
+		object->announce = 0;
+		if (interfaces_added(object) == 0)
+			return;
+	}
+
+	object_lock(object);
+	for (i = 0 ; i < object->nb_props ; i++) {
+		set = &object->props[i];
+		if (!set->changed)
+			continue;
+		msg = __properties_changed_message(object, set);
+		/* The signals of the interfaces differ by their first
+		   argument only, they must not replace each other */
+		if (msg) {
+			signal_send(object->cnx, msg, 0);
+			dbus_message_unref(msg);
+		}
+		__property_set_clear_changed(set);
+	}
+	object_unlock(object);
+}
+
+/* The reply is filled straight from the object list and the property
+   caches */
+/* Must be called with the node index locked. Append the objects below
+   node, the ones below a closer manager belong to it. The object at the
+   path of that manager belongs to the one above */
+static int __manager_append_objects(struct path_node_t *node,
+				DBusMessageIter *iter)
+{
+	struct list_item_t *item;
+	struct path_node_t *child;
+	DBusMessageIter entry_iter;
+	int ret = 0;
+
+	__for_each_list_item(&node->children, item, item, child) {
+		if (child->object
+			&& (child->object->user_data != &manager_user_data)) {
+			dbus_message_iter_open_container(iter,
+							DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry_iter);
+			dbus_message_iter_append_basic(&entry_iter,
+						DBUS_TYPE_OBJECT_PATH,
+						&child->object->path);
+			ret = object_append_interfaces(child->object,
+						&entry_iter);
+			if (ret < 0) {
+				dbus_message_iter_abandon_container(iter,
+								&entry_iter);
+				break;
+			}
+			dbus_message_iter_close_container(iter, &entry_iter);
+		}
+		if (!child->manager)
+			ret = __manager_append_objects(child, iter);
+		if (ret < 0)
+			break;
+	}
+
+	return ret;
+}
+
+static int manager_get_objects(DBusConnection *cnx, DBusMessage *msg,
+			struct cdbus_context_t *ctx,
+			struct object_manager_t *manager)
+{
+	struct path_node_t *node;
+	DBusMessage *reply;
+	DBusMessageIter iter, sub_iter;
+	int ret = 0;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return -1;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+					"{oa{sa{sv}}}", &sub_iter);
+	hash_lock(&ctx->node_index);
+	node = __path_node_lookup(ctx, cnx, manager->path);
+	if (node)
+		ret = __manager_append_objects(node, &sub_iter);
+	hash_unlock(&ctx->node_index);
+
+	if (ret < 0) {
+		dbus_message_iter_abandon_container(&iter, &sub_iter);
+		dbus_message_unref(reply);
+		return -1;
+	}
+	dbus_message_iter_close_container(&iter, &sub_iter);
+
+	dbus_connection_send(cnx, reply, NULL);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+/* Serve the org.freedesktop.DBus.ObjectManager methods of the manager
+   registered at the path of the message, if any */
+static DBusHandlerResult manager_dispatch(DBusConnection *cnx,
+					DBusMessage *msg,
+					struct cdbus_context_t *ctx,
+					const char *member)
+{
+	struct object_manager_t *manager;
+
+	list_lock(&ctx->manager_list);
+	manager = __manager_at(ctx, cnx, dbus_message_get_path(msg));
+	list_unlock(&ctx->manager_list);
+	if (!manager)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (strcmp(member, "GetManagedObjects")) {
+		send_error(cnx, msg, DBUS_ERROR_UNKNOWN_METHOD, member);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (manager_get_objects(cnx, msg, ctx, manager) < 0)
+		LOG(LOG_WARNING, "Failed to handle %s of object %s\n",
+			member, dbus_message_get_path(msg));
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void stats_load(struct cdbus_member_stats_t * stats,
+		struct cdbus_member_stats_t * copy)
+{
+	int i;
+
+	copy->calls = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+	copy->errors = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+	copy->bytes_in = __atomic_load_n(&stats->bytes_in, __ATOMIC_RELAXED);
+	copy->bytes_out = __atomic_load_n(&stats->bytes_out, __ATOMIC_RELAXED);
+	copy->time_total = __atomic_load_n(&stats->time_total, __ATOMIC_RELAXED);
+	copy->time_max = __atomic_load_n(&stats->time_max, __ATOMIC_RELAXED);
+	for (i = 0 ; i < CDBUS_STATS_BUCKETS ; i++)
+		copy->latency[i] = __atomic_load_n(&stats->latency[i],
+						__ATOMIC_RELAXED);
+	copy->count_bytes = __atomic_load_n(&stats->count_bytes,
+					__ATOMIC_RELAXED);
+}
+
+static void stats_clear(struct cdbus_member_stats_t * stats)
+{
+	int i;
+
+	__atomic_store_n(&stats->calls, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->errors, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->bytes_in, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->bytes_out, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->time_total, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->time_max, 0, __ATOMIC_RELAXED);
+	for (i = 0 ; i < CDBUS_STATS_BUCKETS ; i++)
+		__atomic_store_n(&stats->latency[i], 0, __ATOMIC_RELAXED);
+}
+
+static int stats_append(DBusMessageIter *iter, const char *interface,
+			const char *member, struct cdbus_member_stats_t *stats)
+{
+	DBusMessageIter struct_iter, array_iter;
+	struct cdbus_member_stats_t copy;
+	const unsigned long long *latency = copy.latency;
+
+	stats_load(stats, &copy);
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
+					&struct_iter);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_STRING,
+				&interface);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_STRING, &member);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
+				&copy.calls);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
+				&copy.errors);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
+				&copy.bytes_in);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
+				&copy.bytes_out);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
+				&copy.time_total);
+	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
+				&copy.time_max);
+	dbus_message_iter_open_container(&struct_iter, DBUS_TYPE_ARRAY,
+					DBUS_TYPE_UINT64_AS_STRING,
+					&array_iter);
+	dbus_message_iter_append_fixed_array(&array_iter, DBUS_TYPE_UINT64,
+					&latency, CDBUS_STATS_BUCKETS);
+	if (!dbus_message_iter_close_container(&struct_iter, &array_iter)
+		|| !dbus_message_iter_close_container(iter, &struct_iter))
+		return -1;
+
+	return 0;
+}
+
+static int stats_get(DBusConnection *cnx, DBusMessage *msg,
+		struct cdbus_interface_entry_t *table)
+{
+	struct cdbus_interface_entry_t *itf;
+	struct cdbus_message_entry_t *entry;
+	DBusMessage *reply;
+	DBusMessageIter iter, sub_iter;
+	int ret = 0;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return -1;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+					"(ssttttttat)", &sub_iter);
+	for (itf = table ; itf->itf_name && !ret ; itf++) {
+		for (entry = itf->itf_table ; entry->msg_name && !ret ; entry++) {
+			if (entry->msg_stats)
+				ret = stats_append(&sub_iter, itf->itf_name,
+						entry->msg_name,
+						entry->msg_stats);
+		}
+	}
+
+	if (ret < 0) {
+		dbus_message_iter_abandon_container(&iter, &sub_iter);
+		dbus_message_unref(reply);
+		return -1;
+	}
+	dbus_message_iter_close_container(&iter, &sub_iter);
+
+	dbus_connection_send(cnx, reply, NULL);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+/* Serve the CDBUS_INTERFACE_STATS methods, the statistics are the ones of
+   the table of the object, shared with the other objects of the table */
+static DBusHandlerResult stats_dispatch(DBusConnection *cnx,
+					DBusMessage *msg,
+					struct cdbus_interface_entry_t *table,
+					const char *member)
+{
+	DBusMessage *reply;
+	int ret = 0;
+
+	if (!table_has_stats(table))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (!strcmp(member, "GetStats")) {
+		ret = stats_get(cnx, msg, table);
+	} else if (!strcmp(member, "Reset")) {
+		cdbus_reset_stats(table);
+		reply = dbus_message_new_method_return(msg);
+		if (reply) {
+			dbus_connection_send(cnx, reply, NULL);
+			dbus_message_unref(reply);
+		} else {
+			ret = -1;
+		}
+	} else {
+		send_error(cnx, msg, DBUS_ERROR_UNKNOWN_METHOD, member);
+	}
+
+	if (ret < 0)
+		LOG(LOG_WARNING, "Failed to handle %s of object %s\n",
+			member, dbus_message_get_path(msg));
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult object_dispatch(DBusConnection *cnx,
+			DBusMessage *msg,
+			void *data)
+{
+	struct object_t * object = data;
+	struct cdbus_user_data_t * user_data;
+	struct cdbus_interface_entry_t * table;
+	const char * interface;
+	const char * member;
+	struct cdbus_message_entry_t * msg_entry;
+	struct cdbus_pool_t * pool;
+	int ret;
+
+	if (!data)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	user_data = object->user_data;
+	table = user_data->object_table;
+
+	member = dbus_message_get_member(msg);
+	if (!member)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (CDBUS_PROBE_ENABLED(object_dispatch))
+		CDBUS_PROBE4(object_dispatch, msg, dbus_message_get_serial(msg),
+			member, dbus_message_get_path(msg));
+
+	if (!strncmp(member, "Introspect", strlen(member))) {
+		if (object_introspect(cnx, msg, object) < 0)
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		else
+			return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	interface = dbus_message_get_interface(msg);
+	if (interface && !strcmp(interface, CDBUS_INTERFACE_OBJECT_MANAGER)
+		&& !find_interface(interface, table))
+		return manager_dispatch(cnx, msg, object->ctx, member);
+
+	if (interface && !strcmp(interface, CDBUS_INTERFACE_STATS)
+		&& !find_interface(interface, table))
+		return stats_dispatch(cnx, msg, table, member);
+
+	if (interface) {
+		msg_entry = find_member_with_interface(interface, member, table);
+	} else {
+		msg_entry = find_member_all_interfaces(member, table);
+	}
+
+	if (!msg_entry) {
+		/* The Properties interface is implemented here unless the
+		   table has its own */
+		if (!interface || !object->nb_props
+			|| strcmp(interface, DBUS_INTERFACE_PROPERTIES))
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		if (property_dispatch(cnx, msg, object, member) < 0)
+			LOG(LOG_WARNING, "Failed to handle %s of object %s\n",
+				member, dbus_message_get_path(msg));
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (__list_get_nb(&object->pools)) {
+		pool = object_get_pool(object, interface, member);
+		if (pool && !pool_push(pool, object, cnx, msg, msg_entry,
+					user_data->user_data))
+			return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	ret = member_call(msg_entry, cnx, msg, user_data->user_data);
+	if (ret < 0)
+		LOG(LOG_WARNING, "Failed to execute handler for member %s "
+			"of object %s\n", member, dbus_message_get_path(msg));
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+
+static void pool_binding_free(struct pool_binding_t * binding)
+{
+	if (binding->interface)
+		free(binding->interface);
+	if (binding->member)
+		free(binding->member);
+	free(binding);
+}
+
+static void object_unregister(DBusConnection *cnx, void *data)
+{
+	struct object_t * object = data;
+	struct list_item_t * item;
+	struct pool_binding_t * binding;
+
+	list_rem_item(&object->item);
+	if (object->subtree)
+		hash_rem_item(&object->hitem);
+	path_nodes_rem(object);
+
+	/* The calls handed over to the pools must not outlive the object,
+	   its user data may be freed once it is unregistered */
+	while ((item = __list_get_first(&object->pools))) {
+		__list_rem_item(item);
+		binding = container_of(item, struct pool_binding_t, item);
+		pool_drain(binding->pool, object);
+		pool_binding_free(binding);
+	}
+
+	/* No property can be updated, and the signal scheduled, once they
+	   are freed */
+	object_lock(object);
+	object_props_free(object);
+	object_unlock(object);
+	timeout_disable(&object->changed_timeout);
+	object_unref(object);
+}
+
+static DBusObjectPathVTable vtable = {
+	.unregister_function = object_unregister,
+	.message_function = object_dispatch,
+};
+
+/* Remove the registration of the object at path and free it */
+static int object_remove(DBusConnection * cnx, const char * path,
+			struct object_t * object)
+{
+	if (!object->subtree)
+		return (dbus_connection_unregister_object_path(cnx, path) == TRUE) ? 0 : -1;
+
+	object_unregister(cnx, object);
+	return 0;
+}
+
+int cdbus_register_object(DBusConnection * cnx, const char * path,
+			struct cdbus_user_data_t * user_data)
+{
+	int ret;
+	struct object_t *object;
+	struct object_t *old;
+	int replaced = 0;
+
+	if (!user_data)
+		return -1;
+
+	object = malloc(sizeof(*object));
+	if (!object)
+		return -1;
+	memset(object, 0, sizeof(*object));
+	LIST_ITEM_INIT(object->item);
+	HASH_ITEM_INIT(object->hitem);
+	object->ctx = get_context(cnx);
+	object->user_data = user_data;
+	LIST_INIT(object->pools);
+	object->cnx = cnx;
+	object->refs = 1;
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_init(&object->lock, NULL);
+#endif
+	HEAP_ITEM_INIT(object->changed_timeout.hitem);
+	object->changed_timeout.cnx = cnx;
+	object->changed_timeout.ctx = object->ctx;
+	object->changed_timeout.cb = properties_changed;
+	object->changed_timeout.cb_data = object;
+
+	object->path = strdup(path);
+	if (!object->path || (object_props_init(object) < 0))
+		goto free;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	/* The properties may be updated by other threads */
+	if (object->nb_props && (context_enable_wakeup(object->ctx) < 0))
+		goto free;
+#endif
+
+	/* An object takes the place of the placeholder of a manager, it is
+	   registered again if the object can't be */
+	old = object_lookup(cnx, path);
+	if (old && (old->user_data == &manager_user_data)
+		&& (user_data != &manager_user_data))
+		replaced = object_remove(cnx, path, old) == 0;
+
+	if (path_nodes_add(object) < 0)
+		goto free;
+
+	list_lock(&object->ctx->subtree_list);
+	object->subtree = __subtree_of(object->ctx, cnx, path);
+	list_unlock(&object->ctx->subtree_list);
+
+	if (object->subtree) {
+		if (object_index_add(object) < 0)
+			goto release;
+	} else {
+		ret = dbus_connection_register_object_path(cnx, path, &vtable,
+							object);
+		if (ret == FALSE)
+			goto release;
+	}
+
+	list_add_tail(&object->ctx->object_list, &object->item);
+	object_xml_invalidate(cnx, path);
+
+	/* InterfacesAdded is sent on the next loop iteration, with the
+	   properties set in the meantime */
+	if (user_data != &manager_user_data) {
+		list_lock(&object->ctx->manager_list);
+		object->announce = __manager_of(object->ctx, cnx, path) != NULL;
+		list_unlock(&object->ctx->manager_list);
+		if (object->announce)
+			object_schedule(object);
+	}
+	return 0;
+
+release:
+	path_nodes_rem(object);
+free:
+	object_props_free(object);
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_destroy(&object->lock);
+#endif
+	free(object->path);
+	free(object);
+	if (replaced)
+		cdbus_register_object(cnx, path, &manager_user_data);
+	return -1;
+}
+
+int cdbus_unregister_object(DBusConnection * cnx, const char * path)
+{
+	int ret;
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct object_t * object = NULL;
+	struct object_manager_t * manager;
+	int placeholder = 1;
+
+	object = object_lookup(cnx, path);
+	if (!object)
+		return -1;
+
+	/* The object is only known by the clients once announced */
+	placeholder = object->user_data == &manager_user_data;
+	if (!object->announce)
+		interfaces_removed(object);
+
+	ret = object_remove(cnx, path, object);
+	if (ret < 0)
+		return -1;
+	object_xml_invalidate(cnx, path);
+
+	/* The manager registered at this path gets its placeholder back */
+	if (!placeholder) {
+		list_lock(&ctx->manager_list);
+		manager = __manager_at(ctx, cnx, path);
+		list_unlock(&ctx->manager_list);
+		if (manager)
+			cdbus_register_object(cnx, path, &manager_user_data);
+	}
+	return 0;
+}
+
+/*
+   Implement org.freedesktop.DBus.ObjectManager at path. GetManagedObjects
+   reports the objects registered below path with the cached values of
+   their properties, except the ones having a closer manager.
+   InterfacesAdded is sent on the loop iteration following the
+   registration of an object, and InterfacesRemoved when it is
+   unregistered. An object may be registered at path too.
+ */
+int cdbus_register_object_manager(DBusConnection * cnx, const char * path)
+{
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct object_manager_t * manager;
+	struct path_node_t * node;
+
+	manager = malloc(sizeof(*manager));
+	if (!manager)
+		return -1;
+	memset(manager, 0, sizeof(*manager));
+	LIST_ITEM_INIT(manager->item);
+	manager->cnx = cnx;
+	manager->path = strdup(path);
+	if (!manager->path)
+		goto free;
+
+	list_lock(&ctx->manager_list);
+	if (__manager_at(ctx, cnx, path)) {
+		list_unlock(&ctx->manager_list);
+		goto free;
+	}
+	__list_add_tail(&ctx->manager_list, &manager->item);
+	list_unlock(&ctx->manager_list);
+
+	/* GetManagedObjects stops at the node of a closer manager */
+	hash_lock(&ctx->node_index);
+	node = __path_nodes_ref(ctx, cnx, path);
+	if (node)
+		node->manager = manager;
+	hash_unlock(&ctx->node_index);
+	if (!node)
+		goto remove;
+
+	/* The messages of the manager are handled by the object at path,
+	   a placeholder is registered if there is none */
+	if (!object_lookup(cnx, path)) {
+		if (cdbus_register_object(cnx, path, &manager_user_data) < 0)
+			goto release;
+	}
+	object_xml_invalidate(cnx, path);
+
+	return 0;
+
+release:
+	manager_node_release(ctx, manager);
+remove:
+	list_rem_item(&manager->item);
+free:
+	free(manager->path);
+	free(manager);
+	return -1;
+}
+
+int cdbus_unregister_object_manager(DBusConnection * cnx, const char * path)
+{
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct object_manager_t * manager;
+	struct object_t * object = NULL;
+
+	list_lock(&ctx->manager_list);
+	manager = __manager_at(ctx, cnx, path);
+	if (manager)
+		__list_rem_item(&manager->item);
+	list_unlock(&ctx->manager_list);
+	if (!manager)
+		return -1;
+
+	manager_node_release(ctx, manager);
+	object = object_lookup(cnx, path);
+	if (object && (object->user_data == &manager_user_data))
+		object_remove(cnx, path, object);
+	object_xml_invalidate(cnx, path);
+
+	free(manager->path);
+	free(manager);
+	return 0;
+}
+
+/* Introspection of a path of a subtree without object */
+static int subtree_introspect(DBusConnection *cnx, DBusMessage *msg,
+			struct subtree_t *subtree)
+{
+	struct extensible_string_t str;
+	DBusMessage *reply;
+	int ret;
+
+	if (extstr_init(&str) < 0)
+		return -1;
+
+	ret = extstr_append_sprintf(&str, "%s\n<node>",
+				DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE);
+	if (ret == 0)
+		ret = generate_children_xml(cnx, subtree->ctx,
+					dbus_message_get_path(msg), &str);
+	if (ret == 0)
+		ret = extstr_append_sprintf(&str, "</node>");
+	if (ret < 0)
+		goto free;
+
+	ret = -1;
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		goto free;
+
+	if (dbus_message_append_args(reply,
+					DBUS_TYPE_STRING,
+					&str.buffer,
+					DBUS_TYPE_INVALID) == TRUE) {
+		dbus_connection_send(cnx, reply, NULL);
+		ret = 0;
+	}
+	dbus_message_unref(reply);
+
+free:
+	extstr_free(&str);
+	return ret;
+}
+
+/* The messages sent below the path of the subtree are routed to the object
+   of the index registered at their path */
+static DBusHandlerResult subtree_dispatch(DBusConnection *cnx,
+					DBusMessage *msg,
+					void *data)
+{
+	struct subtree_t * subtree = data;
+	struct object_t * object;
+	const char * member;
+
+	hash_lock(&subtree->ctx->object_index);
+	object = __object_index_lookup(subtree->ctx, cnx,
+				dbus_message_get_path(msg));
+	hash_unlock(&subtree->ctx->object_index);
+
+	if (object)
+		return object_dispatch(cnx, msg, object);
+
+	member = dbus_message_get_member(msg);
+	if ((dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		|| !member || strcmp(member, "Introspect"))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (subtree_introspect(cnx, msg, subtree) < 0)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* The objects left in the subtree are released along with it */
+static void subtree_unregister(DBusConnection *cnx, void *data)
+{
+	struct subtree_t * subtree = data;
+	struct cdbus_context_t * ctx = subtree->ctx;
+	struct list_item_t * item;
+	struct object_t * object;
+	struct list_t objects;
+
+	/* The objects above the subtree lose children nodes. libdbus can't
+	   be called to look them up, the connection may be finalized */
+	LIST_INIT(objects);
+	list_lock(&ctx->object_list);
+	__for_each_list_item(&ctx->object_list, item, item, object) {
+		if (object->subtree != subtree) {
+			if ((object->cnx == cnx)
+				&& path_is_below(subtree->path, object->path))
+				object->xml_stale = 1;
+			continue;
+		}
+		__list_rem_item(&object->item);
+		__list_add_tail(&objects, &object->item);
+	}
+	list_unlock(&ctx->object_list);
+
+	while ((item = __list_get_first(&objects)))
+		object_unregister(cnx, container_of(item, struct object_t, item));
+#ifdef LIBUTILS_PTHREAD_LOCK
+	pthread_mutex_destroy(&objects.lock);
+#endif
+
+	list_rem_item(&subtree->item);
+	free(subtree->path);
+	free(subtree);
+}
+
+static DBusObjectPathVTable subtree_vtable = {
+	.unregister_function = subtree_unregister,
+	.message_function = subtree_dispatch,
+};
+
+/*
+   Register a single libdbus fallback for path. The objects registered
+   afterwards at path or below it are stored in an index of the context
+   instead of the object tree of libdbus, which makes the registration of
+   many short-lived objects cheap. The subtree must be registered before
+   the objects of its path, and subtrees of a connection may not be nested.
+ */
+int cdbus_register_subtree(DBusConnection * cnx, const char * path)
+{
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct list_item_t * item;
+	struct subtree_t * subtree;
+	struct subtree_t * other;
+	struct object_t * object;
+
+	subtree = malloc(sizeof(*subtree));
+	if (!subtree)
+		return -1;
+	memset(subtree, 0, sizeof(*subtree));
+	LIST_ITEM_INIT(subtree->item);
+	subtree->ctx = ctx;
+	subtree->cnx = cnx;
+	subtree->path = strdup(path);
+	if (!subtree->path)
+		goto free;
+
+	list_lock(&ctx->subtree_list);
+	__for_each_list_item(&ctx->subtree_list, item, item, other) {
+		if ((other->cnx == cnx) && (!strcmp(other->path, path)
+						|| path_is_below(path, other->path)
+						|| path_is_below(other->path, path)))
+			break;
+	}
+	if (other) {
+		list_unlock(&ctx->subtree_list);
+		goto free;
+	}
+
+	list_lock(&ctx->object_list);
+	__for_each_list_item(&ctx->object_list, item, item, object) {
+		if ((object->cnx == cnx) && (!strcmp(object->path, path)
+						|| path_is_below(object->path, path)))
+			break;
+	}
+	list_unlock(&ctx->object_list);
+	if (object) {
+		list_unlock(&ctx->subtree_list);
+		goto free;
+	}
+
+	__list_add_tail(&ctx->subtree_list, &subtree->item);
+	list_unlock(&ctx->subtree_list);
+
+	if (dbus_connection_register_fallback(cnx, path, &subtree_vtable,
+						subtree) == FALSE) {
+		list_rem_item(&subtree->item);
+		goto free;
+	}
+	object_xml_invalidate(cnx, path);
+
+	return 0;
+
+free:
+	free(subtree->path);
+	free(subtree);
+	return -1;
+}
+
+/* The objects still registered in the subtree are unregistered without
+   InterfacesRemoved signal */
+int cdbus_unregister_subtree(DBusConnection * cnx, const char * path)
+{
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct subtree_t * subtree;
+
+	list_lock(&ctx->subtree_list);
+	subtree = __subtree_of(ctx, cnx, path);
+	list_unlock(&ctx->subtree_list);
+	if (!subtree || strcmp(subtree->path, path))
+		return -1;
+
+	return (dbus_connection_unregister_object_path(cnx, path) == TRUE) ? 0 : -1;
+}
+
+/* Copy the statistics of the member of the table, they may be updated
+   meanwhile by the threads running it */
+int cdbus_get_member_stats(struct cdbus_interface_entry_t * table,
+			const char * interface, const char * member,
+			struct cdbus_member_stats_t * stats)
+{
+	struct cdbus_message_entry_t * msg_entry;
+
+	if (!table || !member || !stats)
+		return -1;
+
+	if (interface)
+		msg_entry = find_member_with_interface(interface, member, table);
+	else
+		msg_entry = find_member_all_interfaces(member, table);
+	if (!msg_entry || !msg_entry->msg_stats)
+		return -1;
+
+	stats_load(msg_entry->msg_stats, stats);
+	return 0;
+}
+
+void cdbus_reset_stats(struct cdbus_interface_entry_t * table)
+{
+	struct cdbus_interface_entry_t * itf;
+	struct cdbus_message_entry_t * msg_entry;
+
+	if (!table)
+		return;
+
+	for (itf = table ; itf->itf_name ; itf++) {
+		for (msg_entry = itf->itf_table ; msg_entry->msg_name ; msg_entry++) {
+			if (msg_entry->msg_stats)
+				stats_clear(msg_entry->msg_stats);
+		}
+	}
+}
+
+void cdbus_enable_byte_stats(struct cdbus_interface_entry_t * table,
+			int enable)
+{
+	struct cdbus_interface_entry_t * itf;
+	struct cdbus_message_entry_t * msg_entry;
+
+	if (!table)
+		return;
+
+	for (itf = table ; itf->itf_name ; itf++) {
+		for (msg_entry = itf->itf_table ; msg_entry->msg_name ; msg_entry++) {
+			if (msg_entry->msg_stats)
+				__atomic_store_n(&msg_entry->msg_stats->count_bytes,
+						!!enable, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* Cache the new value of the property, the reference on value is not taken
+   over. When libcdbus is built with THREAD_SAFE, this function may be
+   called by any thread, it must be called from the thread running the loop
+   otherwise */
+int cdbus_property_update(DBusConnection * cnx, const char * path,
+			const char * interface, const char * name,
+			DBusMessage * value)
+{
+	struct cdbus_context_t * ctx;
+	struct object_t * object;
+	struct property_set_t * set;
+	int index, wakeup = 0;
+
+	/* The object may be unregistered meanwhile by the loop, its
+	   properties are then freed */
+	object = object_get(cnx, path);
+	if (!object)
+		return -1;
+	ctx = object->ctx;
+
+	object_lock(object);
+	set = object_props_lookup(object, interface);
+	index = set ? property_lookup(set, name) : -1;
+	if (index >= 0) {
+		dbus_message_ref(value);
+		wakeup = __property_store(object, set, index, value);
+	}
+	object_unlock(object);
+	object_unref(object);
+	if (index < 0)
+		return -1;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	/* The loop may be waiting in poll with a later deadline */
+	if (wakeup && (ctx->wakeup_fd >= 0))
+		wakeup_main(ctx);
+#else
+	(void)ctx;
+	(void)wakeup;
+#endif
+
+	return 0;
+}
+
+/*
+   Run the methods of the object matching interface and member in the
+   worker pool, a NULL interface or member matches any value. The most
+   specific binding is used when several match a method call. A NULL pool
+   removes the binding. This function must be called from the thread running
+   the loop of the connection. When the object is unregistered, its calls
+   still queued in the pools are answered with an error and the running ones
+   are waited for.
+ */
+int cdbus_object_set_pool(DBusConnection * cnx, const char * path,
+			const char * interface, const char * member,
+			struct cdbus_pool_t * pool)
+{
+	struct object_t * object;
+	struct list_item_t * item;
+	struct pool_binding_t * binding;
+
+	object = object_lookup(cnx, path);
+	if (!object)
+		return -1;
+
+	__for_each_list_item(&object->pools, item, item, binding) {
+		if (str_equal(binding->interface, interface)
+			&& str_equal(binding->member, member))
+			break;
+	}
+
+	if (!pool) {
+		if (!binding)
+			return -1;
+		__list_rem_item(&binding->item);
+		pool_binding_free(binding);
+		return 0;
+	}
+
+	if (binding) {
+		binding->pool = pool;
+		return 0;
+	}
+
+	/* The replies are queued from the workers */
+	if (connection_enable_wakeup(cnx, object->ctx) < 0)
+		return -1;
+
+	binding = malloc(sizeof(*binding));
+	if (!binding)
+		return -1;
+	memset(binding, 0, sizeof(*binding));
+	LIST_ITEM_INIT(binding->item);
+	binding->pool = pool;
+	if (interface)
+		binding->interface = strdup(interface);
+	if (member)
+		binding->member = strdup(member);
+	if ((interface && !binding->interface)
+		|| (member && !binding->member)) {
+		pool_binding_free(binding);
+		return -1;
+	}
+	__list_add_tail(&object->pools, &binding->item);
+
+	return 0;
+}
+
+int cdbus_register_signals(DBusConnection * cnx, const char * sender, const char * path,
+	struct cdbus_user_data_t * user_data)
+{
+	struct cdbus_context_t * ctx;
+	struct signal_t * signal;
+	struct cdbus_interface_entry_t * itf_entry;
+	int len;
+	int i;
+
+
+	if (!cnx)
+		return -1;
+	if (!user_data || !user_data->object_table)
+		return -1;
+	ctx = get_context(cnx);
+
+	signal = malloc(sizeof(*signal));
+	if (!signal)
+		return -1;
+	memset(signal, 0, sizeof(*signal));
+
+	LIST_ITEM_INIT(signal->item);
+	signal->cnx = cnx;
+	if (sender)
+		signal->sender = strdup(sender);
+	if (path)
+		signal->object = strdup(path);
+	signal->data.object_table = user_data->object_table;
+	signal->data.user_data = user_data->user_data;
+	signal->match_rule = malloc(sizeof(char) * DBUS_MAXIMUM_MATCH_RULE_LENGTH);
+
+	if (!signal->match_rule)
+		goto free;
+	if (sender && !signal->sender)
+		goto free;
+	if (path && !signal->object)
+		goto free;
+
+	for (itf_entry = signal->data.object_table ; itf_entry->itf_name ; itf_entry++)
+		signal->nb_keys++;
+	signal->keys = malloc(sizeof(*signal->keys) * signal->nb_keys);
+	if (!signal->keys)
+		goto free;
+
+	len = snprintf(signal->match_rule, DBUS_MAXIMUM_MATCH_RULE_LENGTH,
+		"type='signal'");
+	itf_entry = signal->data.object_table;
+	while (itf_entry->itf_name) {
+		len += snprintf(signal->match_rule + len,
+				DBUS_MAXIMUM_MATCH_RULE_LENGTH - len,
+				",interface='%s'",
+				itf_entry->itf_name);
+		itf_entry++;
+	}
+	if (signal->sender)
+		len += snprintf(signal->match_rule + len,
+				DBUS_MAXIMUM_MATCH_RULE_LENGTH - len,
+				",sender='%s'",
+				signal->sender);
+	if (signal->object)
+		len += snprintf(signal->match_rule + len,
+				DBUS_MAXIMUM_MATCH_RULE_LENGTH - len,
+				",path='%s'",
+				signal->object);
+	signal->match_rule[DBUS_MAXIMUM_MATCH_RULE_LENGTH - 1] = 0;
+	dbus_bus_add_match(cnx, signal->match_rule, NULL);
+
+	list_add_tail(&ctx->signal_list, &signal->item);
+
+	hash_lock(&ctx->signal_index);
+	signal->seq = ctx->signal_seq++;
+	for (i = 0 ; i < signal->nb_keys ; i++) {
+		HASH_ITEM_INIT(signal->keys[i].item);
+		signal->keys[i].signal = signal;
+		signal->keys[i].interface = signal->data.object_table[i].itf_name;
+		__hash_add(&ctx->signal_index, &signal->keys[i].item,
+			signal_hash(cnx, signal->object, signal->sender,
+				signal->keys[i].interface));
+	}
+	hash_unlock(&ctx->signal_index);
+
+	return 0;
+
+free:
+	if (signal->keys)
+		free(signal->keys);
+	if (signal->match_rule)
+		free(signal->match_rule);
+ 	if (signal->sender)
+		free(signal->sender);
+ 	if (signal->object)
+		free(signal->object);
+	free(signal);
+	return -1;
+
+}
+
+int cdbus_unregister_signals(DBusConnection * cnx, const char * sender, const char * path)
+{
+	struct cdbus_context_t * ctx = get_context(cnx);
+	struct list_item_t * item;
+	struct signal_t * signal;
+	int i;
+
+	for_each_list_item(&ctx->signal_list, item, item, signal) {
+		if ((signal->cnx == cnx)
+			&& str_equal(signal->sender, sender)
+			&& str_equal(signal->object, path))
+			break;
+	}
+	if (signal) {
+		list_rem_item(&signal->item);
+
+		hash_lock(&ctx->signal_index);
+		for (i = 0 ; i < signal->nb_keys ; i++)
+			__hash_rem_item(&signal->keys[i].item);
+		hash_unlock(&ctx->signal_index);
+
+		dbus_bus_remove_match(cnx, signal->match_rule, NULL);
+
+		free(signal->keys);
+		free(signal->match_rule);
+		if (signal->sender)
+			free(signal->sender);
+		if (signal->object)
+			free(signal->object);
+		free(signal);
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+/*
+   Queue the signals sent with cdbus_send_signal on the connection, the
+   event loop sends them once per iteration. With a window >= 0 (in ms), a
+   signal sent with cdbus_send_signal_coalesced while a signal with the same
+   path, interface, member and destination is queued replaces the queued
+   message, which is sent window ms after the first emission. The bodies
+   are not compared: only the signals reporting a latest state, whose last
+   emission supersedes the previous ones, may be coalesced. The signals of
+   the library itself never are. A negative window disables coalescing. The
+   signals are sent in their emission order, a signal queued after a
+   coalesced one waits for it.
+ */
+int cdbus_signal_queue_enable(DBusConnection * cnx, int window)
+{
+	struct connection_t *connection = connection_lookup(cnx);
+
+	if (!connection)
+		return -1;
+
+#ifdef LIBUTILS_PTHREAD_LOCK
+	/* Other threads may queue signals */
+	if (context_enable_wakeup(connection->ctx) < 0)
+		return -1;
+#endif
+
+	list_lock(&connection->signal_queue);
+	/* The queued signals were indexed with the previous window */
+	__signal_queue_send(connection, 1);
+	connection->queue_signals = 1;
+	connection->window = window;
+	list_unlock(&connection->signal_queue);
+
+	return 0;
+}
+
+/* Send the queued signals, the next ones are sent immediately */
+int cdbus_signal_queue_disable(DBusConnection * cnx)
+{
+	struct connection_t *connection = connection_lookup(cnx);
+
+	if (!connection)
+		return -1;
+
+	list_lock(&connection->signal_queue);
+	connection->queue_signals = 0;
+	__signal_queue_send(connection, 1);
+	list_unlock(&connection->signal_queue);
+
+	return 0;
+}
+
+/* Send the queued signals without waiting for their deadline */
+int cdbus_signal_queue_flush(DBusConnection * cnx)
+{
+	struct connection_t *connection = connection_lookup(cnx);
+
+	if (!connection)
+		return -1;
+
+	list_lock(&connection->signal_queue);
+	__signal_queue_send(connection, 1);
+	list_unlock(&connection->signal_queue);
+
+	return 0;
+}
+
+/* Send a signal, through the queue of the connection if it is enabled. The
+   caller keeps its reference on msg */
+int cdbus_send_signal(DBusConnection * cnx, DBusMessage * msg)
+{
+	return signal_send(cnx, msg, 0);
+}
+
+/* Same as cdbus_send_signal, but a coalescing queue only sends the latest
+   emission of the signal. The body is not compared, it must carry the
+   whole state of what the signal reports */
+int cdbus_send_signal_coalesced(DBusConnection * cnx, DBusMessage * msg)
+{
+	return signal_send(cnx, msg, 1);
+}
+
+struct cdbus_arena_chunk_t {
+	struct cdbus_arena_chunk_t *next;
+	long double data[];
+};
+
+/* Descriptor closed by the reset, allocated in the arena itself */
+struct cdbus_arena_fd_t {
+	struct cdbus_arena_fd_t *next;
+	int fd;
+};
+
+void cdbus_arena_init(struct cdbus_arena_t * arena)
+{
+	arena->chunks = NULL;
+	arena->fds = NULL;
+	arena->base = arena->buffer.data;
+	arena->size = sizeof(arena->buffer.data);
+	arena->used = 0;
+	arena->last = 0;
+}
+
+void * cdbus_arena_alloc(struct cdbus_arena_t * arena, size_t size)
+{
+	struct cdbus_arena_chunk_t *chunk;
+	size_t offset, chunk_size;
+
+	if (!arena)
+		return malloc(size);
+
+	offset = (arena->used + CDBUS_ARENA_ALIGN - 1) & ~(CDBUS_ARENA_ALIGN - 1);
+	if (offset + size > arena->size) {
+		/* Each chunk is twice the previous one */
+		chunk_size = arena->size * 2;
+		while (chunk_size < size)
+			chunk_size *= 2;
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->base = (char *)chunk->data;
+		arena->size = chunk_size;
+		offset = 0;
+	}
+	arena->last = offset;
+	arena->used = offset + size;
+
+	return arena->base + offset;
+}
+
+void * cdbus_arena_realloc(struct cdbus_arena_t * arena, void * ptr,
+			size_t old_size, size_t size)
+{
+	void *new;
+
+	if (!arena)
+		return realloc(ptr, size);
+	if (!ptr)
+		return cdbus_arena_alloc(arena, size);
+
+	/* The last allocation grows in place */
+	if (((char *)ptr == arena->base + arena->last)
+		&& (arena->last + size <= arena->size)) {
+		arena->used = arena->last + size;
+		return ptr;
+	}
+
+	new = cdbus_arena_alloc(arena, size);
+	if (!new)
+		return NULL;
+	memcpy(new, ptr, old_size < size ? old_size : size);
+
+	return new;
+}
+
+/* Release everything allocated in the arena, it can be used again */
+void cdbus_arena_reset(struct cdbus_arena_t * arena)
+{
+	struct cdbus_arena_chunk_t *chunk;
+
+	if (!arena)
+		return;
+
+	for ( ; arena->fds ; arena->fds = arena->fds->next)
+		close(arena->fds->fd);
+
+	while (arena->chunks) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	cdbus_arena_init(arena);
+}
+
+/* Make room for one more item of an av or a{sv} */
+static void * variant_grow(struct cdbus_arena_t *arena, void *items,
+			int nb, size_t item_size)
+{
+	int size;
+
+	/* The size is the power of 2 from 4 above nb */
+	if (nb && ((nb < 4) || (nb & (nb - 1))))
+		return items;
+	size = nb ? nb * 2 : 4;
+	return cdbus_arena_realloc(arena, items, item_size * nb,
+				item_size * size);
+}
+
+static int variant_unpack_value(DBusMessageIter *iter,
+				struct cdbus_arena_t *arena,
+				struct cdbus_variant_t *variant)
+{
+	DBusMessageIter sub_iter, entry_iter;
+	struct cdbus_variant_t *items;
+	struct cdbus_dict_entry_t *entries;
+	struct cdbus_arena_fd_t *fd;
+	int type;
+
+	memset(variant, 0, sizeof(*variant));
+	variant->type = DBUS_TYPE_INVALID;
+
+	type = dbus_message_iter_get_arg_type(iter);
+	if (dbus_type_is_basic(type)) {
+		dbus_message_iter_get_basic(iter, &variant->value);
+		variant->type = type;
+		/* libdbus returns a duplicate of the descriptor */
+		if ((type == DBUS_TYPE_UNIX_FD) && arena) {
+			fd = cdbus_arena_alloc(arena, sizeof(*fd));
+			if (!fd) {
+				close(variant->value.fd);
+				variant->type = DBUS_TYPE_INVALID;
+				return -1;
+			}
+			fd->fd = variant->value.fd;
+			fd->next = arena->fds;
+			arena->fds = fd;
+		}
+		return 0;
+	}
+	if (type != DBUS_TYPE_ARRAY)
+		return -1;
+
+	dbus_message_iter_recurse(iter, &sub_iter);
+	switch (dbus_message_iter_get_element_type(iter)) {
+	case DBUS_TYPE_VARIANT:
+		variant->type = DBUS_TYPE_ARRAY;
+		while (dbus_message_iter_get_arg_type(&sub_iter)
+			== DBUS_TYPE_VARIANT) {
+			items = variant_grow(arena, variant->value.array.items,
+					variant->value.array.nb,
+					sizeof(*items));
+			if (!items)
+				return -1;
+			variant->value.array.items = items;
+			items += variant->value.array.nb++;
+			if (cdbus_variant_unpack(&sub_iter, arena, items) < 0)
+				return -1;
+			dbus_message_iter_next(&sub_iter);
+		}
+		return 0;
+	case DBUS_TYPE_DICT_ENTRY:
+		variant->type = DBUS_TYPE_DICT_ENTRY;
+		while (dbus_message_iter_get_arg_type(&sub_iter)
+			== DBUS_TYPE_DICT_ENTRY) {
+			dbus_message_iter_recurse(&sub_iter, &entry_iter);
+			if (dbus_message_iter_get_arg_type(&entry_iter)
+				!= DBUS_TYPE_STRING)
+				return -1;
+			entries = variant_grow(arena, variant->value.dict.entries,
+					variant->value.dict.nb,
+					sizeof(*entries));
+			if (!entries)
+				return -1;
+			variant->value.dict.entries = entries;
+			entries += variant->value.dict.nb++;
+			memset(entries, 0, sizeof(*entries));
+			dbus_message_iter_get_basic(&entry_iter, &entries->key);
+			dbus_message_iter_next(&entry_iter);
+			if (cdbus_variant_unpack(&entry_iter, arena,
+							&entries->value) < 0)
+				return -1;
+			dbus_message_iter_next(&sub_iter);
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+   Unpack the variant at iter without copying: the strings point into the
+   message. Only the items of an av or a{sv} are allocated, from the arena
+   or with malloc if arena is NULL (then release them with
+   cdbus_variant_free). The descriptors are closed with the variant.
+ */
+int cdbus_variant_unpack(DBusMessageIter * iter, struct cdbus_arena_t * arena,
+			struct cdbus_variant_t * variant)
+{
+	DBusMessageIter sub_iter;
+
+	if (!iter || !variant)
+		return -1;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT) {
+		memset(variant, 0, sizeof(*variant));
+		variant->type = DBUS_TYPE_INVALID;
+		return -1;
+	}
+
+	dbus_message_iter_recurse(iter, &sub_iter);
+	return variant_unpack_value(&sub_iter, arena, variant);
+}
+
+static const char * variant_signature(const struct cdbus_variant_t *variant,
+				char *buffer)
+{
+	if (variant->type == DBUS_TYPE_ARRAY)
+		return "av";
+	if (variant->type == DBUS_TYPE_DICT_ENTRY)
+		return "a{sv}";
+	if (!dbus_type_is_basic(variant->type))
+		return NULL;
+	buffer[0] = variant->type;
+	buffer[1] = 0;
+	return buffer;
+}
+
+int cdbus_variant_pack(DBusMessageIter * iter,
+		const struct cdbus_variant_t * variant)
+{
+	DBusMessageIter sub_iter, array_iter, entry_iter;
+	const char *signature, *str;
+	char buffer[2];
+	int i, ret = 0;
+
+	if (!iter || !variant)
+		return -1;
+
+	signature = variant_signature(variant, buffer);
+	if (!signature)
 		return -1;
 
-	return 0;
+	dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, signature,
+					&sub_iter);
+	switch (variant->type) {
+	case DBUS_TYPE_ARRAY:
+		dbus_message_iter_open_container(&sub_iter, DBUS_TYPE_ARRAY,
+						"v", &array_iter);
+		for (i = 0; i < variant->value.array.nb; i++) {
+			if (cdbus_variant_pack(&array_iter,
+					&variant->value.array.items[i]) < 0)
+				ret = -1;
+		}
+		dbus_message_iter_close_container(&sub_iter, &array_iter);
+		break;
+	case DBUS_TYPE_DICT_ENTRY:
+		dbus_message_iter_open_container(&sub_iter, DBUS_TYPE_ARRAY,
+						"{sv}", &array_iter);
+		for (i = 0; i < variant->value.dict.nb; i++) {
+			/* An entry must have a value */
+			if (!variant_signature(&variant->value.dict.entries[i].value,
+						buffer)) {
+				ret = -1;
+				continue;
+			}
+			str = variant->value.dict.entries[i].key;
+			if (!str)
+				str = "";
+			dbus_message_iter_open_container(&array_iter,
+						DBUS_TYPE_DICT_ENTRY, NULL,
+						&entry_iter);
+			dbus_message_iter_append_basic(&entry_iter,
+						DBUS_TYPE_STRING, &str);
+			if (cdbus_variant_pack(&entry_iter,
+					&variant->value.dict.entries[i].value) < 0)
+				ret = -1;
+			dbus_message_iter_close_container(&array_iter,
+							&entry_iter);
+		}
+		dbus_message_iter_close_container(&sub_iter, &array_iter);
+		break;
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	case DBUS_TYPE_SIGNATURE:
+		str = variant->value.str ? variant->value.str : "";
+		dbus_message_iter_append_basic(&sub_iter, variant->type, &str);
+		break;
+	default:
+		dbus_message_iter_append_basic(&sub_iter, variant->type,
+					&variant->value);
+		break;
+	}
+	dbus_message_iter_close_container(iter, &sub_iter);
+
+	return ret;
 }
 
+/* Release the items and close the descriptors of a variant unpacked
+   without arena */
+void cdbus_variant_free(struct cdbus_variant_t * variant)
+{
+	int i;
 
-static int generate_object_xml(DBusConnection * cnx,
-			DBusMessage * msg,
-			struct extensible_string_t * str,
-			struct cdbus_interface_entry_t * table)
+	if (!variant)
+		return;
+
+	if (variant->type == DBUS_TYPE_ARRAY) {
+		for (i = 0; i < variant->value.array.nb; i++)
+			cdbus_variant_free(&variant->value.array.items[i]);
+		free(variant->value.array.items);
+	} else if (variant->type == DBUS_TYPE_DICT_ENTRY) {
+		for (i = 0; i < variant->value.dict.nb; i++)
+			cdbus_variant_free(&variant->value.dict.entries[i].value);
+		free(variant->value.dict.entries);
+	} else if ((variant->type == DBUS_TYPE_UNIX_FD)
+		&& (variant->value.fd >= 0)) {
+		close(variant->value.fd);
+	}
+	variant->type = DBUS_TYPE_INVALID;
+}
+
+/*
+   Bulk payloads: the data is written into a sealed memfd and only its file
+   descriptor goes through the bus, the receiver maps it read-only.
+ */
+int cdbus_bulk_pack(DBusMessageIter * iter, const void * data, int len)
 {
-	int ret;
+	const char *ptr = data;
+	ssize_t size;
+	int fd, ret;
 
-	struct cdbus_interface_entry_t *itf = table;
-	char ** strarr, **curr;
-	ret = extstr_append_sprintf(str, "%s\n",
-				DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE);
-	if (ret < 0)
+	if (!iter || (len < 0) || (len && !data))
 		return -1;
 
-	ret = extstr_append_sprintf(str, "<node>");
-	if (ret < 0)
+	fd = memfd_create("cdbus-bulk", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		LOG(LOG_ERR, "memfd_create failed: %s\n", strerror(errno));
 		return -1;
-
-	while(itf->itf_name) {
-		ret = generate_interface_xml(str, itf);
-		if (ret < 0)
-			return -1;
-		itf++;
 	}
 
-	if (dbus_connection_list_registered(cnx, dbus_message_get_path(msg), &strarr)) {
-		for (curr = strarr ; *curr ; curr++) {
-			ret = extstr_append_sprintf(str, "<node name=\"%s\"/>", *curr);
-			if (ret < 0)
-				return -1;
+	while (len > 0) {
+		size = write(fd, ptr, len);
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err;
 		}
-		dbus_free_string_array(strarr);
+		ptr += size;
+		len -= size;
 	}
+	if (fcntl(fd, F_ADD_SEALS, BULK_SEALS) < 0)
+		goto err;
 
+	/* libdbus keeps its own copy of the descriptor */
+	ret = dbus_message_iter_append_basic(iter, DBUS_TYPE_UNIX_FD, &fd) ?
+		0 : -1;
+	close(fd);
+	return ret;
 
-	ret = extstr_append_sprintf(str, "</node>");
-
-	if (ret < 0)
-		return -1;
-
-	return 0;
+err:
+	LOG(LOG_ERR, "Unable to fill bulk payload: %s\n", strerror(errno));
+	close(fd);
+	return -1;
 }
 
-
-static int object_introspect(DBusConnection *cnx,
-		DBusMessage *msg,
-		struct cdbus_interface_entry_t * table)
+/* The mapping must be released with cdbus_bulk_unmap */
+int cdbus_bulk_unpack(DBusMessageIter * iter, void ** data, int * len)
 {
-	struct extensible_string_t str;
-	int ret = 0;
-	DBusMessage *reply;
+	struct stat st;
+	void *map;
+	int fd, seals;
 
-	if (extstr_init(&str) < 0)
+	if (!iter || !data || !len)
 		return -1;
+	*data = NULL;
+	*len = 0;
 
-	ret = generate_object_xml(cnx, msg, &str, table);
-	if (ret < 0)
-		goto free;
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_UNIX_FD)
+		return -1;
+	dbus_message_iter_get_basic(iter, &fd);
+	if (fd < 0)
+		return -1;
 
-	reply = dbus_message_new_method_return(msg);
-	if (!reply) {
-		ret = -1;
-		goto free;
+	/* The sender must not be able to change the payload under us */
+	seals = fcntl(fd, F_GET_SEALS);
+	if ((seals < 0) || ((seals & (F_SEAL_SHRINK | F_SEAL_WRITE))
+				!= (F_SEAL_SHRINK | F_SEAL_WRITE))) {
+		LOG(LOG_ERR, "Bulk payload is not sealed\n");
+		goto err;
 	}
+	if ((fstat(fd, &st) < 0) || (st.st_size > INT_MAX))
+		goto err;
 
-	if (dbus_message_append_args(reply,
-					DBUS_TYPE_STRING,
-					&str.buffer,
-					DBUS_TYPE_INVALID) == FALSE) {
-		ret = -1;
-		goto msg_unref;
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			goto err;
+		*data = map;
+		*len = st.st_size;
 	}
+	close(fd);
+	return 0;
 
-	dbus_connection_send(cnx, reply, NULL);
-
-msg_unref:
-	dbus_message_unref(reply);
-free:
-	extstr_free(&str);
-	return ret;
+err:
+	close(fd);
+	return -1;
 }
 
-static DBusHandlerResult object_dispatch(DBusConnection *cnx,
-			DBusMessage *msg,
-			void *data)
+void cdbus_bulk_unmap(void * data, int len)
 {
-	struct cdbus_user_data_t * user_data = data;
-	struct cdbus_interface_entry_t * table;
-	const char * interface;
-	const char * member;
-	cdbus_proxy_fcn_t fcn;
-	int ret;
+	if (data && (len > 0))
+		munmap(data, len);
+}
 
-	if (!data)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+struct cdbus_reply_token_t {
+	DBusConnection *cnx;
+	DBusMessage *msg;
+	/* Statistics of the member and start of the call */
+	struct cdbus_member_stats_t *stats;
+	unsigned long long start;
+};
 
-	if (user_data)
-		table = user_data->object_table;
+/*
+   Take over the reply of the method call msg: the handler returns
+   CDBUS_REPLY_DEFERRED and the reply is sent later with the generated
+   <method>_reply or <method>_reply_error functions. The token keeps a
+   reference on the connection and the message, but the in arguments given
+   to the handler are released when it returns and must be copied if they
+   are needed for the reply. When libcdbus is built with THREAD_SAFE, the
+   reply may be sent from any thread.
+ */
+struct cdbus_reply_token_t * cdbus_defer_reply(DBusConnection * cnx,
+					DBusMessage * msg)
+{
+	struct cdbus_reply_token_t *token;
 
-	member = dbus_message_get_member(msg);
-	if (!member)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	if (!cnx || !msg)
+		return NULL;
 
-	if (!strncmp(member, "Introspect", strlen(member))) {
-		if (object_introspect(cnx, msg, table) < 0)
-			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-		else
-			return DBUS_HANDLER_RESULT_HANDLED;
-	}
+#ifdef LIBUTILS_PTHREAD_LOCK
+	if (connection_enable_wakeup(cnx, get_context(cnx)) < 0)
+		return NULL;
+#endif
 
-	interface = dbus_message_get_interface(msg);
-	if (interface) {
-		fcn = find_member_with_interface(interface, member, table);
-	} else {
-		fcn = find_member_all_interfaces(member, table);
+	token = malloc(sizeof(*token));
+	if (!token)
+		return NULL;
+	token->cnx = dbus_connection_ref(cnx);
+	token->msg = dbus_message_ref(msg);
+	token->stats = NULL;
+	if (current_call) {
+		token->stats = current_call->stats;
+		token->start = current_call->start;
+		current_call->deferred = 1;
 	}
 
-	if (!fcn) {
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-	}
+	return token;
+}
 
-	ret = fcn(cnx, msg, user_data->user_data);
-	if (ret < 0)
-		LOG(LOG_WARNING, "Failed to execute handler for member %s "
-			"of object %s\n", member, dbus_message_get_path(msg));
+/* Send the reply of the method call being handled by the thread */
+int cdbus_send_reply(DBusConnection * cnx, DBusMessage * reply)
+{
+	if (current_call)
+		stats_add_size(current_call->stats,
+			&current_call->stats->bytes_out, reply);
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	return (dbus_connection_send(cnx, reply, NULL) == TRUE) ? 0 : -1;
 }
 
+/* Drop the token without replying */
+void cdbus_reply_token_free(struct cdbus_reply_token_t * token)
+{
+	if (!token)
+		return;
 
-static DBusObjectPathVTable vtable = {
-	.message_function = object_dispatch,
-};
+	dbus_message_unref(token->msg);
+	dbus_connection_unref(token->cnx);
+	free(token);
+}
 
-int cdbus_register_object(DBusConnection * cnx, const char * path,
-			struct cdbus_user_data_t * user_data)
+DBusMessage * cdbus_reply_new_return(struct cdbus_reply_token_t * token)
 {
-	int ret;
-	ret = dbus_connection_register_object_path(cnx, path, &vtable,
-						user_data);
-	if (ret == FALSE)
-		return -1;
+	if (!token)
+		return NULL;
 
-	return 0;
+	return dbus_message_new_method_return(token->msg);
 }
 
-int cdbus_unregister_object(DBusConnection * cnx, const char * path)
+/* Send the reply and release it with the token */
+int cdbus_reply_send(struct cdbus_reply_token_t * token, DBusMessage * reply)
 {
-	int ret;
-	ret = dbus_connection_unregister_object_path(cnx, path);
-	if (ret == FALSE)
+	int ret = 0;
+
+	if (!token || !reply)
 		return -1;
-	return 0;
+
+	if (token->stats) {
+		if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+			stats_add(&token->stats->errors, 1);
+		stats_add_size(token->stats, &token->stats->bytes_out, reply);
+		stats_record_time(token->stats, token->start);
+	}
+
+	if (dbus_connection_send(token->cnx, reply, NULL) == FALSE)
+		ret = -1;
+	dbus_message_unref(reply);
+	cdbus_reply_token_free(token);
+
+	return ret;
 }
 
-int cdbus_register_signals(DBusConnection * cnx, const char * sender, const char * path,
-	struct cdbus_user_data_t * user_data)
+int cdbus_reply_error(struct cdbus_reply_token_t * token, const char * name,
+		const char * message)
 {
-	struct signal_t * signal;
-	struct cdbus_interface_entry_t * itf_entry;
-	int len;
-
+	DBusMessage *reply;
 
-	if (!cnx)
-		return -1;
-	if (!user_data || !user_data->object_table)
+	if (!token)
 		return -1;
 
-	signal = malloc(sizeof(*signal));
-	if (!signal)
+	reply = dbus_message_new_error(token->msg,
+				name ? name : DBUS_ERROR_FAILED,
+				message ? message : "method_call failed");
+	if (!reply)
 		return -1;
-	memset(signal, 0, sizeof(*signal));
 
-	LIST_ITEM_INIT(signal->item);
-	signal->cnx = cnx;
-	if (sender)
-		signal->sender = strdup(sender);
-	if (path)
-		signal->object = strdup(path);
-	signal->data.object_table = user_data->object_table;
-	signal->data.user_data = user_data->user_data;
-	signal->match_rule = malloc(sizeof(char) * DBUS_MAXIMUM_MATCH_RULE_LENGTH);
+	return cdbus_reply_send(token, reply);
+}
 
-	if (!signal->match_rule)
-		goto free;
-	if (sender && !signal->sender)
-		goto free;
-	if (path && !signal->object)
-		goto free;
+struct batch_call_t {
+	DBusMessage *msg;
+	DBusPendingCall *pending;
+	cdbus_reply_cb_t cb;
+	void *data;
+	DBusFreeFunction free_data;
+};
 
-	len = snprintf(signal->match_rule, DBUS_MAXIMUM_MATCH_RULE_LENGTH,
-		"type='signal'");
-	itf_entry = signal->data.object_table;
-	while (itf_entry->itf_name) {
-		len += snprintf(signal->match_rule + len,
-				DBUS_MAXIMUM_MATCH_RULE_LENGTH - len,
-				",interface='%s'",
-				itf_entry->itf_name);
-		itf_entry++;
-	}
-	if (signal->sender)
-		len += snprintf(signal->match_rule + len,
-				DBUS_MAXIMUM_MATCH_RULE_LENGTH - len,
-				",sender='%s'",
-				signal->sender);
-	if (signal->object)
-		len += snprintf(signal->match_rule + len,
-				DBUS_MAXIMUM_MATCH_RULE_LENGTH - len,
-				",path='%s'",
-				signal->object);
-	signal->match_rule[DBUS_MAXIMUM_MATCH_RULE_LENGTH - 1] = 0;
-	dbus_bus_add_match(cnx, signal->match_rule, NULL);
+struct cdbus_batch_t {
+	DBusConnection *cnx;
+	struct batch_call_t *calls;
+	int nb;
+	int size;
+};
 
-	list_add_tail(&signal_list, &signal->item);
+struct cdbus_batch_t * cdbus_batch_new(DBusConnection * cnx)
+{
+	struct cdbus_batch_t *batch;
 
-	return 0;
+	if (!cnx)
+		return NULL;
 
-free:
-	if (signal->match_rule)
-		free(signal->match_rule);
- 	if (signal->sender)
-		free(signal->sender);
- 	if (signal->object)
-		free(signal->object);
-	free(signal);
-	return -1;
+	batch = malloc(sizeof(*batch));
+	if (!batch)
+		return NULL;
+	memset(batch, 0, sizeof(*batch));
+	batch->cnx = dbus_connection_ref(cnx);
 
+	return batch;
 }
 
-int cdbus_unregister_signals(DBusConnection * cnx, const char * sender, const char * path)
+static void batch_call_free(struct batch_call_t *call)
 {
-	struct list_item_t * item;
-	struct signal_t * signal;
+	if (call->msg)
+		dbus_message_unref(call->msg);
+	if (call->pending) {
+		dbus_pending_call_cancel(call->pending);
+		dbus_pending_call_unref(call->pending);
+	}
+	if (call->free_data)
+		call->free_data(call->data);
+}
 
-	for_each_list_item(&signal_list, item, item, signal) {
-		if ((signal->cnx == cnx)
-			&& (signal->sender == sender)
-			&& (signal->object == path))
-			break;
+/* Queue a method call, the message is sent by cdbus_batch_run. The reply is
+   given to cb, free_data is called on data once the call is done or
+   dropped */
+int cdbus_batch_add(struct cdbus_batch_t * batch, DBusMessage * msg,
+		cdbus_reply_cb_t cb, void * data, DBusFreeFunction free_data)
+{
+	struct batch_call_t *calls;
+	int size;
+
+	if (!batch || !msg)
+		return -1;
+
+	if (batch->nb == batch->size) {
+		size = batch->size ? batch->size * 2 : 16;
+		calls = realloc(batch->calls, sizeof(*calls) * size);
+		if (!calls)
+			return -1;
+		batch->calls = calls;
+		batch->size = size;
 	}
-	if (signal) {
-		list_rem_item(&signal->item);
-		dbus_bus_remove_match(cnx, signal->match_rule, NULL);
 
-		if (signal->sender)
-			free(signal->sender);
-		if (signal->object)
-			free(signal->object);
-		free(signal);
-		return 0;
-	} else {
+	memset(&batch->calls[batch->nb], 0, sizeof(*batch->calls));
+	batch->calls[batch->nb].msg = dbus_message_ref(msg);
+	batch->calls[batch->nb].cb = cb;
+	batch->calls[batch->nb].data = data;
+	batch->calls[batch->nb].free_data = free_data;
+	batch->nb++;
+
+	return 0;
+}
+
+/*
+   Send all the queued calls back to back, then wait for their replies. The
+   whole batch shares one deadline, timeout ms after the call (the default
+   timeout of libdbus if negative): a call without reply at this time gets a
+   NoReply error. The callbacks are called in the order of the calls and
+   the batch is emptied.
+   Return 0 if every call got a successful reply, -1 otherwise.
+ */
+int cdbus_batch_run(struct cdbus_batch_t * batch, int timeout)
+{
+	struct batch_call_t *call;
+	DBusMessage *reply;
+	int ret = 0;
+	int i;
+
+	if (!batch)
 		return -1;
+
+	/* Every call is sent with the same timeout, so that they all expire
+	   together */
+	for (i = 0 ; i < batch->nb ; i++) {
+		call = &batch->calls[i];
+		if (!dbus_connection_send_with_reply(batch->cnx, call->msg,
+						&call->pending, timeout))
+			call->pending = NULL;
+		dbus_message_unref(call->msg);
+		call->msg = NULL;
+	}
+	dbus_connection_flush(batch->cnx);
+
+	for (i = 0 ; i < batch->nb ; i++) {
+		call = &batch->calls[i];
+		reply = NULL;
+		if (call->pending) {
+			/* The replies of the next calls are queued while
+			   waiting for this one */
+			dbus_pending_call_block(call->pending);
+			reply = dbus_pending_call_steal_reply(call->pending);
+		}
+
+		if (!reply || dbus_message_get_error_name(reply))
+			ret = -1;
+		if (call->cb)
+			call->cb(batch->cnx, reply, call->data);
+		if (reply)
+			dbus_message_unref(reply);
+		batch_call_free(call);
 	}
+	batch->nb = 0;
+
+	return ret;
+}
+
+void cdbus_batch_free(struct cdbus_batch_t * batch)
+{
+	int i;
+
+	if (!batch)
+		return;
+
+	for (i = 0 ; i < batch->nb ; i++)
+		batch_call_free(&batch->calls[i]);
+	free(batch->calls);
+	dbus_connection_unref(batch->cnx);
+	free(batch);
 }
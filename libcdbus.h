@@ -25,8 +25,26 @@
 #define LIBCDBUS_H
 
 #include <poll.h>
+#include <stddef.h>
 #include <dbus/dbus.h>
 
+/* USDT probes of the libcdbus provider, built when CDBUS_USDT is defined
+   (cmake -DUSDT=yes, sys/sdt.h from systemtap is needed). The proxies
+   generated by xml2cdbus.py fire them too and must be built with the same
+   definition. A probe is a single nop until a tracer attaches to it, see
+   cdbus-latency.bt */
+#ifdef CDBUS_USDT
+#include <sys/sdt.h>
+#define CDBUS_PROBE1(name, arg1) DTRACE_PROBE1(libcdbus, name, arg1)
+#define CDBUS_PROBE2(name, arg1, arg2) DTRACE_PROBE2(libcdbus, name, arg1, arg2)
+#define CDBUS_PROBE4(name, arg1, arg2, arg3, arg4)			\
+	DTRACE_PROBE4(libcdbus, name, arg1, arg2, arg3, arg4)
+#else
+#define CDBUS_PROBE1(name, arg1) do { } while (0)
+#define CDBUS_PROBE2(name, arg1, arg2) do { } while (0)
+#define CDBUS_PROBE4(name, arg1, arg2, arg3, arg4) do { } while (0)
+#endif
+
 DBusConnection* cdbus_get_connection(DBusBusType bus_type);
 
 int cdbus_request_name(DBusConnection* cnx, char * name, int replace);
@@ -36,8 +54,40 @@ const char * cdbus_version_string();
 /* Main loop functions */
 int cdbus_build_pollfds(struct pollfd ** fds, int *nfds, int reserve_slots);
 int cdbus_process_pollfds(struct pollfd * fds, int nfds);
+int cdbus_get_pollfds(struct pollfd ** fds, int *nfds, int reserve_slots,
+		unsigned int *generation);
+unsigned int cdbus_pollfds_generation();
+int cdbus_handle_pollfds(struct pollfd * fds, int nfds);
+int cdbus_get_epoll_fd();
+int cdbus_handle_events();
 int cdbus_next_timeout_event();
 int cdbus_timeout_handle();
+int cdbus_enable_timerfd();
+
+/* Contexts: each context runs its own set of connections, the functions
+   above use the default context */
+struct cdbus_context_t;
+
+struct cdbus_context_t * cdbus_context_new();
+void cdbus_context_free(struct cdbus_context_t * ctx);
+DBusConnection* cdbus_context_get_connection(struct cdbus_context_t * ctx,
+					DBusBusType bus_type);
+
+int cdbus_context_build_pollfds(struct cdbus_context_t * ctx,
+			struct pollfd ** fds, int *nfds, int reserve_slots);
+int cdbus_context_process_pollfds(struct cdbus_context_t * ctx,
+			struct pollfd * fds, int nfds);
+int cdbus_context_get_pollfds(struct cdbus_context_t * ctx,
+		struct pollfd ** fds, int *nfds, int reserve_slots,
+		unsigned int *generation);
+unsigned int cdbus_context_pollfds_generation(struct cdbus_context_t * ctx);
+int cdbus_context_handle_pollfds(struct cdbus_context_t * ctx,
+			struct pollfd * fds, int nfds);
+int cdbus_context_get_epoll_fd(struct cdbus_context_t * ctx);
+int cdbus_context_handle_events(struct cdbus_context_t * ctx);
+int cdbus_context_next_timeout_event(struct cdbus_context_t * ctx);
+int cdbus_context_timeout_handle(struct cdbus_context_t * ctx);
+int cdbus_context_enable_timerfd(struct cdbus_context_t * ctx);
 
 struct cdbus_user_data_t
 {
@@ -50,11 +100,185 @@ int cdbus_register_object(DBusConnection * cnx, const char * path,
 			struct cdbus_user_data_t * user_data);
 int cdbus_unregister_object(DBusConnection * cnx, const char * path);
 
+/* Subtrees: the objects registered below path are looked up in an index of
+   libcdbus, a single registration with libdbus serves all of them */
+int cdbus_register_subtree(DBusConnection * cnx, const char * path);
+int cdbus_unregister_subtree(DBusConnection * cnx, const char * path);
+
+/* Object managers: GetManagedObjects reports the objects registered below
+   the path in one reply, InterfacesAdded and InterfacesRemoved are sent
+   when they are registered and unregistered */
+int cdbus_register_object_manager(DBusConnection * cnx, const char * path);
+int cdbus_unregister_object_manager(DBusConnection * cnx, const char * path);
+
+/* Properties: the values are cached by the object, Get and GetAll are
+   served from the cache without calling the handlers. value holds the new
+   value packed as a variant, the changes of a loop iteration are merged
+   into one PropertiesChanged signal per interface */
+int cdbus_property_update(DBusConnection * cnx, const char * path,
+			const char * interface, const char * name,
+			DBusMessage * value);
+
+/* Statistics: they are gathered for the members of the tables generated by
+   xml2cdbus.py. They are also readable through the CDBUS_INTERFACE_STATS
+   interface of the objects: GetStats returns one (interface, member,
+   calls, errors, bytes_in, bytes_out, time_total, time_max, latency)
+   structure per member, Reset clears them. The proxies send their replies
+   with cdbus_send_reply so that they are accounted to the member */
+#define CDBUS_INTERFACE_STATS "fr.sise.cdbus.Stats"
+
+struct cdbus_member_stats_t;
+
+/* The counters belong to the table, not to the objects: all the objects
+   registered with the same table share them, so GetStats on one of them
+   returns the totals of all of them, and Reset on one of them clears them
+   for all */
+int cdbus_get_member_stats(struct cdbus_interface_entry_t * table,
+			const char * interface, const char * member,
+			struct cdbus_member_stats_t * stats);
+void cdbus_reset_stats(struct cdbus_interface_entry_t * table);
+/* The byte counters are off by default: libdbus doesn't export the body
+   length of a message, so counting it walks the arguments of every call
+   and reply of the members of the table */
+void cdbus_enable_byte_stats(struct cdbus_interface_entry_t * table,
+			int enable);
+int cdbus_send_reply(DBusConnection * cnx, DBusMessage * reply);
+
+/* Deferred replies */
+#define CDBUS_REPLY_DEFERRED 1
+
+struct cdbus_reply_token_t;
+
+struct cdbus_reply_token_t * cdbus_defer_reply(DBusConnection * cnx,
+					DBusMessage * msg);
+void cdbus_reply_token_free(struct cdbus_reply_token_t * token);
+DBusMessage * cdbus_reply_new_return(struct cdbus_reply_token_t * token);
+int cdbus_reply_send(struct cdbus_reply_token_t * token, DBusMessage * reply);
+int cdbus_reply_error(struct cdbus_reply_token_t * token, const char * name,
+		const char * message);
+
+/* Arena allocator: a bump allocator whose memory is released at once by
+   cdbus_arena_reset. A NULL arena falls back to malloc/realloc. The file
+   descriptors of the variants unpacked in the arena are closed by the
+   reset too */
+#define CDBUS_ARENA_BUFF_SIZE 1024
+
+struct cdbus_arena_chunk_t;
+struct cdbus_arena_fd_t;
+
+struct cdbus_arena_t
+{
+	struct cdbus_arena_chunk_t * chunks;
+	struct cdbus_arena_fd_t * fds;
+	char * base;
+	size_t size;
+	size_t used;
+	size_t last;
+	union {
+		char data[CDBUS_ARENA_BUFF_SIZE];
+		long double align;
+	} buffer;
+};
+
+void cdbus_arena_init(struct cdbus_arena_t * arena);
+void * cdbus_arena_alloc(struct cdbus_arena_t * arena, size_t size);
+void * cdbus_arena_realloc(struct cdbus_arena_t * arena, void * ptr,
+			size_t old_size, size_t size);
+void cdbus_arena_reset(struct cdbus_arena_t * arena);
+
+/* Variants: scalars are held inline and strings are borrowed from the
+   message. Besides the basic types, type is DBUS_TYPE_ARRAY for an av
+   and DBUS_TYPE_DICT_ENTRY for an a{sv}, their items are allocated in the
+   arena given to cdbus_variant_unpack. A variant owns the descriptor of a
+   DBUS_TYPE_UNIX_FD value: cdbus_variant_free, or the reset of its arena,
+   closes it, dup() it to keep it */
+struct cdbus_dict_entry_t;
+
+struct cdbus_variant_t
+{
+	int type;
+	union {
+		unsigned char byt;
+		dbus_bool_t bool_val;
+		dbus_int16_t i16;
+		dbus_uint16_t u16;
+		dbus_int32_t i32;
+		dbus_uint32_t u32;
+		dbus_int64_t i64;
+		dbus_uint64_t u64;
+		double dbl;
+		const char * str;
+		int fd;
+		struct {
+			struct cdbus_variant_t * items;
+			int nb;
+		} array;
+		struct {
+			struct cdbus_dict_entry_t * entries;
+			int nb;
+		} dict;
+	} value;
+};
+
+struct cdbus_dict_entry_t
+{
+	const char * key;
+	struct cdbus_variant_t value;
+};
+
+int cdbus_variant_unpack(DBusMessageIter * iter, struct cdbus_arena_t * arena,
+			struct cdbus_variant_t * variant);
+int cdbus_variant_pack(DBusMessageIter * iter,
+		const struct cdbus_variant_t * variant);
+void cdbus_variant_free(struct cdbus_variant_t * variant);
+
+/* Bulk payloads: an ay argument annotated with fr.sise.cdbus.Bulk is sent
+   as a sealed memfd. The receiver gets a read-only mapping, released after
+   the handler or callback returns; the out arguments of a synchronous call
+   must be released with cdbus_bulk_unmap */
+int cdbus_bulk_pack(DBusMessageIter * iter, const void * data, int len);
+int cdbus_bulk_unpack(DBusMessageIter * iter, void ** data, int * len);
+void cdbus_bulk_unmap(void * data, int len);
+
+/* Worker pools */
+struct cdbus_pool_t;
+
+struct cdbus_pool_t * cdbus_pool_create(int nb_threads);
+void cdbus_pool_destroy(struct cdbus_pool_t * pool);
+int cdbus_object_set_pool(DBusConnection * cnx, const char * path,
+			const char * interface, const char * member,
+			struct cdbus_pool_t * pool);
+
 /* Signals */
 int cdbus_register_signals(DBusConnection * cnx, const char * sender, const char * path,
 	struct cdbus_user_data_t * user_data);
 int cdbus_unregister_signals(DBusConnection * cnx, const char * sender, const char * path);
 
+/* Signal emission: the queued signals are sent by the event loop once per
+   iteration. The emissions of a signal sent with cdbus_send_signal_coalesced
+   within the coalescing window are merged, only the latest one is sent
+   whatever its arguments: it is meant for the signals reporting a whole
+   state. The signals generated from an XML annotated with
+   fr.sise.cdbus.Coalesce are sent this way */
+int cdbus_signal_queue_enable(DBusConnection * cnx, int window);
+int cdbus_signal_queue_disable(DBusConnection * cnx);
+int cdbus_signal_queue_flush(DBusConnection * cnx);
+int cdbus_send_signal(DBusConnection * cnx, DBusMessage * msg);
+int cdbus_send_signal_coalesced(DBusConnection * cnx, DBusMessage * msg);
+
+/* Batch of method calls */
+struct cdbus_batch_t;
+
+/* The reply is NULL if the call could not be sent */
+typedef void (*cdbus_reply_cb_t)(DBusConnection *cnx, DBusMessage *reply,
+				void *data);
+
+struct cdbus_batch_t * cdbus_batch_new(DBusConnection * cnx);
+int cdbus_batch_add(struct cdbus_batch_t * batch, DBusMessage * msg,
+		cdbus_reply_cb_t cb, void * data, DBusFreeFunction free_data);
+int cdbus_batch_run(struct cdbus_batch_t * batch, int timeout);
+void cdbus_batch_free(struct cdbus_batch_t * batch);
+
 
 /* Private declarations */
 
@@ -70,18 +294,86 @@ struct cdbus_arg_entry_t
 	char * signature;
 };
 
+#define CDBUS_PROPERTY_READ  1
+#define CDBUS_PROPERTY_WRITE 2
+
+/* Value of the org.freedesktop.DBus.Property.EmitsChangedSignal
+   annotation */
+#define CDBUS_PROPERTY_EMITS_CHANGED     0
+#define CDBUS_PROPERTY_EMITS_INVALIDATES 1
+#define CDBUS_PROPERTY_EMITS_NONE        2
+
+/* Unpack the value of a Set call, iter is in the variant, and call the
+   handler of the property */
+typedef int (*cdbus_property_set_fcn_t)(DBusConnection *, DBusMessage *,
+					DBusMessageIter *, void *);
+
+struct cdbus_property_entry_t
+{
+	char *prop_name;
+	char *signature;
+	int access;
+	int emits;
+	cdbus_property_set_fcn_t set_fcn;
+};
+
+/* Statistics of a member, updated with relaxed atomic operations by the
+   threads running it. The times are in microseconds. Bucket 0 of the
+   latency histogram counts the calls shorter than 1 us, bucket i the ones
+   between 2^(i-1) and 2^i us, the last bucket also counts the longer ones.
+   The byte counters hold the body sizes of the messages received and of
+   the replies, without their headers and alignment padding, when
+   count_bytes is set by cdbus_enable_byte_stats */
+#define CDBUS_STATS_BUCKETS 32
+
+struct cdbus_member_stats_t
+{
+	unsigned long long calls;
+	unsigned long long errors;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long time_total;
+	unsigned long long time_max;
+	unsigned long long latency[CDBUS_STATS_BUCKETS];
+	int count_bytes;
+};
+
 struct cdbus_message_entry_t
 {
 	int is_signal;
 	char *msg_name;
 	cdbus_proxy_fcn_t msg_fcn;
 	struct cdbus_arg_entry_t *msg_table;
+	/* Optional statistics of the member */
+	struct cdbus_member_stats_t *msg_stats;
+};
+
+/* Perfect hash generated by xml2cdbus.py: the key is first hashed with a
+   null seed to select a displacement seed, then with this seed to get the
+   slot holding the index of the entry in the table (-1 if the slot is
+   empty). The key must still be compared with the name of the entry */
+struct cdbus_hash_t
+{
+	unsigned int mask;
+	unsigned int disp_mask;
+	const unsigned short *disp;
+	const short *slots;
 };
 
 struct cdbus_interface_entry_t
 {
 	char *itf_name;
 	struct cdbus_message_entry_t *itf_table;
+	/* Optional hashes: itf_hash indexes the members of itf_table,
+	   obj_hash indexes the interfaces of the object table. The tables
+	   are linearly scanned when they are NULL */
+	const struct cdbus_hash_t *itf_hash;
+	const struct cdbus_hash_t *obj_hash;
+	/* Optional introspection data of the interface, generated when
+	   NULL */
+	const char *itf_xml;
+	/* Optional properties of the interface */
+	struct cdbus_property_entry_t *itf_props;
 };
 
 #endif
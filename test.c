@@ -71,8 +71,10 @@ int main(int argc, char **argv)
 	struct sigaction action;
 	DBusConnection *cnx;
 	int timeout;
-	struct pollfd * fds;
-	int nfds;
+	struct pollfd * fds = NULL;
+	int nfds = 0;
+	unsigned int generation = 0;
+	short fifo_revents;
 	int fifofd;
 	char *msg;
 	int tmp;
@@ -105,13 +107,17 @@ int main(int argc, char **argv)
 
 	while(!done) {
 		timeout = cdbus_next_timeout_event();
-		if (cdbus_build_pollfds(&fds, &nfds, 1) < 0)
-			break;
-		fds[nfds].fd = fifofd;
-		fds[nfds].events = POLLIN;
+		if (generation != cdbus_pollfds_generation()) {
+			if (cdbus_get_pollfds(&fds, &nfds, 1, &generation) < 0)
+				break;
+			fds[nfds].fd = fifofd;
+			fds[nfds].events = POLLIN;
+		}
 		poll(fds, nfds + 1, timeout);
-		cdbus_process_pollfds(fds, nfds);
-		if (fds[nfds].revents) {
+		/* the array may be moved by the handle function */
+		fifo_revents = fds[nfds].revents;
+		cdbus_handle_pollfds(fds, nfds);
+		if (fifo_revents) {
 			msg = malloc(128 * sizeof(char));
 			memset(msg, 0, 128 * sizeof(char));
 			tmp = nbread = 0;
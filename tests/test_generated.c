@@ -0,0 +1,748 @@
+/*
+ * Test of the code generated by xml2cdbus.py from test_generated.xml: the
+ * synchronous, asynchronous and batched calls, the arrays of containers,
+ * the worker pools, the deferred replies, the bulk payloads, the
+ * properties, the object managers and the statistics. The service runs the loop in the mode given as argument: poll,
+ * epoll or timerfd
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "fr_sise_gen.h"
+#include "check.h"
+
+#define SERVICE "fr.sise.gen"
+#define PATH "/fr/sise/gen"
+#define CHILD_PATH PATH "/child"
+#define LEAF_PATH CHILD_PATH "/leaf"
+#define MANAGER_PATH "/fr/sise"
+#define NB_SLOW 4
+#define NB_LATER 3
+#define NB_PIXELS 65536
+#define THUMB_STEP 4096
+#define MAX_LEVEL 100
+/* More than the first allocation of the decoder of the arrays */
+#define NB_ENTRIES 12
+
+enum {
+	MODE_POLL,
+	MODE_EPOLL,
+	MODE_TIMERFD,
+};
+
+static pthread_t loop_thread;
+/* Number of Slow calls run by a worker pool */
+static int slow_in_pool;
+static struct cdbus_reply_token_t *later_tokens[NB_LATER];
+static unsigned long later_ids[NB_LATER];
+static int nb_later;
+
+static int gen_Echo(DBusConnection *cnx, DBusMessage *msg, void *data,
+		char *text, int32_t *nums, int nums_len,
+		struct fr_sise_gen_Echo_pair_t *pair, char **upper,
+		int32_t **reversed, int *reversed_len, long *sum)
+{
+	int i;
+
+	*upper = strdup(text);
+	*reversed = malloc(sizeof(**reversed) * (nums_len + 1));
+	if (!*upper || !*reversed) {
+		free(*upper);
+		free(*reversed);
+		return -1;
+	}
+	for (i = 0 ; (*upper)[i] ; i++)
+		(*upper)[i] = toupper((*upper)[i]);
+	*sum = pair->member_1;
+	for (i = 0 ; i < nums_len ; i++) {
+		(*reversed)[nums_len - 1 - i] = nums[i];
+		*sum += nums[i];
+	}
+	*reversed_len = nums_len;
+	return 0;
+}
+
+/* The out arrays are freed by the proxy, not the strings */
+static void gen_Echo_free(DBusConnection *cnx, DBusMessage *msg, void *data,
+			char *text, int32_t *nums, int nums_len,
+			struct fr_sise_gen_Echo_pair_t *pair, char **upper,
+			int32_t **reversed, int *reversed_len, long *sum)
+{
+	free(*upper);
+}
+
+/* Run by the pool when libcdbus is thread safe */
+static int gen_Slow(DBusConnection *cnx, DBusMessage *msg, void *data,
+		unsigned long id, unsigned long *out_id)
+{
+	if (!pthread_equal(pthread_self(), loop_thread))
+		__atomic_fetch_add(&slow_in_pool, 1, __ATOMIC_RELAXED);
+	usleep(20000);
+	*out_id = id;
+	return 0;
+}
+
+/* The replies are sent in reverse order once all the calls are received,
+   id 0 gets an error at once */
+static int gen_Later(DBusConnection *cnx, DBusMessage *msg, void *data,
+		unsigned long id, unsigned long *out_id)
+{
+	struct cdbus_reply_token_t *token;
+
+	token = cdbus_defer_reply(cnx, msg);
+	if (!token)
+		return -1;
+	if (!id) {
+		fr_sise_gen_Later_reply_error(token, DBUS_ERROR_INVALID_ARGS,
+					"id 0");
+		return CDBUS_REPLY_DEFERRED;
+	}
+
+	later_tokens[nb_later] = token;
+	later_ids[nb_later++] = id;
+	if (nb_later == NB_LATER) {
+		while (nb_later--)
+			CHECK(fr_sise_gen_Later_reply(later_tokens[nb_later],
+						later_ids[nb_later]) == 0);
+		nb_later = 0;
+	}
+	return CDBUS_REPLY_DEFERRED;
+}
+
+/* The sum of the pixels, and one out of THUMB_STEP as thumbnail */
+static int gen_Image(DBusConnection *cnx, DBusMessage *msg, void *data,
+		char *pixels, int pixels_len, unsigned long *sum,
+		char **thumb, int *thumb_len)
+{
+	int i;
+
+	*thumb = malloc(pixels_len / THUMB_STEP + 1);
+	if (!*thumb)
+		return -1;
+	*sum = 0;
+	for (i = 0 ; i < pixels_len ; i++)
+		*sum += (unsigned char)pixels[i];
+	for (i = 0 ; i < pixels_len / THUMB_STEP ; i++)
+		(*thumb)[i] = pixels[i * THUMB_STEP];
+	*thumb_len = pixels_len / THUMB_STEP;
+	return 0;
+}
+
+/* The second string of the entries and the sum of their numbers. The
+   strings are borrowed from the call, an empty array has no storage */
+static int gen_Names(DBusConnection *cnx, DBusMessage *msg, void *data,
+		struct fr_sise_gen_Names_entries_t *entries, int entries_len,
+		char ***names, int *names_len, long *total)
+{
+	int i;
+
+	*names = NULL;
+	*names_len = 0;
+	*total = 0;
+	if (!entries_len) {
+		CHECK(entries == NULL);
+		return 0;
+	}
+
+	*names = malloc(sizeof(**names) * entries_len);
+	if (!*names)
+		return -1;
+	for (i = 0 ; i < entries_len ; i++) {
+		(*names)[i] = entries[i].member_2;
+		*total += entries[i].member_1;
+	}
+	*names_len = entries_len;
+	return 0;
+}
+
+struct fr_sise_gen_ops fr_sise_gen_ops = {
+	.Echo = gen_Echo,
+	.Echo_free = gen_Echo_free,
+	.Slow = gen_Slow,
+	.Later = gen_Later,
+	.Image = gen_Image,
+	.Names = gen_Names,
+};
+
+/* The levels above MAX_LEVEL are refused */
+static int gen_set_Level(DBusConnection *cnx, DBusMessage *msg, void *data,
+			unsigned long level)
+{
+	return (level > MAX_LEVEL) ? -1 : 0;
+}
+
+struct fr_sise_gen_properties_ops fr_sise_gen_properties_ops = {
+	.Level = gen_set_Level,
+};
+
+/* Update the level of the child until it is unregistered by the loop */
+static void * update_child(void *data)
+{
+	DBusConnection *cnx = data;
+	unsigned long level = 0;
+
+	while (fr_sise_gen_Level_update(cnx, CHILD_PATH, level++) == 0)
+		;
+	return NULL;
+}
+
+/* Replies received by the client, and their ids in order */
+static int nb_replies;
+static char ids[64];
+
+static void append_id(unsigned long id)
+{
+	snprintf(ids + strlen(ids), sizeof(ids) - strlen(ids), "%s%lu",
+		ids[0] ? " " : "", id);
+}
+
+static void echo_cb(DBusConnection *cnx, int ret, void *data, char *upper,
+		int32_t *reversed, int reversed_len, long sum)
+{
+	nb_replies++;
+	CHECK(ret == 0);
+	if (ret < 0)
+		return;
+	CHECK(!strcmp(upper, "ABC"));
+	CHECK((reversed_len == 3) && (reversed[0] == 3) && (reversed[2] == 1));
+	CHECK(sum == 10);
+}
+
+/* data is NULL for the empty array */
+static void names_cb(DBusConnection *cnx, int ret, void *data, char **names,
+		int names_len, long total)
+{
+	char name[16];
+	int i;
+
+	nb_replies++;
+	CHECK(ret == 0);
+	if (ret < 0)
+		return;
+	if (!data) {
+		CHECK(!names && !names_len && !total);
+		return;
+	}
+	CHECK((names_len == NB_ENTRIES) && names);
+	for (i = 0 ; names && (i < names_len) ; i++) {
+		snprintf(name, sizeof(name), "name%d", i);
+		CHECK(!strcmp(names[i], name));
+	}
+	CHECK(total == NB_ENTRIES * (NB_ENTRIES - 1) / 2);
+}
+
+static void id_cb(DBusConnection *cnx, int ret, void *data, unsigned long id)
+{
+	nb_replies++;
+	if (ret < 0)
+		append_id(0);
+	else
+		append_id(id);
+}
+
+/* Run the loop of the client until it got nb replies */
+static void client_wait(int nb)
+{
+	static struct pollfd *fds;
+	static int nfds;
+	static unsigned int generation;
+	int timeout;
+	int i;
+
+	for (i = 0 ; (i < 50) && (nb_replies < nb) ; i++) {
+		if (generation != cdbus_pollfds_generation())
+			cdbus_get_pollfds(&fds, &nfds, 0, &generation);
+		timeout = cdbus_next_timeout_event();
+		if ((timeout < 0) || (timeout > 100))
+			timeout = 100;
+		poll(fds, nfds, timeout);
+		cdbus_handle_pollfds(fds, nfds);
+		cdbus_timeout_handle();
+	}
+}
+
+static void test_calls(DBusConnection *cnx)
+{
+	struct fr_sise_gen_Echo_pair_t pair = { "p", 4 };
+	int32_t nums[] = { 1, 2, 3 };
+	int32_t *reversed = NULL;
+	int reversed_len = 0;
+	char *upper = NULL;
+	long sum = 0;
+
+	/* The out strings of a synchronous call point into the released
+	   reply, only the async callback checks upper */
+	CHECK(fr_sise_gen_Echo_call(cnx, SERVICE, NULL, "abc", nums, 3, &pair,
+				&upper, &reversed, &reversed_len, &sum) == 0);
+	CHECK((reversed_len == 3) && (reversed[0] == 3) && (reversed[2] == 1));
+	CHECK(sum == 10);
+	free(reversed);
+
+	nb_replies = 0;
+	CHECK(fr_sise_gen_Echo_call_async(cnx, SERVICE, NULL, "abc", nums, 3,
+					&pair, echo_cb, NULL) == 0);
+	client_wait(1);
+	CHECK(nb_replies == 1);
+}
+
+/* Arrays of containers, with and without elements */
+static void test_arrays(DBusConnection *cnx)
+{
+	struct fr_sise_gen_Names_entries_t entries[NB_ENTRIES];
+	char keys[NB_ENTRIES][16], names[NB_ENTRIES][16];
+	char **out;
+	int out_len;
+	long total;
+	int i;
+
+	for (i = 0 ; i < NB_ENTRIES ; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+		snprintf(names[i], sizeof(names[i]), "name%d", i);
+		entries[i].member_0 = keys[i];
+		entries[i].member_1 = i;
+		entries[i].member_2 = names[i];
+	}
+
+	/* The out strings of a synchronous call point into the released
+	   reply, only the async callback checks them */
+	out = NULL;
+	CHECK(fr_sise_gen_Names_call(cnx, SERVICE, NULL, entries, NB_ENTRIES,
+				&out, &out_len, &total) == 0);
+	CHECK((out_len == NB_ENTRIES) && out);
+	CHECK(total == NB_ENTRIES * (NB_ENTRIES - 1) / 2);
+	free(out);
+
+	/* An empty array is decoded without allocation */
+	out = (char **)entries;
+	out_len = -1;
+	total = -1;
+	CHECK(fr_sise_gen_Names_call(cnx, SERVICE, NULL, entries, 0, &out,
+				&out_len, &total) == 0);
+	CHECK(!out && !out_len && !total);
+
+	nb_replies = 0;
+	CHECK(fr_sise_gen_Names_call_async(cnx, SERVICE, NULL, entries,
+					NB_ENTRIES, names_cb, entries) == 0);
+	CHECK(fr_sise_gen_Names_call_async(cnx, SERVICE, NULL, entries, 0,
+					names_cb, NULL) == 0);
+	client_wait(2);
+	CHECK(nb_replies == 2);
+}
+
+/* The callbacks of a batch are called in the order of the calls */
+static void test_batch(DBusConnection *cnx)
+{
+	struct fr_sise_gen_Echo_pair_t pair = { "p", 4 };
+	int32_t nums[] = { 1, 2, 3 };
+	struct cdbus_batch_t *batch;
+	int i;
+
+	batch = cdbus_batch_new(cnx);
+	CHECK(batch != NULL);
+	if (!batch)
+		return;
+	nb_replies = 0;
+	ids[0] = 0;
+	for (i = 1 ; i <= NB_SLOW ; i++)
+		CHECK(fr_sise_gen_Slow_call_batch(batch, SERVICE, NULL, i,
+						id_cb, NULL) == 0);
+	CHECK(fr_sise_gen_Echo_call_batch(batch, SERVICE, NULL, "abc", nums, 3,
+					&pair, echo_cb, NULL) == 0);
+	CHECK(cdbus_batch_run(batch, 5000) == 0);
+	CHECK(nb_replies == NB_SLOW + 1);
+	CHECK(!strcmp(ids, "1 2 3 4"));
+	cdbus_batch_free(batch);
+}
+
+static void test_deferred(DBusConnection *cnx)
+{
+	unsigned long id;
+
+	nb_replies = 0;
+	ids[0] = 0;
+	CHECK(fr_sise_gen_Later_call_async(cnx, SERVICE, NULL, 0, id_cb,
+					NULL) == 0);
+	client_wait(1);
+	for (id = 10 ; id < 10 + NB_LATER ; id++)
+		CHECK(fr_sise_gen_Later_call_async(cnx, SERVICE, NULL, id,
+						id_cb, NULL) == 0);
+	client_wait(NB_LATER + 1);
+	CHECK(!strcmp(ids, "0 12 11 10"));
+}
+
+static void test_bulk(DBusConnection *cnx)
+{
+	unsigned long sum = 0, expected = 0;
+	char *pixels;
+	char *thumb = NULL;
+	int thumb_len = 0;
+	int i;
+
+	pixels = malloc(NB_PIXELS);
+	CHECK(pixels != NULL);
+	if (!pixels)
+		return;
+	for (i = 0 ; i < NB_PIXELS ; i++) {
+		pixels[i] = i * 7;
+		expected += (unsigned char)pixels[i];
+	}
+
+	CHECK(fr_sise_gen_Image_call(cnx, SERVICE, NULL, pixels, NB_PIXELS,
+				&sum, &thumb, &thumb_len) == 0);
+	CHECK(sum == expected);
+	CHECK(thumb_len == NB_PIXELS / THUMB_STEP);
+	for (i = 0 ; thumb && (i < thumb_len) ; i++)
+		CHECK(thumb[i] == pixels[i * THUMB_STEP]);
+	if (thumb)
+		cdbus_bulk_unmap(thumb, thumb_len);
+	free(pixels);
+}
+
+static void test_properties(DBusConnection *cnx)
+{
+	unsigned long level = 0;
+
+	CHECK(fr_sise_gen_Level_get(cnx, SERVICE, NULL, &level) == 0);
+	CHECK(level == 1);
+	CHECK(fr_sise_gen_Level_set(cnx, SERVICE, NULL, 7) == 0);
+	CHECK(fr_sise_gen_Level_get(cnx, SERVICE, NULL, &level) == 0);
+	CHECK(level == 7);
+
+	/* Refused by the handler, the cached value is kept */
+	CHECK(fr_sise_gen_Level_set(cnx, SERVICE, NULL, MAX_LEVEL + 1) < 0);
+	CHECK(fr_sise_gen_Level_get(cnx, SERVICE, NULL, &level) == 0);
+	CHECK(level == 7);
+	CHECK(fr_sise_gen_Level_get(cnx, SERVICE, CHILD_PATH, &level) == 0);
+	CHECK(level == 2);
+}
+
+/* Number of objects reported by the manager at path, their paths are
+   written to paths, separated by spaces */
+static int managed_objects(DBusConnection *cnx, const char *path,
+			char *paths, size_t size)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter iter, dict, entry;
+	const char *object;
+	int nb = 0;
+
+	paths[0] = 0;
+	msg = dbus_message_new_method_call(SERVICE, path,
+					"org.freedesktop.DBus.ObjectManager",
+					"GetManagedObjects");
+	if (!msg)
+		return -1;
+	reply = dbus_connection_send_with_reply_and_block(cnx, msg, 1000, NULL);
+	dbus_message_unref(msg);
+	if (!reply)
+		return -1;
+
+	dbus_message_iter_init(reply, &iter);
+	dbus_message_iter_recurse(&iter, &dict);
+	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+		dbus_message_iter_recurse(&dict, &entry);
+		dbus_message_iter_get_basic(&entry, &object);
+		snprintf(paths + strlen(paths), size - strlen(paths), "%s%s",
+			paths[0] ? " " : "", object);
+		nb++;
+		dbus_message_iter_next(&dict);
+	}
+	dbus_message_unref(reply);
+
+	return nb;
+}
+
+/* The object at the path of the nested manager belongs to the one above,
+   the objects below it to the nested one */
+static void test_object_manager(DBusConnection *cnx)
+{
+	char paths[256];
+
+	CHECK(managed_objects(cnx, MANAGER_PATH, paths, sizeof(paths)) == 2);
+	CHECK(!strcmp(paths, PATH " " CHILD_PATH));
+	CHECK(managed_objects(cnx, CHILD_PATH, paths, sizeof(paths)) == 1);
+	CHECK(!strcmp(paths, LEAF_PATH));
+}
+
+/* Call the method of the CDBUS_INTERFACE_STATS interface of the object.
+   For GetStats, the counters of Echo are stored in stats */
+static int stats_call(DBusConnection *cnx, const char *path,
+		const char *method, struct cdbus_member_stats_t *stats)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter iter, array, entry;
+	const char *member;
+	int found = 0;
+
+	msg = dbus_message_new_method_call(SERVICE, path,
+					CDBUS_INTERFACE_STATS, method);
+	if (!msg)
+		return -1;
+	reply = dbus_connection_send_with_reply_and_block(cnx, msg, 1000, NULL);
+	dbus_message_unref(msg);
+	if (!reply)
+		return -1;
+	if (!stats) {
+		dbus_message_unref(reply);
+		return 0;
+	}
+
+	dbus_message_iter_init(reply, &iter);
+	dbus_message_iter_recurse(&iter, &array);
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&array, &entry);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_get_basic(&entry, &member);
+		if (!strcmp(member, "Echo")) {
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_get_basic(&entry, &stats->calls);
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_get_basic(&entry, &stats->errors);
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_get_basic(&entry, &stats->bytes_in);
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_get_basic(&entry, &stats->bytes_out);
+			found = 1;
+		}
+		dbus_message_iter_next(&array);
+	}
+	dbus_message_unref(reply);
+
+	return found ? 0 : -1;
+}
+
+/* The objects of the table share its counters, the service checks the
+   last Echo call with the C API */
+static void test_stats(DBusConnection *cnx)
+{
+	struct fr_sise_gen_Echo_pair_t pair = { "p", 4 };
+	int32_t nums[] = { 1, 2, 3 };
+	struct cdbus_member_stats_t stats;
+	int32_t *reversed;
+	int reversed_len;
+	char *upper;
+	long sum;
+	int i;
+
+	CHECK(stats_call(cnx, PATH, "Reset", NULL) == 0);
+	for (i = 0 ; i < 2 ; i++) {
+		reversed = NULL;
+		CHECK(fr_sise_gen_Echo_call(cnx, SERVICE, NULL, "abc", nums, 3,
+					&pair, &upper, &reversed,
+					&reversed_len, &sum) == 0);
+		free(reversed);
+	}
+
+	/* The calls were made on PATH */
+	memset(&stats, 0, sizeof(stats));
+	CHECK(stats_call(cnx, CHILD_PATH, "GetStats", &stats) == 0);
+	CHECK((stats.calls == 2) && (stats.errors == 0));
+	CHECK((stats.bytes_in > 0) && (stats.bytes_out > 0));
+
+	CHECK(stats_call(cnx, CHILD_PATH, "Reset", NULL) == 0);
+	memset(&stats, 0xff, sizeof(stats));
+	CHECK(stats_call(cnx, PATH, "GetStats", &stats) == 0);
+	CHECK((stats.calls == 0) && (stats.bytes_in == 0)
+		&& (stats.bytes_out == 0));
+
+	reversed = NULL;
+	CHECK(fr_sise_gen_Echo_call(cnx, SERVICE, NULL, "abc", nums, 3, &pair,
+				&upper, &reversed, &reversed_len, &sum) == 0);
+	free(reversed);
+}
+
+/* Client process, it exits with the result of its checks */
+static int client(int sync_fd)
+{
+	DBusConnection *cnx;
+	char c;
+
+	if (read(sync_fd, &c, 1) != 1)
+		return 1;
+
+	cnx = cdbus_get_connection(DBUS_BUS_SESSION);
+	if (!cnx)
+		return 1;
+
+	test_calls(cnx);
+	test_arrays(cnx);
+	test_batch(cnx);
+	test_deferred(cnx);
+	test_bulk(cnx);
+	test_properties(cnx);
+	test_object_manager(cnx);
+	test_stats(cnx);
+
+	return CHECK_RESULT();
+}
+
+int main(int argc, char **argv)
+{
+	static struct cdbus_user_data_t user_data = {
+		fr_sise_gen_object_table, NULL
+	};
+	struct cdbus_member_stats_t stats;
+	struct cdbus_context_t *ctx;
+	struct cdbus_pool_t *pool;
+	pthread_t updater;
+	DBusConnection *cnx;
+	struct pollfd *fds = NULL;
+	struct pollfd efd;
+	unsigned int generation = 0;
+	int nfds = 0;
+	int sync_fds[2];
+	int status = -1;
+	int timeout;
+	int mode;
+	time_t end;
+	pid_t pid;
+
+	if (!getenv("DBUS_SESSION_BUS_ADDRESS"))
+		return CHECK_SKIPPED;
+	if ((argc < 2) || !strcmp(argv[1], "poll"))
+		mode = MODE_POLL;
+	else if (!strcmp(argv[1], "epoll"))
+		mode = MODE_EPOLL;
+	else if (!strcmp(argv[1], "timerfd"))
+		mode = MODE_TIMERFD;
+	else
+		return 1;
+
+	/* The client is forked before libdbus is used by the service */
+	if (pipe(sync_fds) < 0)
+		return 1;
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	if (!pid) {
+		close(sync_fds[1]);
+		_exit(client(sync_fds[0]));
+	}
+	close(sync_fds[0]);
+
+	loop_thread = pthread_self();
+	ctx = cdbus_context_new();
+	CHECK(ctx != NULL);
+	cnx = cdbus_context_get_connection(ctx, DBUS_BUS_SESSION);
+	CHECK(cnx != NULL);
+	if (!cnx)
+		return 1;
+	CHECK(cdbus_request_name(cnx, SERVICE, 0) >= 0);
+	CHECK(cdbus_register_object_manager(cnx, MANAGER_PATH) == 0);
+	CHECK(cdbus_register_object(cnx, PATH, &user_data) == 0);
+	CHECK(cdbus_register_object(cnx, CHILD_PATH, &user_data) == 0);
+	CHECK(cdbus_register_object_manager(cnx, CHILD_PATH) == 0);
+	CHECK(cdbus_register_object(cnx, LEAF_PATH, &user_data) == 0);
+	CHECK(fr_sise_gen_Level_update(cnx, PATH, 1) == 0);
+	CHECK(fr_sise_gen_Level_update(cnx, CHILD_PATH, 2) == 0);
+	cdbus_enable_byte_stats(fr_sise_gen_object_table, 1);
+
+	/* The pools need a thread safe library, Slow runs in the loop
+	   otherwise */
+	pool = cdbus_pool_create(2);
+	if (pool)
+		CHECK(cdbus_object_set_pool(cnx, PATH, SERVICE, "Slow",
+					pool) == 0);
+
+	if (mode == MODE_TIMERFD)
+		CHECK(cdbus_context_enable_timerfd(ctx) >= 0);
+	efd.fd = -1;
+	efd.events = POLLIN;
+	if (mode != MODE_POLL) {
+		efd.fd = cdbus_context_get_epoll_fd(ctx);
+		CHECK(efd.fd >= 0);
+	}
+
+	CHECK(write(sync_fds[1], "", 1) == 1);
+	close(sync_fds[1]);
+
+	end = time(NULL) + 20;
+	while (time(NULL) < end) {
+		timeout = cdbus_context_next_timeout_event(ctx);
+		if ((timeout < 0) || (timeout > 100))
+			timeout = 100;
+		if (mode == MODE_POLL) {
+			if (generation != cdbus_context_pollfds_generation(ctx))
+				cdbus_context_get_pollfds(ctx, &fds, &nfds, 0,
+							&generation);
+			poll(fds, nfds, timeout);
+			cdbus_context_handle_pollfds(ctx, fds, nfds);
+		} else {
+			poll(&efd, 1, timeout);
+			cdbus_context_handle_events(ctx);
+		}
+		/* The timeouts come through the epoll fd in timerfd mode */
+		if (mode == MODE_TIMERFD)
+			CHECK(cdbus_context_next_timeout_event(ctx) == -1);
+		else
+			cdbus_context_timeout_handle(ctx);
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			break;
+	}
+
+	CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+	if (!WIFEXITED(status))
+		kill(pid, SIGKILL);
+	if (pool)
+		CHECK(slow_in_pool == NB_SLOW);
+
+	/* The last Echo call of test_stats, then the counters off */
+	CHECK(cdbus_get_member_stats(fr_sise_gen_object_table, "fr.sise.gen",
+				"Echo", &stats) == 0);
+	CHECK((stats.calls == 1) && (stats.errors == 0) && stats.count_bytes);
+	CHECK((stats.bytes_in > 0) && (stats.bytes_out > 0));
+	CHECK(cdbus_get_member_stats(fr_sise_gen_object_table, "fr.sise.gen",
+				"Unknown", &stats) < 0);
+	cdbus_enable_byte_stats(fr_sise_gen_object_table, 0);
+	cdbus_reset_stats(fr_sise_gen_object_table);
+	CHECK(cdbus_get_member_stats(fr_sise_gen_object_table, NULL, "Echo",
+				&stats) == 0);
+	CHECK((stats.calls == 0) && !stats.count_bytes);
+
+	cdbus_unregister_object(cnx, LEAF_PATH);
+	cdbus_unregister_object_manager(cnx, CHILD_PATH);
+
+	/* The properties may be updated by other threads when libcdbus is
+	   thread safe, even while the object is unregistered */
+	if (pool && !pthread_create(&updater, NULL, update_child, cnx)) {
+		usleep(1000);
+		cdbus_unregister_object(cnx, CHILD_PATH);
+		pthread_join(updater, NULL);
+	} else {
+		cdbus_unregister_object(cnx, CHILD_PATH);
+	}
+	cdbus_unregister_object(cnx, PATH);
+	cdbus_unregister_object_manager(cnx, MANAGER_PATH);
+	if (pool)
+		cdbus_pool_destroy(pool);
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	cdbus_context_free(ctx);
+
+	return CHECK_RESULT();
+}
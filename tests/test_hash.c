@@ -0,0 +1,127 @@
+/*
+ * Unit tests of the chained hash table
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include "hash.h"
+#include "check.h"
+
+#define NB_ITEMS 1000
+
+struct entry_t {
+	struct hash_item_t item;
+	int id;
+};
+
+static struct entry_t entries[NB_ITEMS];
+
+/* Number of items with this hash value, -1 if they are not walked in
+   ascending id order */
+static int count_hash(struct hash_t *table, unsigned int hash)
+{
+	struct hash_item_t *hitem;
+	struct entry_t *entry;
+	int prev = -1;
+	int nb = 0;
+
+	__for_each_hash_item(table, hash, hitem, item, entry) {
+		if ((entry->item.hash != hash) || (entry->id <= prev))
+			return -1;
+		prev = entry->id;
+		nb++;
+	}
+
+	return nb;
+}
+
+static void test_add_remove(void)
+{
+	DECLARE_HASH_INIT(table);
+	int i;
+
+	CHECK(__hash_get_first(&table, 0) == NULL);
+
+	for (i = 0 ; i < NB_ITEMS ; i++) {
+		HASH_ITEM_INIT(entries[i].item);
+		entries[i].id = i;
+		CHECK(hash_add(&table, &entries[i].item, i * 2654435761u) == 0);
+	}
+	/* The table grew from its minimal size */
+	CHECK(hash_get_nb(&table) == NB_ITEMS);
+	CHECK(table.size >= NB_ITEMS);
+
+	/* An item is only in one table at a time */
+	CHECK(hash_add(&table, &entries[0].item, 0) < 0);
+
+	for (i = 0 ; i < NB_ITEMS ; i++)
+		CHECK(count_hash(&table, i * 2654435761u) == 1);
+
+	for (i = 0 ; i < NB_ITEMS ; i += 2) {
+		CHECK(hash_rem_item(&entries[i].item) == 0);
+		CHECK(hash_item_get_table(&entries[i].item) == NULL);
+	}
+	CHECK(hash_get_nb(&table) == NB_ITEMS / 2);
+	for (i = 0 ; i < NB_ITEMS ; i++)
+		CHECK(count_hash(&table, i * 2654435761u) == (i & 1));
+
+	/* A removed item can't be removed again */
+	CHECK(hash_rem_item(&entries[0].item) < 0);
+
+	hash_free(&table);
+	CHECK(hash_get_nb(&table) == 0);
+}
+
+/* The signal index relies on the items sharing a hash value being walked
+   in insertion order, resizes and removals included */
+static void test_same_hash(void)
+{
+	DECLARE_HASH_INIT(table);
+	int i;
+
+	for (i = 0 ; i < NB_ITEMS ; i++) {
+		HASH_ITEM_INIT(entries[i].item);
+		entries[i].id = i;
+		/* Two hash values colliding in every bucket, interleaved */
+		CHECK(hash_add(&table, &entries[i].item, (i & 1) << 30) == 0);
+	}
+	CHECK(count_hash(&table, 0) == NB_ITEMS / 2);
+	CHECK(count_hash(&table, 1 << 30) == NB_ITEMS / 2);
+
+	for (i = 0 ; i < NB_ITEMS ; i += 3)
+		CHECK(hash_rem_item(&entries[i].item) == 0);
+	CHECK(count_hash(&table, 0) + count_hash(&table, 1 << 30)
+		== NB_ITEMS - (NB_ITEMS + 2) / 3);
+
+	/* An item added back goes last */
+	CHECK(hash_add(&table, &entries[0].item, 0) == 0);
+	CHECK(count_hash(&table, 0) == -1);
+
+	hash_free(&table);
+}
+
+int main(int argc, char **argv)
+{
+	test_add_remove();
+	test_same_hash();
+
+	return CHECK_RESULT();
+}
@@ -0,0 +1,161 @@
+/*
+ * Unit tests of the binary min-heap
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include "heap.h"
+#include "check.h"
+
+#define NB_ITEMS 1000
+
+static struct heap_item_t items[NB_ITEMS];
+
+/* Every item must be at its index and not be smaller than its parent */
+static int heap_is_valid(struct heap_t *heap)
+{
+	int i;
+
+	for (i = 0 ; i < heap->nb ; i++) {
+		if ((heap->items[i]->index != i) || (heap->items[i]->heap != heap))
+			return 0;
+		if (i && (heap->items[(i - 1) / 2]->key > heap->items[i]->key))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Pop all the items, their keys must come in ascending order */
+static int heap_drain_sorted(struct heap_t *heap)
+{
+	struct heap_item_t *item;
+	unsigned long long prev = 0;
+	int nb = 0;
+
+	while ((item = heap_get_first(heap))) {
+		if (item->key < prev)
+			return -1;
+		prev = item->key;
+		if (heap_rem_item(item) < 0)
+			return -1;
+		nb++;
+	}
+
+	return nb;
+}
+
+static void test_ordering(void)
+{
+	DECLARE_HEAP_INIT(heap);
+	int i;
+
+	CHECK(heap_get_first(&heap) == NULL);
+
+	srand(1);
+	for (i = 0 ; i < NB_ITEMS ; i++) {
+		HEAP_ITEM_INIT(items[i]);
+		/* Few distinct keys, so that many items share one */
+		items[i].key = rand() % 100;
+		CHECK(heap_add(&heap, &items[i]) == 0);
+	}
+	CHECK(heap_get_nb(&heap) == NB_ITEMS);
+	CHECK(heap_is_valid(&heap));
+
+	CHECK(heap_drain_sorted(&heap) == NB_ITEMS);
+	CHECK(heap_get_nb(&heap) == 0);
+	heap_free(&heap);
+}
+
+static void test_removal(void)
+{
+	DECLARE_HEAP_INIT(heap);
+	int i;
+
+	for (i = 0 ; i < NB_ITEMS ; i++) {
+		HEAP_ITEM_INIT(items[i]);
+		items[i].key = NB_ITEMS - i;
+		CHECK(heap_add(&heap, &items[i]) == 0);
+	}
+
+	/* An item is only in one heap at a time */
+	CHECK(heap_add(&heap, &items[0]) < 0);
+
+	/* Remove every third item from anywhere in the heap */
+	for (i = 0 ; i < NB_ITEMS ; i += 3) {
+		CHECK(heap_rem_item(&items[i]) == 0);
+		CHECK(heap_item_get_heap(&items[i]) == NULL);
+		CHECK(items[i].index == -1);
+	}
+	CHECK(heap_is_valid(&heap));
+	CHECK(heap_get_nb(&heap) == NB_ITEMS - (NB_ITEMS + 2) / 3);
+
+	/* A removed item can't be removed again but can be added back with
+	   another key */
+	CHECK(heap_rem_item(&items[0]) < 0);
+	items[0].key = 0;
+	CHECK(heap_add(&heap, &items[0]) == 0);
+	CHECK(heap_get_first(&heap) == &items[0]);
+
+	/* The last item, then the first one */
+	CHECK(heap_rem_item(heap.items[heap.nb - 1]) == 0);
+	CHECK(heap_rem_item(heap_get_first(&heap)) == 0);
+	CHECK(heap_is_valid(&heap));
+
+	CHECK(heap_drain_sorted(&heap) == NB_ITEMS - (NB_ITEMS + 2) / 3 - 1);
+	heap_free(&heap);
+}
+
+/* Changing the key of an item is done by removing and adding it again, as
+   the timeouts do when they are rearmed */
+static void test_rekey(void)
+{
+	DECLARE_HEAP_INIT(heap);
+	int i, j;
+
+	for (i = 0 ; i < 64 ; i++) {
+		HEAP_ITEM_INIT(items[i]);
+		items[i].key = i * 10;
+		heap_add(&heap, &items[i]);
+	}
+
+	srand(2);
+	for (j = 0 ; j < 10000 ; j++) {
+		i = rand() % 64;
+		heap_lock(&heap);
+		__heap_rem_item(&items[i]);
+		items[i].key = rand() % 1000;
+		__heap_add(&heap, &items[i]);
+		heap_unlock(&heap);
+	}
+	CHECK(heap_is_valid(&heap));
+	CHECK(heap_drain_sorted(&heap) == 64);
+	heap_free(&heap);
+}
+
+int main(int argc, char **argv)
+{
+	test_ordering();
+	test_removal();
+	test_rekey();
+
+	return CHECK_RESULT();
+}
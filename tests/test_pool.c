@@ -0,0 +1,314 @@
+/*
+ * Test of the worker pools: the calls queued in a pool are answered with
+ * an error when their object is unregistered or the pool destroyed
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "libcdbus.h"
+#include "check.h"
+
+#define SERVICE "fr.sise.unit"
+#define PATH "/fr/sise/unit"
+#define NB_SLOW 4
+
+struct service_t {
+	struct cdbus_pool_t *pool;
+	struct cdbus_user_data_t *user_data;
+	int *counter;
+	int quit;
+};
+
+static struct service_t service;
+
+static int reply_ok(DBusConnection *cnx, DBusMessage *msg)
+{
+	DBusMessage *reply;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return -1;
+	dbus_connection_send(cnx, reply, NULL);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+/* Run by the pool, the user data must still be valid */
+static int unit_Slow(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	int *counter = data;
+
+	usleep(200000);
+	(*counter)++;
+	return reply_ok(cnx, msg);
+}
+
+static struct cdbus_arg_entry_t no_args[] = {
+	{ NULL, 0, NULL },
+};
+
+static struct cdbus_message_entry_t unit_members[] = {
+	{ 0, "Slow", unit_Slow, no_args, NULL },
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t unit_table[] = {
+	{ SERVICE, unit_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static int service_register(DBusConnection *cnx)
+{
+	service.counter = calloc(1, sizeof(*service.counter));
+	service.user_data = malloc(sizeof(*service.user_data));
+	if (!service.counter || !service.user_data)
+		return -1;
+	service.user_data->object_table = unit_table;
+	service.user_data->user_data = service.counter;
+	if (cdbus_register_object(cnx, PATH, service.user_data) < 0)
+		return -1;
+	return cdbus_object_set_pool(cnx, PATH, SERVICE, "Slow", service.pool);
+}
+
+/* The user data is freed right after the object is unregistered */
+static void service_unregister(DBusConnection *cnx)
+{
+	cdbus_unregister_object(cnx, PATH);
+	free(service.user_data);
+	free(service.counter);
+}
+
+/* Control methods run by the loop thread, they are queued after the slow
+   calls */
+static int ctrl_Unregister(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	service_unregister(cnx);
+	return reply_ok(cnx, msg);
+}
+
+static int ctrl_Register(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	CHECK(service_register(cnx) == 0);
+	return reply_ok(cnx, msg);
+}
+
+static int ctrl_Destroy(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	cdbus_object_set_pool(cnx, PATH, SERVICE, "Slow", NULL);
+	cdbus_pool_destroy(service.pool);
+	service.pool = NULL;
+	return reply_ok(cnx, msg);
+}
+
+static int ctrl_Quit(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	service.quit = 1;
+	return reply_ok(cnx, msg);
+}
+
+static struct cdbus_message_entry_t ctrl_members[] = {
+	{ 0, "Unregister", ctrl_Unregister, no_args, NULL },
+	{ 0, "Register", ctrl_Register, no_args, NULL },
+	{ 0, "Destroy", ctrl_Destroy, no_args, NULL },
+	{ 0, "Quit", ctrl_Quit, no_args, NULL },
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t ctrl_table[] = {
+	{ SERVICE ".Ctrl", ctrl_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static DBusPendingCall *call(DBusConnection *cnx, const char *interface,
+			const char *member)
+{
+	DBusPendingCall *pending = NULL;
+	DBusMessage *msg;
+
+	msg = dbus_message_new_method_call(SERVICE, PATH "/ctrl", interface,
+					member);
+	if (!msg)
+		return NULL;
+	if (!strcmp(interface, SERVICE))
+		dbus_message_set_path(msg, PATH);
+	dbus_connection_send_with_reply(cnx, msg, &pending, 5000);
+	dbus_message_unref(msg);
+	return pending;
+}
+
+/* Return 0 for a method return, 1 for a Failed error, -1 otherwise */
+static int wait_reply(DBusPendingCall *pending)
+{
+	DBusMessage *reply;
+	int ret = -1;
+
+	if (!pending)
+		return -1;
+	dbus_pending_call_block(pending);
+	reply = dbus_pending_call_steal_reply(pending);
+	dbus_pending_call_unref(pending);
+	if (!reply)
+		return -1;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+		ret = 0;
+	else if (dbus_message_is_error(reply, DBUS_ERROR_FAILED))
+		ret = 1;
+	dbus_message_unref(reply);
+	return ret;
+}
+
+/* Queue the slow calls, then the control call ending them: the first one
+   is run, the other ones must be answered with an error */
+static int slow_calls(DBusConnection *cnx, const char *ctrl)
+{
+	DBusPendingCall *pending[NB_SLOW];
+	DBusPendingCall *ctrl_pending;
+	int failures = 0;
+	int errors = 0;
+	int ret;
+	int i;
+
+	for (i = 0 ; i < NB_SLOW ; i++)
+		pending[i] = call(cnx, SERVICE, "Slow");
+	ctrl_pending = call(cnx, SERVICE ".Ctrl", ctrl);
+
+	for (i = 0 ; i < NB_SLOW ; i++) {
+		ret = wait_reply(pending[i]);
+		if (ret < 0) {
+			fprintf(stderr, "%s: no reply to call %d\n", ctrl, i);
+			failures++;
+		}
+		errors += ret > 0;
+	}
+	if (wait_reply(ctrl_pending))
+		failures++;
+	/* A worker may not have picked the first call yet */
+	if ((errors != NB_SLOW - 1) && (errors != NB_SLOW)) {
+		fprintf(stderr, "%s: %d errors\n", ctrl, errors);
+		failures++;
+	}
+
+	return failures;
+}
+
+/* Client process, it exits with the number of failures */
+static int client(int sync_fd)
+{
+	DBusConnection *cnx;
+	DBusError error;
+	int failures = 0;
+	char c;
+
+	if (read(sync_fd, &c, 1) != 1)
+		return 1;
+
+	dbus_error_init(&error);
+	cnx = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+	if (!cnx)
+		return 1;
+
+	failures += slow_calls(cnx, "Unregister");
+	failures += wait_reply(call(cnx, SERVICE ".Ctrl", "Register")) != 0;
+	failures += slow_calls(cnx, "Destroy");
+	failures += wait_reply(call(cnx, SERVICE ".Ctrl", "Quit")) != 0;
+
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	static struct cdbus_user_data_t ctrl_data = { ctrl_table, NULL };
+	struct cdbus_context_t *ctx;
+	DBusConnection *cnx;
+	struct pollfd *fds = NULL;
+	unsigned int generation = 0;
+	int nfds = 0;
+	int sync_fds[2];
+	int status = -1;
+	int timeout;
+	time_t end;
+	pid_t pid;
+
+	if (!getenv("DBUS_SESSION_BUS_ADDRESS"))
+		return CHECK_SKIPPED;
+
+	/* The pools need a thread safe library */
+	service.pool = cdbus_pool_create(1);
+	if (!service.pool)
+		return CHECK_SKIPPED;
+
+	/* The client is forked before libdbus is used by the service */
+	if (pipe(sync_fds) < 0)
+		return 1;
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	if (!pid) {
+		close(sync_fds[1]);
+		_exit(client(sync_fds[0]));
+	}
+	close(sync_fds[0]);
+
+	ctx = cdbus_context_new();
+	CHECK(ctx != NULL);
+	cnx = cdbus_context_get_connection(ctx, DBUS_BUS_SESSION);
+	CHECK(cnx != NULL);
+	if (!cnx)
+		return 1;
+	CHECK(cdbus_request_name(cnx, SERVICE, 0) >= 0);
+	CHECK(cdbus_register_object(cnx, PATH "/ctrl", &ctrl_data) == 0);
+	CHECK(service_register(cnx) == 0);
+
+	CHECK(write(sync_fds[1], "", 1) == 1);
+	close(sync_fds[1]);
+
+	end = time(NULL) + 20;
+	while (!service.quit && (time(NULL) < end)) {
+		if (generation != cdbus_context_pollfds_generation(ctx))
+			cdbus_context_get_pollfds(ctx, &fds, &nfds, 0,
+						&generation);
+		timeout = cdbus_context_next_timeout_event(ctx);
+		if ((timeout < 0) || (timeout > 100))
+			timeout = 100;
+		poll(fds, nfds, timeout);
+		cdbus_context_handle_pollfds(ctx, fds, nfds);
+		cdbus_context_timeout_handle(ctx);
+	}
+	CHECK(service.quit);
+
+	waitpid(pid, &status, 0);
+	CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+
+	service_unregister(cnx);
+	cdbus_unregister_object(cnx, PATH "/ctrl");
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	cdbus_context_free(ctx);
+
+	return CHECK_RESULT();
+}
@@ -0,0 +1,275 @@
+/*
+ * Test of the signal queue: the signals sent by the library itself must
+ * all go through it, only the emissions asking for it are coalesced
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcdbus.h"
+#include "check.h"
+
+#define SERVICE "fr.sise.unit"
+#define PATH "/fr/sise/unit"
+#define ITF_A SERVICE ".A"
+#define ITF_B SERVICE ".B"
+#define WINDOW 50
+
+static struct cdbus_message_entry_t no_members[] = {
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_property_entry_t level_props[] = {
+	{ "Level", "u", CDBUS_PROPERTY_READ, CDBUS_PROPERTY_EMITS_CHANGED, NULL },
+	{ NULL, NULL, 0, 0, NULL },
+};
+
+static struct cdbus_interface_entry_t unit_table[] = {
+	{ ITF_A, no_members, NULL, NULL, NULL, level_props },
+	{ ITF_B, no_members, NULL, NULL, NULL, level_props },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+/* Run the loop of the service for ms milliseconds */
+static void run(struct cdbus_context_t *ctx, int ms)
+{
+	static struct pollfd *fds;
+	static int nfds;
+	static unsigned int generation;
+	struct timespec ts;
+	long long now, end;
+	int timeout;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	for (end = now + ms ; now < end ; ) {
+		if (generation != cdbus_context_pollfds_generation(ctx))
+			cdbus_context_get_pollfds(ctx, &fds, &nfds, 0,
+						&generation);
+		timeout = cdbus_context_next_timeout_event(ctx);
+		if ((timeout < 0) || (timeout > end - now))
+			timeout = end - now;
+		poll(fds, nfds, timeout);
+		cdbus_context_handle_pollfds(ctx, fds, nfds);
+		cdbus_context_timeout_handle(ctx);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	}
+}
+
+/* Pop the signals received by the watcher, the first argument of each one
+   is appended to args, separated by spaces */
+static int receive(DBusConnection *watcher, const char *member, char *args,
+		size_t size)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter;
+	const char *arg;
+	int nb = 0;
+
+	args[0] = 0;
+	while (1) {
+		msg = dbus_connection_pop_message(watcher);
+		if (!msg) {
+			dbus_connection_read_write(watcher, 100);
+			msg = dbus_connection_pop_message(watcher);
+		}
+		if (!msg)
+			break;
+		if (dbus_message_is_signal(msg, dbus_message_get_interface(msg),
+						member)) {
+			nb++;
+			dbus_message_iter_init(msg, &iter);
+			if (dbus_message_iter_get_arg_type(&iter)
+				== DBUS_TYPE_INVALID)
+				arg = "-";
+			else
+				dbus_message_iter_get_basic(&iter, &arg);
+			if (args[0])
+				strncat(args, " ", size - strlen(args) - 1);
+			strncat(args, arg, size - strlen(args) - 1);
+		}
+		dbus_message_unref(msg);
+	}
+
+	return nb;
+}
+
+static int update(DBusConnection *cnx, const char *interface,
+		dbus_uint32_t level)
+{
+	DBusMessage *value;
+	DBusMessageIter iter, value_iter;
+	int ret;
+
+	value = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!value)
+		return -1;
+	dbus_message_iter_init_append(value, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, "u",
+					&value_iter);
+	dbus_message_iter_append_basic(&value_iter, DBUS_TYPE_UINT32, &level);
+	dbus_message_iter_close_container(&iter, &value_iter);
+
+	ret = cdbus_property_update(cnx, PATH, interface, "Level", value);
+	dbus_message_unref(value);
+	return ret;
+}
+
+/* The PropertiesChanged signals of the interfaces of an object only differ
+   by their first argument */
+static void test_properties_changed(struct cdbus_context_t *ctx,
+				DBusConnection *cnx, DBusConnection *watcher)
+{
+	static struct cdbus_user_data_t user_data = { unit_table, NULL };
+	char args[256];
+
+	CHECK(cdbus_register_object(cnx, PATH, &user_data) == 0);
+
+	CHECK(update(cnx, ITF_A, 1) == 0);
+	CHECK(update(cnx, ITF_B, 2) == 0);
+	run(ctx, 4 * WINDOW);
+	CHECK(receive(watcher, "PropertiesChanged", args, sizeof(args)) == 2);
+	CHECK(!strcmp(args, ITF_A " " ITF_B));
+
+	/* A change made while the previous signal is still queued */
+	CHECK(update(cnx, ITF_A, 3) == 0);
+	run(ctx, 0);
+	CHECK(update(cnx, ITF_A, 4) == 0);
+	CHECK(update(cnx, ITF_B, 5) == 0);
+	run(ctx, 4 * WINDOW);
+	CHECK(receive(watcher, "PropertiesChanged", args, sizeof(args)) >= 2);
+	CHECK(strstr(args, ITF_B) != NULL);
+
+	CHECK(cdbus_unregister_object(cnx, PATH) == 0);
+}
+
+static void emit(DBusConnection *cnx, const char *member, const char *arg,
+		int coalesce)
+{
+	DBusMessage *msg;
+
+	msg = dbus_message_new_signal(PATH, SERVICE, member);
+	if (!msg)
+		return;
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &arg,
+				DBUS_TYPE_INVALID);
+	if (coalesce)
+		CHECK(cdbus_send_signal_coalesced(cnx, msg) == 0);
+	else
+		CHECK(cdbus_send_signal(cnx, msg) == 0);
+	dbus_message_unref(msg);
+}
+
+/* Only the emissions asking for it are coalesced, whatever their
+   arguments */
+static void test_coalescing(struct cdbus_context_t *ctx, DBusConnection *cnx,
+			DBusConnection *watcher)
+{
+	char args[256];
+
+	emit(cnx, "State", "s1", 1);
+	emit(cnx, "State", "s2", 1);
+	emit(cnx, "State", "s3", 1);
+	run(ctx, 4 * WINDOW);
+	CHECK(receive(watcher, "State", args, sizeof(args)) == 1);
+	CHECK(!strcmp(args, "s3"));
+
+	emit(cnx, "Event", "e1", 0);
+	emit(cnx, "Event", "e2", 0);
+	emit(cnx, "Event", "e3", 0);
+	run(ctx, 4 * WINDOW);
+	CHECK(receive(watcher, "Event", args, sizeof(args)) == 3);
+	CHECK(!strcmp(args, "e1 e2 e3"));
+}
+
+/* The InterfacesAdded and InterfacesRemoved signals of the objects of a
+   manager only differ by their first argument */
+static void test_object_manager(struct cdbus_context_t *ctx,
+				DBusConnection *cnx, DBusConnection *watcher)
+{
+	static struct cdbus_user_data_t user_data = { unit_table, NULL };
+	char args[256];
+
+	CHECK(cdbus_register_object_manager(cnx, PATH) == 0);
+	run(ctx, 4 * WINDOW);
+	receive(watcher, "InterfacesAdded", args, sizeof(args));
+
+	CHECK(cdbus_register_object(cnx, PATH "/d0", &user_data) == 0);
+	CHECK(cdbus_register_object(cnx, PATH "/d1", &user_data) == 0);
+	CHECK(cdbus_register_object(cnx, PATH "/d2", &user_data) == 0);
+	/* The objects are announced in any order */
+	run(ctx, 4 * WINDOW);
+	CHECK(receive(watcher, "InterfacesAdded", args, sizeof(args)) == 3);
+	CHECK(strstr(args, PATH "/d0") && strstr(args, PATH "/d1")
+		&& strstr(args, PATH "/d2"));
+
+	CHECK(cdbus_unregister_object(cnx, PATH "/d0") == 0);
+	CHECK(cdbus_unregister_object(cnx, PATH "/d1") == 0);
+	CHECK(cdbus_unregister_object(cnx, PATH "/d2") == 0);
+	run(ctx, 4 * WINDOW);
+	CHECK(receive(watcher, "InterfacesRemoved", args, sizeof(args)) == 3);
+	CHECK(strstr(args, PATH "/d0") && strstr(args, PATH "/d1")
+		&& strstr(args, PATH "/d2"));
+
+	CHECK(cdbus_unregister_object_manager(cnx, PATH) == 0);
+}
+
+int main(int argc, char **argv)
+{
+	struct cdbus_context_t *ctx;
+	DBusConnection *cnx, *watcher;
+	DBusError error;
+
+	if (!getenv("DBUS_SESSION_BUS_ADDRESS"))
+		return CHECK_SKIPPED;
+
+	ctx = cdbus_context_new();
+	CHECK(ctx != NULL);
+	cnx = cdbus_context_get_connection(ctx, DBUS_BUS_SESSION);
+	CHECK(cnx != NULL);
+	if (!cnx)
+		return 1;
+	CHECK(cdbus_signal_queue_enable(cnx, WINDOW) == 0);
+
+	/* The watcher is not run by libcdbus, it only reads the signals */
+	dbus_error_init(&error);
+	watcher = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+	CHECK(watcher != NULL);
+	if (!watcher)
+		return 1;
+	dbus_bus_add_match(watcher, "type='signal',path_namespace='/fr/sise'",
+			NULL);
+	dbus_connection_flush(watcher);
+
+	test_coalescing(ctx, cnx, watcher);
+	test_properties_changed(ctx, cnx, watcher);
+	test_object_manager(ctx, cnx, watcher);
+
+	dbus_connection_close(watcher);
+	dbus_connection_unref(watcher);
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	cdbus_context_free(ctx);
+
+	return CHECK_RESULT();
+}
@@ -0,0 +1,197 @@
+/*
+ * Test of the signal subscription index: the connection subscribes to its
+ * own signals, each one must reach the earliest matching subscription
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcdbus.h"
+#include "check.h"
+
+#define ITF1 "fr.sise.unit.One"
+#define ITF2 "fr.sise.unit.Two"
+#define ITF_END "fr.sise.unit.End"
+
+/* Name of the subscription which handled the last signal, NULL if none */
+static const char *handled;
+static int done;
+
+static int unit_Sig(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	handled = data;
+	return 0;
+}
+
+static int unit_End(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	done = 1;
+	return 0;
+}
+
+static struct cdbus_arg_entry_t no_args[] = {
+	{ NULL, 0, NULL },
+};
+
+static struct cdbus_message_entry_t sig_members[] = {
+	{ 0, "Sig", unit_Sig, no_args, NULL },
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_message_entry_t end_members[] = {
+	{ 0, "End", unit_End, no_args, NULL },
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t one_table[] = {
+	{ ITF1, sig_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t both_table[] = {
+	{ ITF1, sig_members, NULL, NULL, NULL, NULL },
+	{ ITF2, sig_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t end_table[] = {
+	{ ITF_END, end_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static int emit(DBusConnection *cnx, const char *path, const char *interface,
+		const char *member)
+{
+	DBusMessage *msg;
+
+	msg = dbus_message_new_signal(path, interface, member);
+	if (!msg)
+		return -1;
+	dbus_connection_send(cnx, msg, NULL);
+	dbus_message_unref(msg);
+	return 0;
+}
+
+/* Emit a signal followed by an End signal, and return the name of the
+   subscription which handled the first one once the End one came back */
+static const char *deliver(struct cdbus_context_t *ctx, DBusConnection *cnx,
+			const char *path, const char *interface)
+{
+	static struct pollfd *fds;
+	static int nfds;
+	static unsigned int generation;
+	time_t end;
+	int timeout;
+
+	handled = NULL;
+	done = 0;
+	emit(cnx, path, interface, "Sig");
+	emit(cnx, "/", ITF_END, "End");
+
+	end = time(NULL) + 5;
+	while (!done && (time(NULL) < end)) {
+		if (generation != cdbus_context_pollfds_generation(ctx))
+			cdbus_context_get_pollfds(ctx, &fds, &nfds, 0,
+						&generation);
+		timeout = cdbus_context_next_timeout_event(ctx);
+		if ((timeout < 0) || (timeout > 100))
+			timeout = 100;
+		poll(fds, nfds, timeout);
+		cdbus_context_handle_pollfds(ctx, fds, nfds);
+		cdbus_context_timeout_handle(ctx);
+	}
+	CHECK(done);
+
+	return handled;
+}
+
+static int is(const char *handled, const char *name)
+{
+	if (!handled || !name)
+		return handled == name;
+	return !strcmp(handled, name);
+}
+
+int main(int argc, char **argv)
+{
+	struct cdbus_user_data_t end = { end_table, NULL };
+	struct cdbus_user_data_t exact = { one_table, "exact" };
+	struct cdbus_user_data_t any = { one_table, "any" };
+	struct cdbus_user_data_t path_b = { both_table, "path_b" };
+	struct cdbus_context_t *ctx;
+	DBusConnection *cnx;
+	const char *me;
+
+	if (!getenv("DBUS_SESSION_BUS_ADDRESS"))
+		return CHECK_SKIPPED;
+
+	ctx = cdbus_context_new();
+	CHECK(ctx != NULL);
+	cnx = cdbus_context_get_connection(ctx, DBUS_BUS_SESSION);
+	CHECK(cnx != NULL);
+	if (!cnx)
+		return 1;
+	me = dbus_bus_get_unique_name(cnx);
+
+	/* The match rule of a subscription to several interfaces is refused
+	   by the bus, and the signals must still come back once a wildcard
+	   subscription is gone: they are routed back by these ones */
+	dbus_bus_add_match(cnx, "type='signal',interface='" ITF1 "'", NULL);
+	dbus_bus_add_match(cnx, "type='signal',interface='" ITF2 "'", NULL);
+
+	CHECK(cdbus_register_signals(cnx, NULL, "/", &end) == 0);
+	CHECK(cdbus_register_signals(cnx, me, "/a", &exact) == 0);
+	CHECK(cdbus_register_signals(cnx, NULL, NULL, &any) == 0);
+	CHECK(cdbus_register_signals(cnx, NULL, "/b", &path_b) == 0);
+
+	/* Exact path and sender, registered first */
+	CHECK(is(deliver(ctx, cnx, "/a", ITF1), "exact"));
+	/* The wildcard subscription is earlier than the one of /b */
+	CHECK(is(deliver(ctx, cnx, "/b", ITF1), "any"));
+	CHECK(is(deliver(ctx, cnx, "/c", ITF1), "any"));
+	/* Only /b is subscribed to the second interface */
+	CHECK(is(deliver(ctx, cnx, "/b", ITF2), "path_b"));
+	CHECK(is(deliver(ctx, cnx, "/a", ITF2), NULL));
+
+	CHECK(cdbus_unregister_signals(cnx, NULL, NULL) == 0);
+	CHECK(is(deliver(ctx, cnx, "/b", ITF1), "path_b"));
+	CHECK(is(deliver(ctx, cnx, "/c", ITF1), NULL));
+	CHECK(is(deliver(ctx, cnx, "/a", ITF1), "exact"));
+
+	/* The wildcard subscription registered again is now the latest */
+	CHECK(cdbus_register_signals(cnx, NULL, NULL, &any) == 0);
+	CHECK(is(deliver(ctx, cnx, "/a", ITF1), "exact"));
+	CHECK(is(deliver(ctx, cnx, "/c", ITF1), "any"));
+
+	CHECK(cdbus_unregister_signals(cnx, me, "/a") == 0);
+	CHECK(cdbus_unregister_signals(cnx, me, "/a") < 0);
+	CHECK(is(deliver(ctx, cnx, "/a", ITF1), "any"));
+
+	cdbus_unregister_signals(cnx, NULL, "/b");
+	cdbus_unregister_signals(cnx, NULL, NULL);
+	cdbus_unregister_signals(cnx, NULL, "/");
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	cdbus_context_free(ctx);
+
+	return CHECK_RESULT();
+}
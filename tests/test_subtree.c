@@ -0,0 +1,204 @@
+/*
+ * Test of the introspection of the subtrees: the children nodes of a path
+ * come from the nodes of the subtree, including the intermediate ones
+ * without object
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcdbus.h"
+#include "check.h"
+
+#define TREE "/fr/sise/tree"
+
+static struct cdbus_message_entry_t no_members[] = {
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t unit_table[] = {
+	{ "fr.sise.unit", no_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_user_data_t user_data = { unit_table, NULL };
+
+/* Run the loop of the service for ms milliseconds */
+static void run(struct cdbus_context_t *ctx, int ms)
+{
+	static struct pollfd *fds;
+	static int nfds;
+	static unsigned int generation;
+	struct timespec ts;
+	long long now, end;
+	int timeout;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	for (end = now + ms ; now < end ; ) {
+		if (generation != cdbus_context_pollfds_generation(ctx))
+			cdbus_context_get_pollfds(ctx, &fds, &nfds, 0,
+						&generation);
+		timeout = cdbus_context_next_timeout_event(ctx);
+		if ((timeout < 0) || (timeout > end - now))
+			timeout = end - now;
+		poll(fds, nfds, timeout);
+		cdbus_context_handle_pollfds(ctx, fds, nfds);
+		cdbus_context_timeout_handle(ctx);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	}
+}
+
+/* Introspect path from the peer, the names of the children nodes are
+   written to names, separated by spaces */
+static int children(struct cdbus_context_t *ctx, DBusConnection *cnx,
+		DBusConnection *peer, const char *path, char *names,
+		size_t size)
+{
+	DBusPendingCall *pending;
+	DBusMessage *msg;
+	const char *xml, *node, *end;
+	size_t len;
+
+	names[0] = 0;
+	msg = dbus_message_new_method_call(dbus_bus_get_unique_name(cnx), path,
+					DBUS_INTERFACE_INTROSPECTABLE,
+					"Introspect");
+	if (!msg)
+		return -1;
+	if (dbus_connection_send_with_reply(peer, msg, &pending, 1000)
+		== FALSE) {
+		dbus_message_unref(msg);
+		return -1;
+	}
+	dbus_message_unref(msg);
+	dbus_connection_flush(peer);
+
+	run(ctx, 100);
+	dbus_pending_call_block(pending);
+	msg = dbus_pending_call_steal_reply(pending);
+	dbus_pending_call_unref(pending);
+	if (!msg)
+		return -1;
+	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &xml,
+					DBUS_TYPE_INVALID) == FALSE) {
+		dbus_message_unref(msg);
+		return -1;
+	}
+
+	for (node = strstr(xml, "<node name=\"") ; node ;
+	     node = strstr(end, "<node name=\"")) {
+		node += strlen("<node name=\"");
+		end = strchr(node, '"');
+		if (!end)
+			break;
+		if (names[0])
+			strncat(names, " ", size - strlen(names) - 1);
+		len = end - node;
+		if (len > size - strlen(names) - 1)
+			len = size - strlen(names) - 1;
+		strncat(names, node, len);
+	}
+	dbus_message_unref(msg);
+
+	return 0;
+}
+
+#define CHECK_CHILDREN(path, expected) do {				\
+		CHECK(children(ctx, cnx, peer, (path), names,		\
+				sizeof(names)) == 0);			\
+		CHECK(!strcmp(names, (expected)));			\
+	} while (0)
+
+int main(int argc, char **argv)
+{
+	struct cdbus_context_t *ctx;
+	DBusConnection *cnx, *peer;
+	DBusError error;
+	char names[256];
+
+	if (!getenv("DBUS_SESSION_BUS_ADDRESS"))
+		return CHECK_SKIPPED;
+
+	ctx = cdbus_context_new();
+	CHECK(ctx != NULL);
+	cnx = cdbus_context_get_connection(ctx, DBUS_BUS_SESSION);
+	CHECK(cnx != NULL);
+	if (!cnx)
+		return 1;
+
+	/* The peer is not run by libcdbus, it only introspects */
+	dbus_error_init(&error);
+	peer = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+	CHECK(peer != NULL);
+	if (!peer)
+		return 1;
+
+	CHECK(cdbus_register_subtree(cnx, TREE) == 0);
+	CHECK(cdbus_register_object(cnx, TREE "/a/x", &user_data) == 0);
+	CHECK(cdbus_register_object(cnx, TREE "/a/y", &user_data) == 0);
+	CHECK(cdbus_register_object(cnx, TREE "/b", &user_data) == 0);
+	CHECK(cdbus_register_object(cnx, TREE "/c/d/e", &user_data) == 0);
+
+	/* The intermediate nodes have no object */
+	CHECK_CHILDREN("/fr/sise", "tree");
+	CHECK_CHILDREN(TREE, "a b c");
+	CHECK_CHILDREN(TREE "/a", "x y");
+	CHECK_CHILDREN(TREE "/c", "d");
+	CHECK_CHILDREN(TREE "/c/d", "e");
+	CHECK_CHILDREN(TREE "/a/x", "");
+
+	/* A node goes away with the last object below it */
+	CHECK(cdbus_unregister_object(cnx, TREE "/a/x") == 0);
+	CHECK_CHILDREN(TREE "/a", "y");
+	CHECK(cdbus_unregister_object(cnx, TREE "/a/y") == 0);
+	CHECK_CHILDREN(TREE, "b c");
+	CHECK_CHILDREN(TREE "/a", "");
+	CHECK(cdbus_unregister_object(cnx, TREE "/c/d/e") == 0);
+	CHECK_CHILDREN(TREE, "b");
+
+	/* An object at an intermediate node, then below it */
+	CHECK(cdbus_register_object(cnx, TREE "/a", &user_data) == 0);
+	CHECK(cdbus_register_object(cnx, TREE "/a/z", &user_data) == 0);
+	CHECK_CHILDREN(TREE, "a b");
+	CHECK_CHILDREN(TREE "/a", "z");
+	CHECK(cdbus_unregister_object(cnx, TREE "/a") == 0);
+	CHECK_CHILDREN(TREE, "a b");
+	CHECK_CHILDREN(TREE "/a", "z");
+
+	/* The objects left go away with the subtree */
+	CHECK(cdbus_unregister_subtree(cnx, TREE) == 0);
+	CHECK(cdbus_register_subtree(cnx, TREE) == 0);
+	CHECK_CHILDREN(TREE, "");
+	CHECK(cdbus_register_object(cnx, TREE "/b", &user_data) == 0);
+	CHECK_CHILDREN(TREE, "b");
+	CHECK(cdbus_unregister_subtree(cnx, TREE) == 0);
+
+	dbus_connection_close(peer);
+	dbus_connection_unref(peer);
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	cdbus_context_free(ctx);
+
+	return CHECK_RESULT();
+}
@@ -0,0 +1,209 @@
+/*
+ * Test of the timerfd mode: the loop only polls the pollfd set, the
+ * dispatches and the timeouts must be driven by the timerfd alone
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "libcdbus.h"
+#include "check.h"
+
+#define SERVICE "fr.sise.unit"
+#define PATH "/fr/sise/unit"
+#define NB_CALLS 5
+
+static int unit_Ping(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return -1;
+	dbus_connection_send(cnx, reply, NULL);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+/* The signal goes through the queue of the connection, it is sent when
+   the flush timeout expires */
+static int unit_Emit(DBusConnection *cnx, DBusMessage *msg, void *data)
+{
+	DBusMessage *signal;
+
+	signal = dbus_message_new_signal(PATH, SERVICE, "Changed");
+	if (!signal)
+		return -1;
+	cdbus_send_signal(cnx, signal);
+	dbus_message_unref(signal);
+	return unit_Ping(cnx, msg, data);
+}
+
+static struct cdbus_arg_entry_t no_args[] = {
+	{ NULL, 0, NULL },
+};
+
+static struct cdbus_message_entry_t unit_members[] = {
+	{ 0, "Ping", unit_Ping, no_args, NULL },
+	{ 0, "Emit", unit_Emit, no_args, NULL },
+	{ 0, NULL, NULL, NULL, NULL },
+};
+
+static struct cdbus_interface_entry_t unit_table[] = {
+	{ SERVICE, unit_members, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+static int call(DBusConnection *cnx, const char *member)
+{
+	DBusMessage *msg, *reply;
+	DBusError error;
+
+	msg = dbus_message_new_method_call(SERVICE, PATH, SERVICE, member);
+	if (!msg)
+		return -1;
+	dbus_error_init(&error);
+	reply = dbus_connection_send_with_reply_and_block(cnx, msg, 1000, &error);
+	dbus_message_unref(msg);
+	if (!reply) {
+		fprintf(stderr, "%s: %s\n", member, error.message);
+		dbus_error_free(&error);
+		return -1;
+	}
+	dbus_message_unref(reply);
+	return 0;
+}
+
+/* Client process, it exits with the number of failures */
+static int client(int sync_fd)
+{
+	DBusConnection *cnx;
+	DBusMessage *msg;
+	DBusError error;
+	char c;
+	int signals = 0;
+	int failures = 0;
+	int i;
+
+	if (read(sync_fd, &c, 1) != 1)
+		return 1;
+
+	dbus_error_init(&error);
+	cnx = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+	if (!cnx)
+		return 1;
+	dbus_bus_add_match(cnx, "type='signal',interface='" SERVICE "'", NULL);
+
+	/* Each call needs a dispatch scheduled through the timerfd */
+	for (i = 0 ; i < NB_CALLS ; i++)
+		if (call(cnx, "Ping") < 0)
+			failures++;
+
+	if (call(cnx, "Emit") < 0)
+		failures++;
+	for (i = 0 ; (i < 20) && !signals ; i++) {
+		dbus_connection_read_write(cnx, 100);
+		while ((msg = dbus_connection_pop_message(cnx))) {
+			if (dbus_message_is_signal(msg, SERVICE, "Changed"))
+				signals++;
+			dbus_message_unref(msg);
+		}
+	}
+	if (signals != 1) {
+		fprintf(stderr, "queued signal not received\n");
+		failures++;
+	}
+
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	static struct cdbus_user_data_t user_data = { unit_table, NULL };
+	struct cdbus_context_t *ctx;
+	DBusConnection *cnx;
+	struct pollfd *fds = NULL;
+	unsigned int generation = 0;
+	int nfds = 0;
+	int sync_fds[2];
+	int status = -1;
+	time_t end;
+	pid_t pid;
+
+	if (!getenv("DBUS_SESSION_BUS_ADDRESS"))
+		return CHECK_SKIPPED;
+
+	/* The client is forked before libdbus is used */
+	if (pipe(sync_fds) < 0)
+		return 1;
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	if (!pid) {
+		close(sync_fds[1]);
+		_exit(client(sync_fds[0]));
+	}
+	close(sync_fds[0]);
+
+	ctx = cdbus_context_new();
+	CHECK(ctx != NULL);
+	cnx = cdbus_context_get_connection(ctx, DBUS_BUS_SESSION);
+	CHECK(cnx != NULL);
+	if (!cnx)
+		return 1;
+	CHECK(cdbus_request_name(cnx, SERVICE, 0) >= 0);
+	CHECK(cdbus_register_object(cnx, PATH, &user_data) == 0);
+	CHECK(cdbus_signal_queue_enable(cnx, 50) == 0);
+	CHECK(cdbus_context_enable_timerfd(ctx) >= 0);
+
+	CHECK(write(sync_fds[1], "", 1) == 1);
+	close(sync_fds[1]);
+
+	/* cdbus_context_timeout_handle is never called by the loop */
+	end = time(NULL) + 10;
+	while (time(NULL) < end) {
+		if (generation != cdbus_context_pollfds_generation(ctx))
+			cdbus_context_get_pollfds(ctx, &fds, &nfds, 0,
+						&generation);
+		CHECK(cdbus_context_next_timeout_event(ctx) == -1);
+		poll(fds, nfds, 100);
+		cdbus_context_handle_pollfds(ctx, fds, nfds);
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			break;
+	}
+
+	CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+	if (!WIFEXITED(status))
+		kill(pid, SIGKILL);
+
+	cdbus_unregister_object(cnx, PATH);
+	dbus_connection_close(cnx);
+	dbus_connection_unref(cnx);
+	cdbus_context_free(ctx);
+
+	return CHECK_RESULT();
+}
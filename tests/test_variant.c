@@ -0,0 +1,139 @@
+/*
+ * Unit tests of the variants: the file descriptors they hold are closed
+ * with them
+ *
+ * Copyright 2011-2014 S.I.S.E. S.A.
+ * Author: Michel Lafon-Puyo <michel.lafonpuyo@gmail.com>
+ *
+ * This file is part of libcdbus
+ *
+ * libcdbus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "libcdbus.h"
+#include "check.h"
+
+static int fd_is_open(int fd)
+{
+	return fcntl(fd, F_GETFD) >= 0;
+}
+
+/* A message holding an av of nb variants, each one a descriptor of fd */
+static DBusMessage *fd_message(int fd, int nb)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter, array, variant;
+	int i;
+
+	msg = dbus_message_new_signal("/fr/sise/unit", "fr.sise.unit", "Fds");
+	if (!msg)
+		return NULL;
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, "av", &variant);
+	dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "v", &array);
+	for (i = 0 ; i < nb ; i++) {
+		struct cdbus_variant_t value = {
+			.type = DBUS_TYPE_UNIX_FD,
+			.value.fd = fd,
+		};
+		CHECK(cdbus_variant_pack(&array, &value) == 0);
+	}
+	dbus_message_iter_close_container(&variant, &array);
+	dbus_message_iter_close_container(&iter, &variant);
+
+	return msg;
+}
+
+static void test_free(int fd)
+{
+	struct cdbus_variant_t variant;
+	DBusMessage *msg;
+	DBusMessageIter iter;
+	int fds[2];
+
+	msg = fd_message(fd, 2);
+	CHECK(msg != NULL);
+	if (!msg)
+		return;
+
+	dbus_message_iter_init(msg, &iter);
+	CHECK(cdbus_variant_unpack(&iter, NULL, &variant) == 0);
+	CHECK(variant.type == DBUS_TYPE_ARRAY);
+	CHECK(variant.value.array.nb == 2);
+	if (variant.value.array.nb == 2) {
+		fds[0] = variant.value.array.items[0].value.fd;
+		fds[1] = variant.value.array.items[1].value.fd;
+		CHECK((fds[0] != fd) && fd_is_open(fds[0]));
+		CHECK((fds[1] != fd) && fd_is_open(fds[1]));
+		cdbus_variant_free(&variant);
+		CHECK(!fd_is_open(fds[0]) && !fd_is_open(fds[1]));
+	}
+	dbus_message_unref(msg);
+}
+
+static void test_arena(int fd)
+{
+	struct cdbus_arena_t arena;
+	struct cdbus_variant_t variant;
+	DBusMessage *msg;
+	DBusMessageIter iter;
+	int *fds;
+	int nb;
+	int i;
+
+	/* Enough descriptors for the arena to grow */
+	nb = 2 * CDBUS_ARENA_BUFF_SIZE / sizeof(struct cdbus_variant_t);
+	fds = malloc(sizeof(*fds) * nb);
+	msg = fd_message(fd, nb);
+	CHECK(fds && msg);
+	if (!fds || !msg)
+		return;
+
+	cdbus_arena_init(&arena);
+	dbus_message_iter_init(msg, &iter);
+	CHECK(cdbus_variant_unpack(&iter, &arena, &variant) == 0);
+	CHECK(variant.value.array.nb == nb);
+	for (i = 0 ; i < variant.value.array.nb ; i++) {
+		fds[i] = variant.value.array.items[i].value.fd;
+		CHECK(fd_is_open(fds[i]));
+	}
+	cdbus_arena_reset(&arena);
+	for (i = 0 ; i < nb ; i++)
+		CHECK(!fd_is_open(fds[i]));
+
+	dbus_message_unref(msg);
+	free(fds);
+}
+
+int main(int argc, char **argv)
+{
+	int fd;
+
+	fd = open("/dev/null", O_RDONLY);
+	if (fd < 0)
+		return CHECK_SKIPPED;
+
+	test_free(fd);
+	test_arena(fd);
+
+	/* The descriptor of the caller is left alone */
+	CHECK(fd_is_open(fd));
+	close(fd);
+
+	return CHECK_RESULT();
+}
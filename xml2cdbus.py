@@ -33,6 +33,8 @@ class DBusSignature:
     def __init__(self, signature):
         self.signature = signature
         self.subs = []
+        # A bulk ay goes through a sealed memfd, see cdbus_bulk_pack
+        self.bulk = False
         self.ParseSignature()
 
     def ParseSignature(self):
@@ -94,8 +96,15 @@ class DBusSignature:
     def IsPrimitive(self):
         return not (self.IsArray() or self.IsContainer())
 
+    def IsFixed(self):
+        return self.signature in ["y", "b", "n", "q", "i", "u", "x", "t", "d"]
+
+    def IsFixedArray(self):
+        return self.IsArray() and self.subs[0].IsFixed()
+
     def DBusType(self):
-        if self.signature == "y": return "DBUS_TYPE_BYTE"
+        if self.bulk: return "DBUS_TYPE_UNIX_FD"
+        elif self.signature == "y": return "DBUS_TYPE_BYTE"
         elif self.signature == "b": return "DBUS_TYPE_BOOLEAN"
         elif self.signature == "n": return "DBUS_TYPE_INT16"
         elif self.signature == "q": return "DBUS_TYPE_UINT16"
@@ -113,6 +122,8 @@ class DBusSignature:
         if self.IsStruct(): return "DBUS_TYPE_STRUCT"
 
     def DBusSignature(self):
+        if self.bulk:
+            return "h"
         return self.signature + self.SubSignature()
 
     def SubSignature(self):
@@ -141,11 +152,15 @@ class DBusSignature:
         elif self.signature == "o": return "char *"
         elif self.signature == "g": return "char *"
         elif self.signature == "h": return "int"
-        elif self.signature == "v": return "void *"
+        elif self.signature == "v": return "struct cdbus_variant_t"
         if self.IsArray():     return self.CArrayType(varname)
         if self.IsStruct():     return self.CContainerType(varname)
 
     def CArrayType(self, varname):
+        # Fixed arrays elements must have the wire size, the array is
+        # read in place from the message
+        if self.subs[0].signature == "i": return "int32_t *"
+        elif self.subs[0].signature == "u": return "uint32_t *"
         return self.subs[0].CType(varname) + " *"
 
     def CContainerType(self, varname):
@@ -158,7 +173,7 @@ class DBusSignature:
             add = ""
         if self.IsArray():     return self.CArrayVarProto(direction, varname)
         elif self.IsContainer(): return self.CContainerVarProto(direction, varname)
-        elif self.signature == "v" : return self.CVariantVarProto(direction, varname)
+        elif self.signature == "v" : return self.CContainerVarProto(direction, varname)
         else:
             return self.CType(varname) + add + " " + varname
 
@@ -172,15 +187,8 @@ class DBusSignature:
     def CContainerVarProto(self, direction, varname):
         return self.CType(varname) + " *" + " " + varname 
 
-    def CVariantVarProto(self, direction, varname):
-        if direction != "in":
-            add = "*"
-        else:
-            add = ""
-        return self.CType(varname) + add + " " + varname + ", int " + add +  varname + "_dbus_type"
-
     def CVar(self, direction, varname):
-        if self.IsContainer():
+        if self.IsContainer() or self.signature == "v":
             return "&" + varname
         if direction == "in":
             string = varname
@@ -191,11 +199,6 @@ class DBusSignature:
                 string += ", " + varname + "_len"
             else:
                 string += ", &" + varname + "_len"
-        if self.signature == "v":
-            if direction == "in":
-                string += ", " + varname + "_dbus_type"
-            else:
-                string += ", &" + varname + "_dbus_type"
         return string
 
     def CDeclareVar(self, direction, varname):
@@ -205,12 +208,20 @@ class DBusSignature:
         elif self.IsStruct():
             return self.CType(varname) + " " + varname + " = { 0 }"
         elif self.signature == "v":
-            return self.CType(varname) + " " + varname + " = NULL; int" + " " + varname + "_dbus_type = DBUS_TYPE_INVALID"
+            return self.CType(varname) + " " + varname + " = { DBUS_TYPE_INVALID }"
         else:
             return self.CType(varname) + " " + varname + " = 0"
 
-    def CFree(self, varname, member="", in_array=False):
+    def CFree(self, varname, member="", in_array=False, borrowed=False):
         strings = []
+        if self.bulk:
+            if borrowed:
+                strings.append("if (" + varname + ") cdbus_bulk_unmap(" + varname + ", " + varname + "_len);")
+            else:
+                strings.append("if (" + varname + ") free(" + varname + ");")
+            return strings
+        if borrowed and self.IsFixedArray():
+            return strings
         if member != "":
             if not in_array:
                 varname += ".member_" + str(member)
@@ -232,10 +243,10 @@ class DBusSignature:
                     subfree = x.CFree(varname, str(self.subs.index(x)))
                     for y in subfree:
                         strings.append(y)
-            if self.IsArray() or self.signature == "v":
+            if self.IsArray():
                 strings.append("if (" + varname + ") free(" + varname + ");");
         elif self.signature == "v":
-                strings.append("if (" + varname + ") free(" + varname + ");");
+                strings.append("cdbus_variant_free(&" + varname + ");");
         return strings;
 
     def CPack(self, direction, varname, member = "", iterator="iter", in_array=False):
@@ -251,13 +262,17 @@ class DBusSignature:
             if self.signature == "s":
                 strings.append("dbus_message_iter_append_basic(&" + iterator + ", " + self.DBusType() + ", " + param + " ? &" + param + " : &null_string)")
             elif self.signature == "v":
-                strings.append("cdbus_pack_" + varname + "_variant(&" + iterator + ", " + param + ", " + param + "_dbus_type)")
+                if member != "" or direction == "out":
+                    param = "&" + param
+                strings.append("cdbus_variant_pack(&" + iterator + ", " + param + ")")
             else:
                 strings.append("dbus_message_iter_append_basic(&" + iterator + ", " + self.DBusType() + ", &" + param + ")")
-        if self.IsArray():
+        if self.bulk:
+            strings.append("cdbus_bulk_pack(&" + iterator + ", " + param + ", " + param + "_len)")
+        elif self.IsArray():
             strings.append("cdbus_pack_" + varname + "_array(&" + iterator + ", " + param + ", " + param + "_len)")
         if self.IsStruct(): 
-            if member != "":
+            if member != "" or direction == "out":
                 param = "&" + param;
             strings.append("cdbus_pack_" + varname + "_struct(&" + iterator + ", " + param + ")")
                 
@@ -265,6 +280,8 @@ class DBusSignature:
 
     def CPackFunctions(self, varname):
         strings = []
+        if self.bulk:
+            return strings
         for sub in self.subs:
             if self.IsArray():
                 functions = sub.CPackFunctions(varname)
@@ -273,34 +290,14 @@ class DBusSignature:
             for func in functions:
                     strings.append(func)
 
-        if self.signature == "v":
-            strings.append(self.CPackVariantFunction(varname))
         if self.IsStruct():
             strings.append(self.CPackStructFunction(varname))
-        if self.IsArray():
+        if self.IsFixedArray():
+            strings.append(self.CPackFixedArrayFunction(varname))
+        elif self.IsArray():
             strings.append(self.CPackArrayFunction(varname))
         return strings
 
-    def CPackVariantFunction(self, varname):
-        string = "int cdbus_pack_" + varname + "_variant(DBusMessageIter *iter, " + self.CVarProto("in", varname) + ")\n"
-        string += "{\n"
-        string += "\tDBusMessageIter sub_iter;\n"
-        string += "\tchar signature[2];\n"
-        string += "\tif (!dbus_type_is_basic(" + varname + "_dbus_type)) return -1;\n"
-        string += "\tsignature[0] = " + varname + "_dbus_type;\n"
-        string += "\tsignature[1] = 0;\n"
-        string += "\tdbus_message_iter_open_container(iter, " + self.DBusType() + ", signature, &sub_iter);\n"
-        string += "\tif (" + varname + "_dbus_type == 's') {"
-        string += "\t\tdbus_message_iter_append_basic(&sub_iter, " + varname + "_dbus_type, &" + varname +");\n"
-        string += "\t} else {"
-        string += "\t\tdbus_message_iter_append_basic(&sub_iter, " + varname + "_dbus_type, " + varname +");\n"
-        string += "\t}"
-        string += "\tdbus_message_iter_close_container(iter, &sub_iter);\n"
-        string += "\treturn 0;\n"
-        string += "}\n"
-        return string
-
-
     def CPackStructFunction(self, varname):
         string = "int cdbus_pack_" + varname + "_struct(DBusMessageIter *iter, " + self.CVarProto("in", varname) + ")\n"
         string += "{\n"
@@ -330,7 +327,18 @@ class DBusSignature:
         return string
 
 
-    def CUnpack(self, direction, varname, member = "", iterator="iter", in_array=False):
+    def CPackFixedArrayFunction(self, varname):
+        string = "int cdbus_pack_" + varname + "_array(DBusMessageIter *iter, " + self.CVarProto("in", varname) + ")\n"
+        string += "{\n"
+        string += "\tDBusMessageIter sub_iter;\n"
+        string += "\tdbus_message_iter_open_container(iter, " + self.DBusType() + ", \"" + self.SubSignature() + "\", &sub_iter);\n"
+        string += "\tdbus_message_iter_append_fixed_array(&sub_iter, " + self.subs[0].DBusType() + ", &" + varname + ", " + varname + "_len);\n"
+        string += "\tdbus_message_iter_close_container(iter, &sub_iter);\n"
+        string += "\treturn 0;\n"
+        string += "}\n"
+        return string
+
+    def CUnpack(self, direction, varname, member = "", iterator="iter", in_array=False, arena="arena"):
         strings = []
         if direction == "out":
             param = varname
@@ -344,7 +352,7 @@ class DBusSignature:
                 param = "&((*" + param + ")" + "[" + str(member) + "])"
         strings.append("if (dbus_message_iter_get_arg_type(&" + iterator + ") == " + self.DBusType() + ") {");
         if self.signature == "v":
-            strings.append("\tcdbus_unpack_" + varname + "_variant(&" + iterator + ", " + param + ", " + param + "_dbus_type);")
+            strings.append("\tcdbus_variant_unpack(&" + iterator + ", " + arena + ", " + param + ");")
 
         elif self.IsPrimitive():
             strings.append("#if (DBUS_MAJOR_VERSION >= 1) && (DBUS_MINOR_VERSION >= 6)")
@@ -375,16 +383,24 @@ class DBusSignature:
             strings.append("#else")
             strings.append("\tdbus_message_iter_get_basic(&" + iterator + ", " + param +");")
             strings.append("#endif")
-        if self.IsArray():
+        if self.bulk:
+            strings.append("\tcdbus_bulk_unpack(&" + iterator + ", (void **)" + param + ", " + param + "_len);")
+        elif self.IsFixedArray() and (direction == "out" or member != ""):
+            strings.append("\tcdbus_unpack_" + varname + "_array_copy(&" + iterator + ", " + arena + ", " + param + ", " + param + "_len);")
+        elif self.IsFixedArray():
             strings.append("\tcdbus_unpack_" + varname + "_array(&" + iterator + ", " + param + ", " + param + "_len);")
+        elif self.IsArray():
+            strings.append("\tcdbus_unpack_" + varname + "_array(&" + iterator + ", " + arena + ", " + param + ", " + param + "_len);")
         if self.IsStruct():
-            strings.append("\tcdbus_unpack_" + varname + "_struct(&" + iterator + ", " + param + ");")
+            strings.append("\tcdbus_unpack_" + varname + "_struct(&" + iterator + ", " + arena + ", " + param + ");")
         strings.append("}");
         strings.append("dbus_message_iter_next(&" + iterator + ");")
         return strings
 
     def CUnpackFunctions(self, varname):
         strings = []
+        if self.bulk:
+            return strings
         for sub in self.subs:
             if self.IsArray():
                 functions = sub.CUnpackFunctions(varname)
@@ -393,149 +409,79 @@ class DBusSignature:
             for func in functions:
                     strings.append(func)
 
-        if self.signature == "v":
-            strings.append(self.CUnpackVariantFunction(varname))
         if self.IsStruct():
             strings.append(self.CUnpackStructFunction(varname))
-        if self.IsArray():
+        if self.IsFixedArray():
+            strings.append(self.CUnpackFixedArrayFunction(varname))
+        elif self.IsArray():
             strings.append(self.CUnpackArrayFunction(varname))
         return strings
 
-    def CUnpackVariantFunction(self, varname):
-        string = "int cdbus_unpack_" + varname + "_variant(DBusMessageIter *iter, " + self.CVarProto("out", varname) + ")\n"
+    def CUnpackStructFunction(self, varname):
+        string = "int cdbus_unpack_" + varname + "_struct(DBusMessageIter *iter, struct cdbus_arena_t *arena, " + self.CVarProto("out", varname) + ")\n"
         string += "{\n"
         string += "\tDBusMessageIter sub_iter;\n"
-        string += "#if (DBUS_MAJOR_VERSION >= 1) && (DBUS_MINOR_VERSION >= 6)\n"
-        string += "\tDBusBasicValue val;\n"
-        string += "#endif\n"
         string += "\tdbus_message_iter_recurse(iter, &sub_iter);\n"
-        string += "\t*" + varname + "_dbus_type = dbus_message_iter_get_arg_type(&sub_iter);\n"
-        string += "\tif (!dbus_type_is_basic(*" + varname + "_dbus_type)) return -1;\n"
-        string += "#if (DBUS_MAJOR_VERSION >= 1) && (DBUS_MINOR_VERSION >= 6)\n"
-        string += "\tdbus_message_iter_get_basic(&sub_iter, &val);\n"
-        string += "\tswitch(*" + varname + "_dbus_type) {\n"
-        string += "\tcase DBUS_TYPE_BYTE:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(char));\n"
-        string += "\t\t**(char **)" + varname + " = val.byt;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_BOOLEAN:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int));\n"
-        string += "\t\t**(int **)" + varname + " = val.bool_val;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_INT16:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int16_t));\n"
-        string += "\t\t**(int16_t**)" + varname + " = val.i16;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UINT16:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(uint16_t));\n"
-        string += "\t\t**(uint16_t **)" + varname + " = val.u16;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_INT32:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int32_t));\n"
-        string += "\t\t**(int32_t **)" + varname + " = val.i32;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UINT32:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(uint32_t));\n"
-        string += "\t\t**(uint32_t **)" + varname + " = val.u32;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_INT64:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int64_t));\n"
-        string += "\t\t**(int64_t **)" + varname + " = val.i64;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UINT64:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(uint64_t));\n"
-        string += "\t\t**(uint64_t **)" + varname + " = val.u64;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_DOUBLE:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(double));\n"
-        string += "\t\t**(double **)" + varname + " = val.dbl;\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_STRING:\n"
-        string += "\t\t*" + varname + " = malloc(strlen(val.str)+1);\n"
-        string += "\t\tstrcpy(*(char **)" + varname + ", val.str);\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UNIX_FD:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int));\n"
-        string += "\t\t**(int **)" + varname + " = val.fd;\n"
-        string += "\t\tbreak;\n"
-        string += "\tdefault:\n"
-        string += "\t\treturn -1;\n"
-        string += "\t}\n"
-        string += "#else\n"
-        string += "\tswitch(*" + varname + "_dbus_type) {\n"
-        string += "\tcase DBUS_TYPE_BYTE:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(char));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_BOOLEAN:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_INT16:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int16_t));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UINT16:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(uint16_t));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_INT32:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int32_t));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UINT32:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(uint32_t));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_INT64:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int64_t));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UINT64:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(uint64_t));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_DOUBLE:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(double));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_STRING:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(char*));\n"
-        string += "\t\tbreak;\n"
-        string += "\tcase DBUS_TYPE_UNIX_FD:\n"
-        string += "\t\t*" + varname + " = malloc(sizeof(int));\n"
-        string += "\t\tbreak;\n"
-        string += "\tdefault:\n"
-        string += "\t\treturn -1;\n"
-        string += "\t}\n"
-        string += "\tdbus_message_iter_get_basic(&sub_iter, *" + varname + ");\n"
-        string += "#endif\n"
+        for x in self.subs:
+            string += "\t" + "\n\t".join(y for y in x.CUnpack("out", varname, str(self.subs.index(x)), "sub_iter")) + ";\n"
         string += "\treturn 0;\n"
         string += "}\n"
         return string
+        
 
-    def CUnpackStructFunction(self, varname):
-        string = "int cdbus_unpack_" + varname + "_struct(DBusMessageIter *iter, " + self.CVarProto("out", varname) + ")\n"
+    def CUnpackArrayFunction(self, varname):
+        # Single pass, the array grows geometrically and an empty array is
+        # not allocated
+        string = "int cdbus_unpack_" + varname + "_array(DBusMessageIter *iter, struct cdbus_arena_t *arena, " + self.CVarProto("out", varname) + ")\n"
         string += "{\n"
         string += "\tDBusMessageIter sub_iter;\n"
+        string += "\t" + self.CType(varname) + " array;\n"
+        string += "\tint size = 0;\n"
+        string += "\t*" + varname + " = NULL;\n"
+        string += "\t*" + varname + "_len = 0;\n"
         string += "\tdbus_message_iter_recurse(iter, &sub_iter);\n"
+        string += "\twhile (dbus_message_iter_get_arg_type(&sub_iter) != DBUS_TYPE_INVALID) {\n"
+        string += "\t\tif (*" + varname + "_len == size) {\n"
+        string += "\t\t\tsize = size ? size * 2 : 8;\n"
+        string += "\t\t\tarray = cdbus_arena_realloc(arena, *" + varname + ", sizeof(**" + varname + ") * *" + varname + "_len, sizeof(**" + varname + ") * size);\n"
+        string += "\t\t\tif (!array)\n"
+        string += "\t\t\t\treturn -1;\n"
+        string += "\t\t\t*" + varname + " = array;\n"
+        string += "\t\t}\n"
+        string += "\t\tmemset(&(*" + varname + ")[*" + varname + "_len], 0, sizeof(**" + varname + "));\n"
         for x in self.subs:
-            string += "\t" + "\n\t".join(y for y in x.CUnpack("out", varname, str(self.subs.index(x)), "sub_iter")) + ";\n"
+            string += "\t\t" + "\n\t\t".join(y for y in x.CUnpack("out", varname, "*" + varname + "_len", "sub_iter", True)) + "\n"
+        string += "\t\t(*" + varname + "_len)++;\n"
+        string += "\t}\n"
         string += "\treturn 0;\n"
         string += "}\n"
         return string
-        
 
-    def CUnpackArrayFunction(self, varname):
+    def CUnpackFixedArrayFunction(self, varname):
+        # The array is borrowed from the message, it is only valid as long
+        # as the message is
         string = "int cdbus_unpack_" + varname + "_array(DBusMessageIter *iter, " + self.CVarProto("out", varname) + ")\n"
         string += "{\n"
         string += "\tDBusMessageIter sub_iter;\n"
+        string += "\t*" + varname + " = NULL;\n"
         string += "\t*" + varname + "_len = 0;\n"
+        string += "\tif (dbus_message_iter_get_element_type(iter) != " + self.subs[0].DBusType() + ") return -1;\n"
         string += "\tdbus_message_iter_recurse(iter, &sub_iter);\n"
-        string += "\tdo {\n"
-        string += "\t\t(*" + varname + "_len)++;\n"
-        string += "\t} while(dbus_message_iter_next(&sub_iter));\n"
-        string += "\t*" + varname + " = malloc(sizeof(**" + varname + ") * (*" + varname + "_len));\n"  
-        string += "\t*" + varname + "_len = 0;\n"
-        string += "\tdbus_message_iter_recurse(iter, &sub_iter);\n"
-        string += "\twhile(1) {\n"
-        string += "\t\tint dont_stop;\n"
-        string += "\t\tdont_stop = dbus_message_iter_has_next(&sub_iter);\n"
-        for x in self.subs:
-            string += "\t\t" + "\n\t\t".join(y for y in x.CUnpack("out", varname, "(*" + varname + "_len)++", "sub_iter", True)) + "\n"
-        string += "\t\tif (!dont_stop) break;\n"
+        string += "\tdbus_message_iter_get_fixed_array(&sub_iter, " + varname + ", " + varname + "_len);\n"
+        string += "\treturn 0;\n"
+        string += "}\n"
+        string += "\n"
+        string += "int cdbus_unpack_" + varname + "_array_copy(DBusMessageIter *iter, struct cdbus_arena_t *arena, " + self.CVarProto("out", varname) + ")\n"
+        string += "{\n"
+        string += "\t" + self.CType(varname) + " array;\n"
+        string += "\tif (cdbus_unpack_" + varname + "_array(iter, &array, " + varname + "_len) < 0) return -1;\n"
+        string += "\tif (!*" + varname + "_len) return 0;\n"
+        string += "\t*" + varname + " = cdbus_arena_alloc(arena, sizeof(*array) * (*" + varname + "_len));\n"
+        string += "\tif (!*" + varname + ") {\n"
+        string += "\t\t*" + varname + "_len = 0;\n"
+        string += "\t\treturn -1;\n"
         string += "\t}\n"
+        string += "\tmemcpy(*" + varname + ", array, sizeof(*array) * (*" + varname + "_len));\n"
         string += "\treturn 0;\n"
         string += "}\n"
         return string
@@ -565,8 +511,6 @@ class DBusSignature:
             string += "\t" + sub.CType(varname + "_member_" + str(self.subs.index(sub))) + " member_" + str(self.subs.index(sub)) + ";\n"
             if sub.IsArray():
                 string += "\tint member_" +  str(self.subs.index(sub)) + "_len;\n"
-            if sub.signature == "v":
-                string += "\tint member_" +  str(self.subs.index(sub)) + "_dbus_type;\n"
         string += "};\n"
         return string
 
@@ -596,14 +540,17 @@ class DBusAttribute:
     def CVar(self):
         return self.type.CVar(self.direction, self.name)
 
-    def CUnpack(self):
-        return self.type.CUnpack(self.direction, self.name)
+    def CUnpack(self, arena="NULL"):
+        return self.type.CUnpack(self.direction, self.name, arena=arena)
 
     def CPack(self):
         return self.type.CPack(self.direction, self.name)
 
-    def CFree(self):
-        return self.type.CFree(self.name)
+    def CFree(self, borrowed=False):
+        # Borrowed variables come from the arena, it is reset at once
+        if borrowed and use_arena and not self.type.bulk:
+            return []
+        return self.type.CFree(self.name, borrowed=borrowed)
 
 class DBusMethod:
     def __init__(self, name, interface, obj, attributes):
@@ -670,14 +617,26 @@ class DBusMethod:
 
         # Unpack the variables 
         string += "\n\tDBusMessageIter iter;\n"
+        string += CArenaDeclare()
+        string += CArenaInit()
+        string += "\tCDBUS_PROBE2(proxy_begin, msg, \"" + self.interface.name + "." + self.name + "\");\n"
         string += "\tdbus_message_iter_init(msg, &iter);\n"
         for x in self.attributes:
             if x.direction == "in":
-                string += "\t" + "\n\t".join(y for y in x.CUnpack()) + "\n"
+                string += "\t" + "\n\t".join(y for y in x.CUnpack(CArenaVar())) + "\n"
+        string += "\tCDBUS_PROBE1(proxy_unpacked, msg);\n"
         string += "\n"
 
         # Call the real functions
         string += "\t" + self.CallCFunctionWithRet() + ";\n"
+        string += "\tCDBUS_PROBE2(proxy_handled, msg, ret);\n"
+        string += "\n"
+
+        # The handler took a reply token, the reply is sent later
+        string += "\tif (ret == CDBUS_REPLY_DEFERRED) {\n"
+        string += "\t\tret = 0;\n"
+        string += "\t\tgoto free;\n"
+        string += "\t}\n"
         string += "\n"
 
         string += "\tif (ret < 0) {\n"
@@ -705,7 +664,7 @@ class DBusMethod:
         string += "\t\t" + self.CallCFreeFunction() + ";\n"
         string += "\t}\n"
         string += "\tif(cnx)\n"
-        string += "\t\tdbus_connection_send(cnx, reply, NULL);\n"
+        string += "\t\tcdbus_send_reply(cnx, reply);\n"
         string += "\tdbus_message_unref(reply);\n"
 
         string += "\n"
@@ -713,13 +672,59 @@ class DBusMethod:
         # Free the allocated variables
         string += "free:\n"
         for x in self.attributes:
-            attrfree = x.CFree()
+            attrfree = x.CFree(x.direction == "in")
             if len(attrfree) != 0:
                 string += "\t" + "\n\t".join(y for y in attrfree) + "\n" 
+        string += CArenaReset()
+        string += "\tCDBUS_PROBE1(proxy_end, msg);\n"
         string += "\treturn ret;\n"
         string += "}\n"
         return string
 
+    def CReplyPrototype(self):
+        string = "int "
+        string += self.CName()
+        attributes = [x.type.CVarProto("in", x.name) for x in self.attributes if x.direction == "out"]
+        string += "_reply(struct cdbus_reply_token_t *token"
+        if attributes:
+            string += ", "
+        string += ', '.join(attributes) + ");\n"
+        string += "int "
+        string += self.CName()
+        string += "_reply_error(struct cdbus_reply_token_t *token, const char *name, const char *message);\n"
+        return string
+
+    def CReplyFunction(self):
+        string = "int "
+        string += self.CName()
+        attributes = [x.type.CVarProto("in", x.name) for x in self.attributes if x.direction == "out"]
+        string += "_reply(struct cdbus_reply_token_t *token"
+        if attributes:
+            string += ", "
+        string += ', '.join(attributes) + ")\n"
+        string += "{\n"
+        string += "\tDBusMessage * reply;\n"
+        string += "\tDBusMessageIter iter;\n"
+        string += "\n"
+        string += "\treply = cdbus_reply_new_return(token);\n"
+        string += "\tif (!reply)\n"
+        string += "\t\treturn -1;\n"
+        string += "\tdbus_message_iter_init_append(reply, &iter);\n"
+        for x in self.attributes:
+            if x.direction == "out":
+                string += "\t" + ";\n\t".join(y for y in x.type.CPack("in", x.name)) + ";\n"
+        string += "\n"
+        string += "\treturn cdbus_reply_send(token, reply);\n"
+        string += "}\n"
+        string += "\n"
+        string += "int "
+        string += self.CName()
+        string += "_reply_error(struct cdbus_reply_token_t *token, const char *name, const char *message)\n"
+        string += "{\n"
+        string += "\treturn cdbus_reply_error(token, name, message);\n"
+        string += "}\n"
+        return string
+
     def CPrototype(self):
         string = "int " 
         string += self.CName()
@@ -778,6 +783,188 @@ class DBusMethod:
         string += "}\n"
         return string
 
+    def CAsyncCallbackType(self):
+        return self.CName() + "_cb_t"
+
+    def CAsyncPrototype(self):
+        # The out arguments are given to the callback by value, they are
+        # only valid during the call
+        string = "typedef void (*" + self.CAsyncCallbackType() + ")(DBusConnection *cnx, int ret, void *data"
+        attributes = [x.type.CVarProto("in", x.name) for x in self.attributes if x.direction == "out"]
+        if attributes:
+            string += ", "
+        string += ', '.join(attributes) + ");\n"
+        string += "int "
+        string += self.CName()
+        attributes = [x.CVarProto() for x in self.attributes if x.direction == "in"]
+        string += "_call_async(DBusConnection *cnx, const char * dest, const char * object_path"
+        if attributes:
+            string += ", "
+        string += ', '.join(attributes)
+        string += ", " + self.CAsyncCallbackType() + " cb, void *data);\n"
+        string += "int "
+        string += self.CName()
+        string += "_call_batch(struct cdbus_batch_t *batch, const char * dest, const char * object_path"
+        if attributes:
+            string += ", "
+        string += ', '.join(attributes)
+        string += ", " + self.CAsyncCallbackType() + " cb, void *data);\n"
+        return string
+
+    def CAsyncNotify(self):
+        string = "struct " + self.CName() + "_async_t {\n"
+        string += "\tDBusConnection *cnx;\n"
+        string += "\t" + self.CAsyncCallbackType() + " cb;\n"
+        string += "\tvoid *data;\n"
+        string += "};\n"
+        string += "\n"
+        string += "static void " + self.CName() + "_async_reply(DBusConnection *cnx, DBusMessage *reply, void *user_data)\n"
+        string += "{\n"
+        string += "\tstruct " + self.CName() + "_async_t *async = user_data;\n"
+        string += "\tDBusMessageIter iter;\n"
+        string += CArenaDeclare()
+        string += "\tint ret = -1;\n"
+        for x in self.attributes:
+            if x.direction == "out":
+                string += "\t" + x.type.CDeclareVar("in", x.name) + ";\n"
+        string += "\n"
+
+        # Unpack the reply, an error reply is reported with ret < 0
+        string += CArenaInit()
+        string += "\tif (reply && !dbus_message_get_error_name(reply)) {\n"
+        string += "\t\tdbus_message_iter_init(reply, &iter);\n"
+        for x in self.attributes:
+            if x.direction == "out":
+                string += "\t\t" + "\n\t\t".join(y for y in x.type.CUnpack("in", x.name, arena=CArenaVar())) + "\n"
+        string += "\t\tret = 0;\n"
+        string += "\t}\n"
+        string += "\n"
+        string += "\tasync->cb(cnx, ret, async->data"
+        for x in self.attributes:
+            if x.direction == "out":
+                string += ", " + x.type.CVar("in", x.name)
+        string += ");\n"
+        string += "\n"
+
+        # Free the allocated variables
+        for x in self.attributes:
+            if x.direction == "out":
+                attrfree = x.CFree(True)
+                if len(attrfree) != 0:
+                    string += "\t" + "\n\t".join(y for y in attrfree) + "\n"
+        string += CArenaReset()
+        string += "}\n"
+        string += "\n"
+        string += "static void " + self.CName() + "_notify(DBusPendingCall *pending, void *user_data)\n"
+        string += "{\n"
+        string += "\tstruct " + self.CName() + "_async_t *async = user_data;\n"
+        string += "\tDBusMessage * reply;\n"
+        string += "\n"
+        string += "\treply = dbus_pending_call_steal_reply(pending);\n"
+        string += "\t" + self.CName() + "_async_reply(async->cnx, reply, async);\n"
+        string += "\tif (reply)\n"
+        string += "\t\tdbus_message_unref(reply);\n"
+        string += "}\n"
+        return string
+
+    def CNewCallMessage(self):
+        string = "\tmsg = dbus_message_new_method_call(dest, (object_path ? object_path :\"" + self.object.name + "\"), \"" + self.interface.name + "\", \"" + self.name + "\");\n"
+        string += "\tif (!msg) {\n"
+        string += "\t\treturn -1;\n"
+        string += "\t}\n"
+
+        # pack the variables
+        string += "\tdbus_message_iter_init_append(msg, &iter);\n"
+        for x in self.attributes:
+            if x.direction == "in":
+                string += "\t" + ";\n\t".join(y for y in x.CPack()) + ";\n"
+        string += "\n"
+
+        string += "\tasync = malloc(sizeof(*async));\n"
+        string += "\tif (!async) {\n"
+        string += "\t\tdbus_message_unref(msg);\n"
+        string += "\t\treturn -1;\n"
+        string += "\t}\n"
+        string += "\tasync->cb = cb;\n"
+        string += "\tasync->data = data;\n"
+        return string
+
+    def CAsyncFunction(self):
+        string = self.CAsyncNotify()
+        string += "\n"
+        string += "int "
+        string += self.CName()
+        string += "_call_async(DBusConnection *cnx, const char * dest, const char * object_path"
+        attributes = [x.CVarProto() for x in self.attributes if x.direction == "in"]
+        if attributes:
+            string += ", "
+        string += ', '.join(attributes)
+        string += ", " + self.CAsyncCallbackType() + " cb, void *data)\n"
+        string += "{\n"
+        string += "\tDBusMessage * msg;\n"
+        string += "\tDBusMessageIter iter;\n"
+        string += "\tDBusPendingCall * pending = NULL;\n"
+        string += "\tstruct " + self.CName() + "_async_t *async;\n"
+        string += "\n"
+        string += "\tif (!cnx || !cb)\n"
+        string += "\t\treturn -1;\n"
+        string += "\n"
+        string += self.CNewCallMessage()
+        string += "\tasync->cnx = cnx;\n"
+        string += "\n"
+
+        # The reply is handled by the main loop of the connection
+        string += "\tif (!dbus_connection_send_with_reply(cnx, msg, &pending, DBUS_TIMEOUT_USE_DEFAULT) || !pending) {\n"
+        string += "\t\tdbus_message_unref(msg);\n"
+        string += "\t\tfree(async);\n"
+        string += "\t\treturn -1;\n"
+        string += "\t}\n"
+        string += "\tdbus_message_unref(msg);\n"
+        string += "\n"
+        string += "\tif (!dbus_pending_call_set_notify(pending, " + self.CName() + "_notify, async, free)) {\n"
+        string += "\t\tdbus_pending_call_cancel(pending);\n"
+        string += "\t\tdbus_pending_call_unref(pending);\n"
+        string += "\t\tfree(async);\n"
+        string += "\t\treturn -1;\n"
+        string += "\t}\n"
+        string += "\tdbus_pending_call_unref(pending);\n"
+        string += "\n"
+        string += "\treturn 0;\n"
+        string += "}\n"
+        return string
+
+    def CBatchFunction(self):
+        string = "int "
+        string += self.CName()
+        string += "_call_batch(struct cdbus_batch_t *batch, const char * dest, const char * object_path"
+        attributes = [x.CVarProto() for x in self.attributes if x.direction == "in"]
+        if attributes:
+            string += ", "
+        string += ', '.join(attributes)
+        string += ", " + self.CAsyncCallbackType() + " cb, void *data)\n"
+        string += "{\n"
+        string += "\tDBusMessage * msg;\n"
+        string += "\tDBusMessageIter iter;\n"
+        string += "\tstruct " + self.CName() + "_async_t *async;\n"
+        string += "\n"
+        string += "\tif (!batch || !cb)\n"
+        string += "\t\treturn -1;\n"
+        string += "\n"
+        string += self.CNewCallMessage()
+        string += "\n"
+
+        # The message is sent by cdbus_batch_run
+        string += "\tif (cdbus_batch_add(batch, msg, " + self.CName() + "_async_reply, async, free) < 0) {\n"
+        string += "\t\tdbus_message_unref(msg);\n"
+        string += "\t\tfree(async);\n"
+        string += "\t\treturn -1;\n"
+        string += "\t}\n"
+        string += "\tdbus_message_unref(msg);\n"
+        string += "\n"
+        string += "\treturn 0;\n"
+        string += "}\n"
+        return string
+
     def CName(self):
         return self.interface.CName() + '_' + self.name;
 
@@ -797,11 +984,14 @@ class DBusMethod:
 
 
 class DBusSignal:
-    def __init__(self, name, interface, obj, attributes):
+    def __init__(self, name, interface, obj, attributes, coalesce=False):
         self.name = name
         self.attributes = attributes
         self.interface = interface
         self.object = obj
+        # Only the latest emission of a signal annotated with
+        # fr.sise.cdbus.Coalesce is sent by a coalescing signal queue
+        self.coalesce = coalesce
 
     def CName(self):
         string = self.interface.CName() + '_' 
@@ -847,7 +1037,10 @@ class DBusSignal:
             string += "\t" + ";\n\t".join(y for y in x.CPack()) + ";\n"
         string += "\n"
         string += "\tif (cnx)\n"
-        string += "\t\tdbus_connection_send(cnx, msg, NULL);\n"
+        if self.coalesce:
+            string += "\t\tcdbus_send_signal_coalesced(cnx, msg);\n"
+        else:
+            string += "\t\tcdbus_send_signal(cnx, msg);\n"
         string += "\tdbus_message_unref(msg);\n"
 
         string += "\n"
@@ -895,14 +1088,19 @@ class DBusSignal:
 
         # Unpack the variables 
         string += "\n\tDBusMessageIter iter;\n"
+        string += CArenaDeclare()
+        string += CArenaInit()
+        string += "\tCDBUS_PROBE2(proxy_begin, msg, \"" + self.interface.name + "." + self.name + "\");\n"
         string += "\tdbus_message_iter_init(msg, &iter);\n"
         for x in self.attributes:
             if x.direction == "in":
-                string += "\t" + "\n\t".join(y for y in x.CUnpack()) + "\n"
+                string += "\t" + "\n\t".join(y for y in x.CUnpack(CArenaVar())) + "\n"
+        string += "\tCDBUS_PROBE1(proxy_unpacked, msg);\n"
         string += "\n"
 
         # Call the real functions
         string += "\t" + self.CallCFunctionWithRet() + ";\n"
+        string += "\tCDBUS_PROBE2(proxy_handled, msg, ret);\n"
         string += "\n"
 
         string += "\tif (ret < 0) {\n"
@@ -919,9 +1117,11 @@ class DBusSignal:
         # Free the allocated variables
         string += "free:\n"
         for x in self.attributes:
-            attrfree = x.CFree()
+            attrfree = x.CFree(x.direction == "in")
             if len(attrfree) != 0:
                 string += "\t" + ";\n\t".join(y for y in attrfree) + ";\n" 
+        string += CArenaReset()
+        string += "\tCDBUS_PROBE1(proxy_end, msg);\n"
         string += "\treturn ret;\n"
         string += "}\n"
         return string
@@ -941,11 +1141,291 @@ class DBusSignal:
     def CTableName(self):
         return self.CName() + "_signal_table"
 
+class DBusProperty:
+    def __init__(self, name, interface, obj, signature, access, emits):
+        self.name = name
+        self.interface = interface
+        self.object = obj
+        self.access = access
+        self.emits = emits
+        self.attribute = DBusAttribute(interface.CName() + '_' + name, signature, "in")
+
+    def IsReadable(self):
+        return self.access in ["read", "readwrite"]
+
+    def IsWritable(self):
+        return self.access in ["write", "readwrite"]
+
+    def CName(self):
+        return self.interface.CName() + "_" + self.name
+
+    def CAccess(self):
+        flags = []
+        if self.IsReadable():
+            flags.append("CDBUS_PROPERTY_READ")
+        if self.IsWritable():
+            flags.append("CDBUS_PROPERTY_WRITE")
+        return " | ".join(flags) if flags else "0"
+
+    def CEmits(self):
+        if self.emits == "invalidates":
+            return "CDBUS_PROPERTY_EMITS_INVALIDATES"
+        if self.emits in ["false", "const"]:
+            return "CDBUS_PROPERTY_EMITS_NONE"
+        return "CDBUS_PROPERTY_EMITS_CHANGED"
+
+    def Xml(self):
+        # Must generate the same data as generate_property_xml in libcdbus.c
+        string = "\t\"<property name=\\\"" + self.name + "\\\" type=\\\"" + self.attribute.type.DBusSignature() + "\\\" access=\\\"" + self.access + "\\\""
+        if self.CEmits() == "CDBUS_PROPERTY_EMITS_CHANGED":
+            return string + " />\"\n"
+        value = "invalidates" if self.emits == "invalidates" else "false"
+        string += ">\"\n"
+        string += "\t\"<annotation name=\\\"org.freedesktop.DBus.Property.EmitsChangedSignal\\\" value=\\\"" + value + "\\\" />\"\n"
+        string += "\t\"</property>\"\n"
+        return string
+
+    def CFunctionPointer(self):
+        return "int (*" + self.name + ")(DBusConnection *cnx, DBusMessage *msg, void *data, " + self.attribute.CVarProto() + ");"
+
+    def CSetProxyName(self):
+        return self.CName() + "_set_proxy"
+
+    def CSetProxyPrototype(self):
+        if not self.IsWritable():
+            return ""
+        return "int " + self.CSetProxyName() + "(DBusConnection *cnx, DBusMessage *msg, DBusMessageIter *iter, void *data);\n"
+
+    def CSetProxy(self):
+        # Called by libcdbus on a Set call, iter is in the variant. The
+        # value is cached by libcdbus if the handler accepts it
+        attr = self.attribute
+        ops = self.interface.CPropertiesOps()
+        string = "int " + self.CSetProxyName() + "(DBusConnection *cnx, DBusMessage *msg, DBusMessageIter *iter, void *data)\n"
+        string += "{\n"
+        string += "\tint ret = 0;\n"
+        string += "\t" + attr.CDeclareVar() + ";\n"
+        string += "\tDBusMessageIter value_iter = *iter;\n"
+        string += CArenaDeclare()
+        string += CArenaInit()
+        string += "\t" + "\n\t".join(attr.type.CUnpack("in", attr.name, iterator="value_iter", arena=CArenaVar())) + "\n"
+        string += "\n"
+        string += "\tif (" + ops + "." + self.name + ")\n"
+        string += "\t\tret = " + ops + "." + self.name + "(cnx, msg, data, " + attr.CVar() + ");\n"
+        string += "\n"
+        attrfree = attr.CFree(True)
+        if attrfree:
+            string += "\t" + "\n\t".join(attrfree) + "\n"
+        string += CArenaReset()
+        string += "\treturn ret;\n"
+        string += "}\n"
+        return string
+
+    def CPrototype(self):
+        attr = self.attribute
+        string = "int " + self.CName() + "_update(DBusConnection *cnx, const char * object_path, " + attr.CVarProto() + ");\n"
+        if self.IsReadable():
+            string += "int " + self.CName() + "_get(DBusConnection *cnx, const char * dest, const char * object_path, " + attr.type.CVarProto("out", attr.name) + ");\n"
+        if self.IsWritable():
+            string += "int " + self.CName() + "_set(DBusConnection *cnx, const char * dest, const char * object_path, " + attr.CVarProto() + ");\n"
+        return string
+
+    def CPackVariant(self, iterator):
+        # Pack the value as a variant in iterator
+        attr = self.attribute
+        string = "\tdbus_message_iter_open_container(&" + iterator + ", DBUS_TYPE_VARIANT, \"" + attr.type.DBusSignature() + "\", &value_iter);\n"
+        string += "\t" + ";\n\t".join(attr.type.CPack("in", attr.name, iterator="value_iter")) + ";\n"
+        string += "\tdbus_message_iter_close_container(&" + iterator + ", &value_iter);\n"
+        return string
+
+    def CUpdateFunction(self):
+        # Server side: cache the new value of the property of the object
+        attr = self.attribute
+        string = "int " + self.CName() + "_update(DBusConnection *cnx, const char * object_path, " + attr.CVarProto() + ")\n"
+        string += "{\n"
+        string += "\tDBusMessage * value;\n"
+        string += "\tDBusMessageIter iter, value_iter;\n"
+        string += "\tint ret;\n"
+        string += "\n"
+        string += "\tvalue = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);\n"
+        string += "\tif (!value)\n"
+        string += "\t\treturn -1;\n"
+        string += "\tdbus_message_iter_init_append(value, &iter);\n"
+        string += self.CPackVariant("iter")
+        string += "\n"
+        string += "\tret = cdbus_property_update(cnx, (object_path ? object_path : \"" + self.object.name + "\"), \"" + self.interface.name + "\", \"" + self.name + "\", value);\n"
+        string += "\tdbus_message_unref(value);\n"
+        string += "\treturn ret;\n"
+        string += "}\n"
+        return string
+
+    def CNewCallMessage(self, member):
+        string = "\tmsg = dbus_message_new_method_call(dest, (object_path ? object_path :\"" + self.object.name + "\"), DBUS_INTERFACE_PROPERTIES, \"" + member + "\");\n"
+        string += "\tif (!msg)\n"
+        string += "\t\treturn -1;\n"
+        string += "\tdbus_message_iter_init_append(msg, &iter);\n"
+        string += "\tdbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);\n"
+        string += "\tdbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &name);\n"
+        return string
+
+    def CCallReply(self):
+        string = "\tif (cnx)\n"
+        string += "\t\treply = dbus_connection_send_with_reply_and_block(cnx, msg, DBUS_TIMEOUT_USE_DEFAULT, NULL);\n"
+        string += "\tdbus_message_unref(msg);\n"
+        string += "\tif (!reply)\n"
+        string += "\t\treturn -1;\n"
+        string += "\tif (dbus_message_get_error_name(reply)) {\n"
+        string += "\t\tdbus_message_unref(reply);\n"
+        string += "\t\treturn -1;\n"
+        string += "\t}\n"
+        return string
+
+    def CGetFunction(self):
+        # Client side: Get call of the property
+        attr = self.attribute
+        string = "int " + self.CName() + "_get(DBusConnection *cnx, const char * dest, const char * object_path, " + attr.type.CVarProto("out", attr.name) + ")\n"
+        string += "{\n"
+        string += "\tDBusMessage * msg, * reply = NULL;\n"
+        string += "\tDBusMessageIter iter, value_iter;\n"
+        string += "\tconst char * interface = \"" + self.interface.name + "\";\n"
+        string += "\tconst char * name = \"" + self.name + "\";\n"
+        string += "\tint ret = -1;\n"
+        string += "\n"
+        string += self.CNewCallMessage("Get")
+        string += "\n"
+        string += self.CCallReply()
+        string += "\n"
+        string += "\tdbus_message_iter_init(reply, &iter);\n"
+        string += "\tif (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT) {\n"
+        string += "\t\tdbus_message_iter_recurse(&iter, &value_iter);\n"
+        string += "\t\t" + "\n\t\t".join(attr.type.CUnpack("out", attr.name, iterator="value_iter", arena="NULL")) + "\n"
+        string += "\t\tret = 0;\n"
+        string += "\t}\n"
+        string += "\tdbus_message_unref(reply);\n"
+        string += "\treturn ret;\n"
+        string += "}\n"
+        return string
+
+    def CSetFunction(self):
+        # Client side: Set call of the property
+        attr = self.attribute
+        string = "int " + self.CName() + "_set(DBusConnection *cnx, const char * dest, const char * object_path, " + attr.CVarProto() + ")\n"
+        string += "{\n"
+        string += "\tDBusMessage * msg, * reply = NULL;\n"
+        string += "\tDBusMessageIter iter, value_iter;\n"
+        string += "\tconst char * interface = \"" + self.interface.name + "\";\n"
+        string += "\tconst char * name = \"" + self.name + "\";\n"
+        string += "\n"
+        string += self.CNewCallMessage("Set")
+        string += self.CPackVariant("iter")
+        string += "\n"
+        string += self.CCallReply()
+        string += "\tdbus_message_unref(reply);\n"
+        string += "\treturn 0;\n"
+        string += "}\n"
+        return string
+
+    def CFunction(self):
+        string = self.CUpdateFunction() + "\n"
+        if self.IsReadable():
+            string += self.CGetFunction() + "\n"
+        if self.IsWritable():
+            string += self.CSetFunction() + "\n"
+            string += self.CSetProxy() + "\n"
+        return string
+
+    def CTableEntry(self):
+        proxy = self.CSetProxyName() if self.IsWritable() else "NULL"
+        return "\t{\"" + self.name + "\", \"" + self.attribute.type.DBusSignature() + "\", " + self.CAccess() + ", " + self.CEmits() + ", " + proxy + "},\n"
+
+def CArenaDeclare():
+    if not use_arena:
+        return ""
+    return "\tstruct cdbus_arena_t arena;\n"
+
+def CArenaInit():
+    if not use_arena:
+        return ""
+    return "\tcdbus_arena_init(&arena);\n"
+
+def CArenaVar():
+    if not use_arena:
+        return "NULL"
+    return "&arena"
+
+def CArenaReset():
+    if not use_arena:
+        return ""
+    return "\tcdbus_arena_reset(&arena);\n"
+
+def CdbusHash(string, seed):
+    # FNV-1a hash, must be kept in sync with libcdbus.c
+    h = (2166136261 ^ seed) & 0xffffffff
+    for c in string.encode():
+        h ^= c
+        h = (h * 16777619) & 0xffffffff
+    h ^= h >> 16
+    return h
+
+class DBusPerfectHash:
+    def __init__(self, name, keys):
+        self.name = name
+        # The first entry wins when a key is duplicated, like the linear scan
+        self.keys = {}
+        for key in keys:
+            if key not in self.keys:
+                self.keys[key] = keys.index(key)
+        size = 1
+        while size < len(self.keys):
+            size *= 2
+        while not self.Build(size):
+            size *= 2
+
+    def Build(self, size):
+        nbuckets = max(1, size // 2)
+        buckets = [[] for i in range(nbuckets)]
+        for key in self.keys:
+            buckets[CdbusHash(key, 0) & (nbuckets - 1)].append(key)
+        slots = [-1] * size
+        disp = [0] * nbuckets
+        # Place the biggest buckets first, while there are many free slots
+        for bucket in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+            keys = buckets[bucket]
+            if not keys:
+                break
+            for seed in range(1, 4096):
+                positions = [CdbusHash(key, seed) & (size - 1) for key in keys]
+                if len(set(positions)) != len(positions):
+                    continue
+                if any(slots[pos] != -1 for pos in positions):
+                    continue
+                for (key, pos) in zip(keys, positions):
+                    slots[pos] = self.keys[key]
+                disp[bucket] = seed
+                break
+            else:
+                return False
+        self.slots = slots
+        self.disp = disp
+        return True
+
+    def CName(self):
+        return self.name
+
+    def CDeclaration(self):
+        string = "static const unsigned short " + self.CName() + "_disp[] = { " + ", ".join(str(x) for x in self.disp) + " };\n"
+        string += "static const short " + self.CName() + "_slots[] = { " + ", ".join(str(x) for x in self.slots) + " };\n"
+        string += "static const struct cdbus_hash_t " + self.CName() + " = {\n"
+        string += "\t" + str(len(self.slots) - 1) + ", " + str(len(self.disp) - 1) + ", " + self.CName() + "_disp, " + self.CName() + "_slots\n"
+        string += "};\n"
+        return string
+
 class DBusInterface:
     def __init__(self,name):
         self.name = name
         self.methods = {}
         self.signals = {}
+        self.properties = {}
 
     def AddMethod(self, method):
         self.methods[method.name] = method
@@ -953,6 +1433,12 @@ class DBusInterface:
     def AddSignal(self, signal):
         self.signals[signal.name] = signal
 
+    def AddProperty(self, prop):
+        self.properties[prop.name] = prop
+
+    def WritableProperties(self):
+        return [prop for prop in self.properties.values() if prop.IsWritable()]
+
     def CName(self):
         return self.name.replace('.', '_')
 
@@ -998,19 +1484,88 @@ class DBusInterface:
         string += "};\n"
         return string;
 
+    def CPropertiesOps(self):
+        return self.CName() + "_properties_ops"
+
+    def CPropertiesOpsPrototype(self):
+        # Handlers of the Set calls, only the writable properties have one
+        if not self.WritableProperties():
+            return ""
+        string = "extern struct "
+        string += self.CPropertiesOps() + " {\n";
+        for prop in self.WritableProperties():
+            string += "\t" + prop.CFunctionPointer() + "\n"
+        string += "} " + self.CPropertiesOps() + ";\n"
+        return string
+
+    def CPropertiesOpsDefaultValue(self):
+        if not self.WritableProperties():
+            return ""
+        string = "struct " + self.CPropertiesOps() + " " + self.CPropertiesOps() + ' __attribute__((weak)) = {\n'
+        for prop in self.WritableProperties():
+            string += "\t." + prop.name + " = NULL,\n"
+        string += "};\n"
+        return string;
+
+    def CHash(self):
+        keys = [name for name in self.methods] + [name for name in self.signals]
+        return DBusPerfectHash(self.CName() + "_interface_hash", keys)
+
+    def CXml(self):
+        # Must generate the same data as generate_interface_xml in libcdbus.c
+        def CMessageXml(kind, name, attributes):
+            string = "\t\"<" + kind + " name=\\\"" + name + "\\\">\"\n"
+            for attr in attributes:
+                string += "\t\"<arg name=\\\"" + attr.name + "\\\" type=\\\"" + attr.type.DBusSignature() + "\\\" direction=\\\"" + attr.direction + "\\\" />\"\n"
+            string += "\t\"</" + kind + ">\"\n"
+            return string
+        string = "static const char " + self.CXmlName() + "[] =\n"
+        string += "\t\"<interface name=\\\"" + self.name + "\\\">\"\n"
+        for (name, method) in self.methods.items():
+            string += CMessageXml("method", name, method.attributes)
+        for (name, signal) in self.signals.items():
+            string += CMessageXml("signal", name, signal.attributes)
+        for prop in self.properties.values():
+            string += prop.Xml()
+        string += "\t\"</interface>\";\n"
+        return string
+
+    def CXmlName(self):
+        return self.CName() + "_interface_xml"
+
     def CTable(self):
-        string = "struct cdbus_message_entry_t " + self.CTableName() + "[] = {\n"
+        string = "static struct cdbus_member_stats_t " + self.CStatsName() + "[" + str(max(1, len(self.methods) + len(self.signals))) + "];\n"
+        string += "struct cdbus_message_entry_t " + self.CTableName() + "[] = {\n"
+        index = 0
         for (name, method) in self.methods.items():
-            string += "\t{0, \"" + name + "\", " + method.CProxyName() + ", " + method.CTableName() + "},\n"
+            string += "\t{0, \"" + name + "\", " + method.CProxyName() + ", " + method.CTableName() + ", &" + self.CStatsName() + "[" + str(index) + "]},\n"
+            index += 1
         for (name, signal) in self.signals.items():
-            string += "\t{1, \"" + name + "\", " + signal.CProxyName() + ", " + signal.CTableName() +"},\n"
-        string += "\t{0, NULL, NULL, NULL},\n"
+            string += "\t{1, \"" + name + "\", " + signal.CProxyName() + ", " + signal.CTableName() + ", &" + self.CStatsName() + "[" + str(index) + "]},\n"
+            index += 1
+        string += "\t{0, NULL, NULL, NULL, NULL},\n"
         string += "};\n"
+        string += self.CHash().CDeclaration()
+        string += self.CXml()
+        if self.properties:
+            string += "struct cdbus_property_entry_t " + self.CPropertyTableName() + "[] = {\n"
+            for prop in self.properties.values():
+                string += prop.CTableEntry()
+            string += "\t{NULL, NULL, 0, 0, NULL},\n"
+            string += "};\n"
         return string
 
     def CTableName(self):
         return self.CName() + "_interface_table"
 
+    def CStatsName(self):
+        return self.CName() + "_stats"
+
+    def CPropertyTableName(self):
+        if not self.properties:
+            return "NULL"
+        return self.CName() + "_property_table"
+
 class DBusObject:
     def __init__(self,name):
         self.interfaces = {}
@@ -1028,10 +1583,15 @@ class DBusObject:
     def CTableHeader(self):
         return "extern struct cdbus_interface_entry_t " + self.CName() + "_object_table[];\n"
 
+    def CHash(self):
+        return DBusPerfectHash(self.CName() + "_object_hash", [key for key in self.interfaces])
+
     def CTable(self):
-        string = "struct cdbus_interface_entry_t " + self.CName() + "_object_table[] = {\n"
-        string += "\t" + ",\n\t".join("{\"" + key + "\", " + self.interfaces[key].CTableName() + "}"  for key in self.interfaces) + ",\n"
-        string += "\t{NULL, NULL},\n"
+        objhash = self.CHash()
+        string = objhash.CDeclaration()
+        string += "struct cdbus_interface_entry_t " + self.CName() + "_object_table[] = {\n"
+        string += "\t" + ",\n\t".join("{\"" + key + "\", " + self.interfaces[key].CTableName() + ", &" + self.interfaces[key].CHash().CName() + ", &" + objhash.CName() + ", " + self.interfaces[key].CXmlName() + ", " + self.interfaces[key].CPropertyTableName() + "}"  for key in self.interfaces) + ",\n"
+        string += "\t{NULL, NULL, NULL, NULL, NULL, NULL},\n"
         string += "};\n"
         return string
 
@@ -1046,6 +1606,7 @@ class DBusObject:
         string += "#ifndef __" + self.CName().upper() + "_H\n"
         string += "#define __" + self.CName().upper() + "_H\n"
         string += "\n"
+        string += "#include <stdint.h>\n"
         string += "#include \"libcdbus.h\"\n"
         string += "\n"
         string += "/* Generated types */\n"
@@ -1059,6 +1620,9 @@ class DBusObject:
                 for attr in msg.attributes:
                     for typestring in attr.type.CTypeDef(attr.name):
                         string += typestring
+            for prop in itf.properties.values():
+                for typestring in prop.attribute.type.CTypeDef(prop.attribute.name):
+                    string += typestring
         string += "\n"
         string += "/* Functions implemented by the library user */\n"
         string += "\n"
@@ -1066,14 +1630,33 @@ class DBusObject:
             string += itf.CMethodsOpsPrototype()
             string += "\n";
             string += itf.CSignalsOpsPrototype()
+            string += itf.CPropertiesOpsPrototype()
         string += "\n"
         string += "/* Public functions */\n"
         string += "\n"
         for itf in self.interfaces.values():
             for msg in itf.methods.values():
                 string += msg.CPrototype()
+                string += msg.CAsyncPrototype()
+                string += msg.CReplyPrototype()
             for msg in itf.signals.values():
                 string += msg.CPrototype()
+            for prop in itf.properties.values():
+                string += prop.CPrototype()
+        string += "\n"
+        string += "/* Packing of the arguments, to append them to a message built by hand */\n"
+        string += "\n"
+        for itf in self.interfaces.values():
+            attrs = []
+            for msg in itf.methods.values():
+                attrs += msg.attributes
+            for msg in itf.signals.values():
+                attrs += msg.attributes
+            for prop in itf.properties.values():
+                attrs.append(prop.attribute)
+            for attr in attrs:
+                for funcstring in attr.type.CPackFunctions(attr.name):
+                    string += funcstring.split("\n")[0] + ";\n"
         string += "\n"
         string += "/* Private declarations, you should don't have to touch it */\n"
         string += "\n"
@@ -1082,6 +1665,8 @@ class DBusObject:
                 string += msg.CProxyPrototype()
             for msg in itf.signals.values():
                 string += msg.CProxyPrototype()
+            for prop in itf.properties.values():
+                string += prop.CSetProxyPrototype()
             string += "\n"
         for itf in self.interfaces.values():
             for msg in itf.methods.values():
@@ -1090,6 +1675,8 @@ class DBusObject:
                 string += msg.CTableHeader();
             string += "\n"
             string += itf.CTableHeader()
+            if itf.properties:
+                string += "extern struct cdbus_property_entry_t " + itf.CPropertyTableName() + "[];\n"
         string += self.CTableHeader()
         string += "#endif"
         return string
@@ -1107,6 +1694,7 @@ class DBusObject:
             string += itf.CMethodsOpsDefaultValue()
             string += "\n";
             string += itf.CSignalsOpsDefaultValue()
+            string += itf.CPropertiesOpsDefaultValue()
         string += "\n"
         string += "\n"
         for itf in self.interfaces.values():
@@ -1131,35 +1719,54 @@ class DBusObject:
                         string += funcstring + "\n"
                     for funcstring in attr.type.CPackFunctions(attr.name):
                         string += funcstring + "\n"
+            for prop in itf.properties.values():
+                attr = prop.attribute
+                for funcstring in attr.type.CUnpackFunctions(attr.name):
+                    string += funcstring + "\n"
+                for funcstring in attr.type.CPackFunctions(attr.name):
+                    string += funcstring + "\n"
 
         for itf in self.interfaces.values():
             for msg in itf.methods.values():
                 string += msg.CProxy() + "\n"
                 string += msg.CFunction() + "\n"
+                string += msg.CAsyncFunction() + "\n"
+                string += msg.CBatchFunction() + "\n"
+                string += msg.CReplyFunction() + "\n"
             for msg in itf.signals.values():
                 string += msg.CProxy() + "\n"
                 string += msg.CFunction() + "\n"
+            for prop in itf.properties.values():
+                string += prop.CFunction()
 
         return string
 
 objects = {}
+use_arena = False
 
 current_node = ""
 current_interface = ""
 current_method = ""
 current_signal = ""
+current_signal_coalesce = False
 current_args = []
+current_property = None
+in_arg = False
+in_signal = False
 
 def args2attribute(method, args, force_direction_in=False):
     attributes = []
     for arg in args:
+        signature = DBusSignature(arg['type'])
+        if arg.get('bulk') and arg['type'] == "ay":
+            signature.bulk = True
         if force_direction_in:
             attributes.append(DBusAttribute(method + '_' + arg['name'],
-                                            DBusSignature(arg['type']),
+                                            signature,
                                             "in"))
         else:
             attributes.append(DBusAttribute(method + '_' + arg['name'],
-                                            DBusSignature(arg['type']),
+                                            signature,
                                             arg['direction']))
 
     return attributes
@@ -1174,15 +1781,27 @@ def add_method():
 
 def add_signal():
     global current_interface, current_node, objects
-    global current_signal, current_args
+    global current_signal, current_signal_coalesce, current_args
     dbusinterface = objects[current_node].Interface(current_interface)
     attributes = args2attribute(dbusinterface.CName() + '_'  + current_signal, current_args, True)
-    signal = DBusSignal(current_signal, dbusinterface, objects[current_node], attributes)
+    signal = DBusSignal(current_signal, dbusinterface, objects[current_node], attributes,
+                        current_signal_coalesce)
     dbusinterface.AddSignal(signal)
-    
+
+def add_property():
+    global current_interface, current_node, objects
+    global current_property
+    dbusinterface = objects[current_node].Interface(current_interface)
+    prop = DBusProperty(current_property['name'], dbusinterface, objects[current_node],
+                        DBusSignature(current_property['type']),
+                        current_property.get('access', "read"),
+                        current_property.get('emits', "true"))
+    dbusinterface.AddProperty(prop)
+
 def start_element_handler(name, attr):
     global current_interface, current_node, objects
-    global current_method, current_signal, current_args
+    global current_method, current_signal, current_args, in_arg
+    global current_property, current_signal_coalesce, in_signal
     if name == "node":
         current_node = attr['name']
         dbusobject = DBusObject(attr['name'])
@@ -1197,15 +1816,35 @@ def start_element_handler(name, attr):
     if name == "signal":
         current_args = []
         current_signal = attr['name']
+        current_signal_coalesce = False
+        in_signal = True
     if name == "arg":
-        current_args.append(attr)
+        current_args.append(dict(attr))
+        in_arg = True
+    if name == "property":
+        current_property = dict(attr)
+    if name == "annotation" and in_arg:
+        if attr['name'] == "fr.sise.cdbus.Bulk" and attr['value'] == "true":
+            current_args[-1]['bulk'] = True
+    elif name == "annotation" and current_property:
+        if attr['name'] == "org.freedesktop.DBus.Property.EmitsChangedSignal":
+            current_property['emits'] = attr['value']
+    elif name == "annotation" and in_signal:
+        if attr['name'] == "fr.sise.cdbus.Coalesce" and attr['value'] == "true":
+            current_signal_coalesce = True
 
 def end_element_handler(name):
-    global current_node
+    global current_node, in_arg, current_property, in_signal
+    if name == "arg":
+        in_arg = False
+    if name == "property":
+        add_property()
+        current_property = None
     if name == "method":
         add_method()
     if name == "signal":
         add_signal()
+        in_signal = False
     if name == "node":
         f = open(objects[current_node].CHeaderFileName(), "w")
         f.write(objects[current_node].CHeader())
@@ -1220,17 +1859,21 @@ def usage():
     print
     print("Options:")
     print("\t-h\tthis message")
+    print("\t-a\tunpack the arguments of handlers and async callbacks in an arena")
 
 def main():
     try: 
-        opts, args = getopt.getopt(sys.argv[1:], "h", ["help"])
+        opts, args = getopt.getopt(sys.argv[1:], "ha", ["help", "arena"])
     except getopt.GetOptError as err:
         print(err)
         usage()
+    global use_arena
     for o,a in opts:
         if o == "-h":
             usage()
             exit(0)
+        if o in ("-a", "--arena"):
+            use_arena = True
     if len(args) == 0:
         usage()
         exit(1)